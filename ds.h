@@ -11,6 +11,8 @@
 // implementation of all the data structures and utilities
 // - DS_AL_IMPLEMENTATION: Define this macro in one source file to include the
 // implementation of the allocator utility and set the allocator to use
+// - DS_AL_THREAD_SAFE: Define this macro to let several threads share an
+// allocator
 // - DS_DA_IMPLEMENTATION: Define this macro in one source file to include the
 // implementation of the dynamic array data structure
 // - DS_PQ_IMPLEMENTATION: Define this macro in one source file to include the
@@ -25,8 +27,16 @@
 // implementation of the hash map data structure
 // - DS_AP_IMPLEMENTATION: Define this macro in one source file to include the
 // implementation of the ds_argument parser utility
+// - DS_RB_IMPLEMENTATION: Define this macro for the lock-free ring buffers
 // - DS_IO_IMPLEMENTATION: Define this macro for some io utils
+// - DS_TP_IMPLEMENTATION: Define this macro for the thread pool
+// - DS_IO_ZLIB: Define this macro to let the io utils read gzip input, and
+// link with -lz
+// - DS_IO_ZSTD: Define this macro to let the io utils read zstd input, and
+// link with -lzstd
 // - DS_JS_IMPLEMENTATION: Define this macro for JSON utils
+// - DS_MP_IMPLEMENTATION: Define this macro for the MessagePack codec of JSON
+// - DS_CB_IMPLEMENTATION: Define this macro for the CBOR codec of JSON
 //
 // MEMORY MANAGEMENT
 //
@@ -56,6 +66,36 @@
 // The default logging level is DS_LOG_LEVEL_DEBUG
 // - DS_NO_TERMINAL_COLORS: Disables the use of terminal colors in the log
 // messages
+//
+// Each message is written with a single call to fprintf, so the messages of
+// different threads do not mix within a line.
+//
+// THREAD SAFETY
+//
+// A data structure can be read by any number of threads at the same time as
+// long as no thread changes it. Reading includes the lookups in hash maps,
+// iterating over their entries, and for JSON Objects all the dump functions,
+// json_object_memory_stats and the binary and MessagePack/CBOR encoders, none
+// of which write to the object. The same goes for the values of a
+// json_binary. A loaded JSON Object can therefore be dumped by worker threads
+// without a lock once it is built.
+//
+// The JSON finders, json_object_map_find, json_object_array_find and
+// json_path_find, only read: they return const items and leave the clones and
+// the source text kept by keep_source alone, so any number of threads can look
+// up the same object. The JSON getters, json_object_map_get,
+// json_object_array_get and json_path_get, return items that the caller may
+// change. They unshare the cloned containers they pass through and forget the
+// kept source text, so they count as changes.
+// json_object_clone is safe on a shared object, because it only changes the
+// reference count with atomic operations; give each thread its own clone, and
+// call json_object_unshare before changing it.
+//
+// Changing a data structure needs the only access to it. The allocator follows
+// the same rule unless DS_AL_THREAD_SAFE is defined; to parse on several
+// threads without a lock between them, give each thread its own allocator with
+// ds_allocator_set_thread_default. The ring buffers and the thread pool are
+// made to be shared, and the io stream is shared with its reader thread only.
 
 #ifndef DS_H
 #define DS_H
@@ -70,6 +110,8 @@
 
 // BASIC UTILS
 
+#include <stddef.h>
+
 typedef int bool;
 const bool true = 1;
 const bool false = 0;
@@ -79,15 +121,26 @@ const bool false = 0;
 // The allocator is a simple utility to allocate and free memory. You can define
 // the allocator to use when allocating and freeing memory. This can be used in
 // all the other data structures and utilities to use a custom allocator.
+//
+// An allocator belongs to one thread at a time, unless DS_AL_THREAD_SAFE is
+// defined, in which case alloc and free take a lock and an allocator can be
+// shared. A NULL allocator stands for the default allocator of the calling
+// thread, which is how the utilities that do not take an allocator (the JSON
+// loader for example) can parse into a separate arena on each thread. The
+// threads started by a thread pool or a stream use the default allocator of
+// the thread that started them, so that allocator needs DS_AL_THREAD_SAFE.
 typedef struct ds_allocator {
         unsigned char *start;
         unsigned char *prev;
         unsigned char *top;
         unsigned long int size;
+        int lock; /* only used with DS_AL_THREAD_SAFE */
 } ds_allocator;
 
 DSHDEF void ds_allocator_init(ds_allocator *allocator, unsigned char *start,
                               unsigned long int size);
+DSHDEF ds_allocator *ds_allocator_set_thread_default(ds_allocator *allocator);
+DSHDEF ds_allocator *ds_allocator_get_thread_default(void);
 DSHDEF void ds_allocator_dump(ds_allocator *allocator);
 DSHDEF void *ds_allocator_alloc(ds_allocator *allocator, unsigned long int size);
 DSHDEF void ds_allocator_free(ds_allocator *allocator, void *ptr);
@@ -102,30 +155,36 @@ DSHDEF void ds_allocator_free(ds_allocator *allocator, void *ptr);
 typedef struct ds_dynamic_array {
         struct ds_allocator *allocator;
         void *items;
-        unsigned int item_size;
-        unsigned int count;
-        unsigned int capacity;
+        size_t item_size;
+        size_t count;
+        size_t capacity;
 } ds_dynamic_array;
 
 DSHDEF void ds_dynamic_array_init_allocator(ds_dynamic_array *da,
-                                            unsigned int item_size,
+                                            size_t item_size,
                                             struct ds_allocator *allocator);
-DSHDEF void ds_dynamic_array_init(ds_dynamic_array *da, unsigned int item_size);
+DSHDEF void ds_dynamic_array_init(ds_dynamic_array *da, size_t item_size);
 DSHDEF int ds_dynamic_array_append(ds_dynamic_array *da, const void *item);
 DSHDEF int ds_dynamic_array_pop(ds_dynamic_array *da, const void **item);
 DSHDEF int ds_dynamic_array_append_many(ds_dynamic_array *da, void **new_items,
-                                        unsigned int new_items_count);
-DSHDEF int ds_dynamic_array_get(ds_dynamic_array *da, unsigned int index,
+                                        size_t new_items_count);
+DSHDEF int ds_dynamic_array_get(ds_dynamic_array *da, size_t index,
                                 void *item);
-DSHDEF int ds_dynamic_array_get_ref(ds_dynamic_array *da, unsigned int index,
+DSHDEF int ds_dynamic_array_get_ref(ds_dynamic_array *da, size_t index,
                                     void **item);
 DSHDEF int ds_dynamic_array_copy(ds_dynamic_array *da, ds_dynamic_array *copy);
 DSHDEF void ds_dynamic_array_sort(ds_dynamic_array *da,
                                   int (*compare)(const void *, const void *));
 DSHDEF int ds_dynamic_array_reverse(ds_dynamic_array *da);
-DSHDEF int ds_dynamic_array_swap(ds_dynamic_array *da, unsigned int index1,
-                                 unsigned int index2);
-DSHDEF int ds_dynamic_array_delete(ds_dynamic_array *da, unsigned int index);
+DSHDEF int ds_dynamic_array_swap(ds_dynamic_array *da, size_t index1,
+                                 size_t index2);
+DSHDEF int ds_dynamic_array_delete(ds_dynamic_array *da, size_t index);
+DSHDEF int ds_dynamic_array_delete_unordered(ds_dynamic_array *da,
+                                             size_t index);
+DSHDEF int ds_dynamic_array_insert(ds_dynamic_array *da, size_t index,
+                                   const void *item);
+DSHDEF int ds_dynamic_array_reserve(ds_dynamic_array *da,
+                                    size_t capacity);
 DSHDEF void ds_dynamic_array_free(ds_dynamic_array *da);
 
 // PRIORITY QUEUE
@@ -142,10 +201,10 @@ typedef struct ds_priority_queue {
 
 DSHDEF void ds_priority_queue_init_allocator(
     ds_priority_queue *pq, int (*compare)(const void *, const void *),
-    unsigned int item_size, struct ds_allocator *allocator);
+    size_t item_size, struct ds_allocator *allocator);
 DSHDEF void ds_priority_queue_init(ds_priority_queue *pq,
                                    int (*compare)(const void *, const void *),
-                                   unsigned int item_size);
+                                   size_t item_size);
 DSHDEF int ds_priority_queue_insert(ds_priority_queue *pq, void *item);
 DSHDEF int ds_priority_queue_pull(ds_priority_queue *pq, void *item);
 DSHDEF int ds_priority_queue_peek(ds_priority_queue *pq, void *item);
@@ -167,7 +226,7 @@ DSHDEF void ds_string_builder_init(ds_string_builder *sb);
 DSHDEF int ds_string_builder_append(ds_string_builder *sb, const char *format,
                                     ...);
 DSHDEF int ds_string_builder_appendn(ds_string_builder *sb, const char *str,
-                                     unsigned int len);
+                                     size_t len);
 DSHDEF int ds_string_builder_appendc(ds_string_builder *sb, char chr);
 DSHDEF int ds_string_builder_build(ds_string_builder *sb, char **str);
 DSHDEF void ds_string_builder_free(ds_string_builder *sb);
@@ -180,14 +239,14 @@ DSHDEF void ds_string_builder_free(ds_string_builder *sb);
 typedef struct ds_string_slice {
         struct ds_allocator *allocator;
         char *str;
-        unsigned int len;
+        size_t len;
 } ds_string_slice;
 
 DSHDEF void ds_string_slice_init_allocator(ds_string_slice *ss, char *str,
-                                           unsigned int len,
+                                           size_t len,
                                            struct ds_allocator *allocator);
 DSHDEF void ds_string_slice_init(ds_string_slice *ss, char *str,
-                                 unsigned int len);
+                                 size_t len);
 DSHDEF int ds_string_slice_tokenize(ds_string_slice *ss, char delimiter,
                                     ds_string_slice *token);
 DSHDEF int ds_string_slice_take_while_pred(ds_string_slice *ss, int (*predicate)(char), ds_string_slice *token);
@@ -215,15 +274,15 @@ typedef struct ds_linked_list_node {
 
 typedef struct ds_linked_list {
         struct ds_allocator *allocator;
-        unsigned int item_size;
+        size_t item_size;
         ds_linked_list_node *head;
         ds_linked_list_node *tail;
 } ds_linked_list;
 
 DSHDEF void ds_linked_list_init_allocator(ds_linked_list *ll,
-                                          unsigned int item_size,
+                                          size_t item_size,
                                           struct ds_allocator *allocator);
-DSHDEF void ds_linked_list_init(ds_linked_list *ll, unsigned int item_size);
+DSHDEF void ds_linked_list_init(ds_linked_list *ll, size_t item_size);
 DSHDEF int ds_linked_list_push_back(ds_linked_list *ll, void *item);
 DSHDEF int ds_linked_list_push_front(ds_linked_list *ll, void *item);
 DSHDEF int ds_linked_list_pop_back(ds_linked_list *ll, void *item);
@@ -234,18 +293,28 @@ DSHDEF void ds_linked_list_free(ds_linked_list *ll);
 // HASH MAP
 //
 // The hash map is a simple table that uses a hash function to store and
-// retrieve items. The hash map uses buckets to handle collisions.
+// retrieve items. The items are kept in insertion order in the entries array
+// and the slots table is an open addressing index into it, with linear
+// probing. The hash of each key is stored with the item, so the table can grow
+// without hashing the keys again. Small maps do not have a slots table and
+// are searched linearly.
 // You can define the hash and compare functions to use when inserting and
 // retrieving items.
+//
+// To iterate over the items, go over the entries array and skip the entries
+// with a NULL key, which are the deleted items.
 typedef struct ds_hashmap_kv {
     void *key;
     void *value;
+    unsigned int hash;
 } ds_hashmap_kv;
 
 typedef struct ds_hashmap {
     struct ds_allocator *allocator;
-    ds_dynamic_array *buckets; /* ds_hashmap_kv */
-    unsigned int capacity;
+    ds_dynamic_array entries; /* ds_hashmap_kv */
+    unsigned int *slots;      /* index of the entry + 1, 0 if empty */
+    unsigned int capacity;    /* number of slots, a power of two */
+    unsigned int count;       /* number of items */
     unsigned int (*hash)(const void *);
     int (*compare)(const void *, const void *);
 } ds_hashmap;
@@ -258,7 +327,10 @@ DSHDEF int ds_hashmap_init(ds_hashmap *map, unsigned int capacity,
                               unsigned int (*hash)(const void *),
                               int (*compare)(const void *, const void *));
 DSHDEF int ds_hashmap_insert(ds_hashmap *map, ds_hashmap_kv *kv);
+DSHDEF int ds_hashmap_insert_hashed(ds_hashmap *map, ds_hashmap_kv *kv);
 DSHDEF int ds_hashmap_get(ds_hashmap *map, ds_hashmap_kv *kv);
+DSHDEF int ds_hashmap_get_ref(ds_hashmap *map, const void *key,
+                              unsigned int hash, ds_hashmap_kv **kv);
 DSHDEF int ds_hashmap_delete(ds_hashmap *map, const void *key);
 DSHDEF unsigned int ds_hashmap_count(ds_hashmap *map);
 DSHDEF void ds_hashmap_free(ds_hashmap *map);
@@ -326,21 +398,249 @@ DSHDEF void ds_argparse_print_help(struct ds_argparse_parser *parser);
 DSHDEF void ds_argparse_print_version(struct ds_argparse_parser *parser);
 DSHDEF void ds_argparse_parser_free(struct ds_argparse_parser *parser);
 
+// RING BUFFERS
+//
+// Bounded queues that threads share without a lock. The ring buffer for a
+// single producer and a single consumer only needs a load and a store per
+// push or pop, and publishes a whole batch with one store. The ring buffer for
+// many producers and many consumers keeps a sequence number in each slot, as
+// described by Dmitry Vyukov, so that a push or a pop claims its slot with a
+// single compare and swap. The counters that are written by different threads
+// are kept on different cache lines. Push and pop never wait: they return the
+// number of items that fit or that were there, which can be 0.
+#ifndef DS_CACHE_LINE_SIZE
+#define DS_CACHE_LINE_SIZE 64
+#endif // DS_CACHE_LINE_SIZE
+
+typedef struct ds_spsc_ring {
+    char *items;
+    size_t item_size;
+    size_t mask; /* capacity - 1, the capacity being a power of two */
+    char pad0[DS_CACHE_LINE_SIZE];
+    size_t head;      /* written by the producer */
+    size_t tail_seen; /* the last tail read by the producer */
+    char pad1[DS_CACHE_LINE_SIZE];
+    size_t tail;      /* written by the consumer */
+    size_t head_seen; /* the last head read by the consumer */
+    char pad2[DS_CACHE_LINE_SIZE];
+} ds_spsc_ring;
+
+DSHDEF int ds_spsc_ring_init(ds_spsc_ring *ring, size_t item_size, size_t capacity);
+DSHDEF size_t ds_spsc_ring_push(ds_spsc_ring *ring, const void *items, size_t count);
+DSHDEF size_t ds_spsc_ring_pop(ds_spsc_ring *ring, void *items, size_t count);
+DSHDEF bool ds_spsc_ring_empty(ds_spsc_ring *ring);
+DSHDEF void ds_spsc_ring_free(ds_spsc_ring *ring);
+
+typedef struct ds_mpmc_ring {
+    char *slots; /* a sequence number followed by an item in each slot */
+    size_t slot_size;
+    size_t item_size;
+    size_t mask;
+    char pad0[DS_CACHE_LINE_SIZE];
+    size_t head; /* the next slot to push to */
+    char pad1[DS_CACHE_LINE_SIZE];
+    size_t tail; /* the next slot to pop from */
+    char pad2[DS_CACHE_LINE_SIZE];
+} ds_mpmc_ring;
+
+DSHDEF int ds_mpmc_ring_init(ds_mpmc_ring *ring, size_t item_size, size_t capacity);
+DSHDEF size_t ds_mpmc_ring_push(ds_mpmc_ring *ring, const void *items, size_t count);
+DSHDEF size_t ds_mpmc_ring_pop(ds_mpmc_ring *ring, void *items, size_t count);
+DSHDEF void ds_mpmc_ring_free(ds_mpmc_ring *ring);
+
 // IO
 //
 // The io utils are a simple set of utilities to read and write files.
+#include <pthread.h>
+
 #ifndef LINE_MAX
 #define LINE_MAX 4096
 #endif
 
-DSHDEF int ds_io_read(const char *filename, char **buffer, const char *mode);
-DSHDEF int ds_io_write(const char *filename, char *buffer, unsigned int buffer_len, const char *mode);
+// Zero bytes that are readable after the end of a ds_io_map buffer
+#ifndef DS_IO_MAP_PADDING
+#define DS_IO_MAP_PADDING 64
+#endif // DS_IO_MAP_PADDING
+
+// Regular files smaller than this are read into a buffer instead of mapped,
+// since a read costs fewer syscalls than setting up and tearing down a mapping
+#ifndef DS_IO_MAP_MIN_SIZE
+#define DS_IO_MAP_MIN_SIZE 65536
+#endif // DS_IO_MAP_MIN_SIZE
+
+// Number of threads used by ds_io_map_batch when none are given. Loading many
+// small files waits on syscalls more than on the CPU, so this is larger than
+// the number of cores to keep enough requests in flight.
+#ifndef DS_IO_BATCH_THREADS
+#define DS_IO_BATCH_THREADS 16
+#endif // DS_IO_BATCH_THREADS
+
+// A file in memory: mapped with mmap for regular files, or read into an
+// allocated buffer for pipes. Capacity is the size of the mapping or of the
+// allocation, including the padding.
+typedef struct ds_io_mapping {
+    char *data;
+    size_t size;
+    size_t capacity;
+    bool mapped;
+} ds_io_mapping;
+
+DSHDEF long int ds_io_read(const char *filename, char **buffer, const char *mode);
+DSHDEF long int ds_io_write(const char *filename, char *buffer, size_t buffer_len, const char *mode);
+DSHDEF int ds_io_map(const char *filename, ds_io_mapping *mapping);
+DSHDEF void ds_io_unmap(ds_io_mapping *mapping);
+
+// Called by ds_io_map_batch for each file as soon as it is loaded, on the
+// thread that loaded it. The mapping is released when the callback returns.
+// Return 0 to go on, or 1 to report a failure.
+typedef int (*ds_io_batch_callback)(size_t index, const char *filename, ds_io_mapping *mapping, void *user);
+
+DSHDEF int ds_io_map_batch(const char **filenames, size_t count, unsigned int threads, ds_io_batch_callback callback, void *user);
+
+// Size of the buffer of compressed data read ahead by a ds_io_source
+#ifndef DS_IO_SOURCE_BUFFER_SIZE
+#define DS_IO_SOURCE_BUFFER_SIZE 65536
+#endif // DS_IO_SOURCE_BUFFER_SIZE
+
+typedef enum {
+    DS_IO_FORMAT_PLAIN,
+    DS_IO_FORMAT_GZIP,
+    DS_IO_FORMAT_ZSTD
+} ds_io_format;
+
+// A file descriptor that is decompressed as it is read. The format is found
+// from the magic bytes at the start, and gzip and zstd are only recognized
+// when DS_IO_ZLIB and DS_IO_ZSTD are defined, so that without them every
+// input is read as it is.
+typedef struct ds_io_source {
+    int fd;
+    ds_io_format format;
+    bool detected;
+    bool eof;      /* the file descriptor has no more data */
+    bool finished; /* the decompressor reached the end of a frame */
+    void *state;   /* the z_stream or the ZSTD_DStream */
+    char *input;   /* data read ahead from the file descriptor */
+    size_t input_size;
+    size_t input_pos;
+    int wake;      /* a pipe that cancels the reads when written, or -1 */
+    const char *error; /* why the input could not be decompressed, or NULL */
+} ds_io_source;
+
+DSHDEF void ds_io_source_init(ds_io_source *source, int fd);
+DSHDEF long int ds_io_source_read(ds_io_source *source, char *buffer, size_t size);
+DSHDEF void ds_io_source_free(ds_io_source *source);
+
+// Number and size of the buffers of a ds_io_stream
+#ifndef DS_IO_STREAM_BUFFERS
+#define DS_IO_STREAM_BUFFERS 4
+#endif // DS_IO_STREAM_BUFFERS
+
+#ifndef DS_IO_STREAM_BUFFER_SIZE
+#define DS_IO_STREAM_BUFFER_SIZE (1 << 20)
+#endif // DS_IO_STREAM_BUFFER_SIZE
+
+typedef struct ds_io_stream_buffer {
+    char *data;
+    size_t size;
+} ds_io_stream_buffer;
+
+// A file read ahead by a thread into a set of buffers, so that the reads
+// overlap with the work done on the data. The buffers go around two single
+// producer and single consumer rings: the reader takes empty buffers from one
+// and hands them over filled in the other, and the caller gives them back
+// when it is done with them. The lock is only taken to sleep when the ring
+// that one side takes from is empty.
+typedef struct ds_io_stream {
+    ds_io_source source;
+    char *data;                  /* the buffers, one after the other */
+    ds_spsc_ring empty;          /* buffers given back by the caller */
+    ds_spsc_ring filled;         /* buffers filled by the reader */
+    ds_io_stream_buffer current; /* the buffer that the caller holds */
+    bool done;
+    bool stop;
+    int error;
+    bool reader_waiting;
+    bool caller_waiting;
+    int cancel[2];               /* the pipe that cancels a blocked read */
+    ds_allocator *allocator;     /* the default allocator of the reader */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+} ds_io_stream;
+
+DSHDEF int ds_io_stream_open(ds_io_stream *stream, int fd);
+DSHDEF int ds_io_stream_next(ds_io_stream *stream, char **data, size_t *size);
+DSHDEF void ds_io_stream_release(ds_io_stream *stream);
+DSHDEF void ds_io_stream_close(ds_io_stream *stream);
+
+// THREAD POOL
+//
+// A fixed set of threads that run tasks. Each thread has its own lock-free
+// queue of tasks: it runs the oldest task of its own queue, and when that is
+// empty it steals from the queue of another thread, so the threads stay busy
+// when the tasks take different times. The tasks submitted from outside the
+// pool are spread over the queues in turn, and the tasks submitted by a task
+// go to the queue of the thread that runs it. When all the queues are full
+// the task runs right away on the thread that submits it. The lock of the
+// pool is only taken to sleep and to wake up sleeping threads.
+#ifndef DS_THREAD_POOL_QUEUE_SIZE
+#define DS_THREAD_POOL_QUEUE_SIZE 1024
+#endif // DS_THREAD_POOL_QUEUE_SIZE
+
+typedef void (*ds_thread_pool_task)(void *arg);
+
+typedef struct ds_thread_pool_job {
+    ds_thread_pool_task task;
+    void *arg;
+} ds_thread_pool_job;
+
+typedef struct ds_thread_pool_queue {
+    struct ds_thread_pool *pool;
+    ds_mpmc_ring jobs;
+} ds_thread_pool_queue;
+
+typedef struct ds_thread_pool {
+    unsigned int count;
+    pthread_t *threads;
+    ds_thread_pool_queue *queues;
+    size_t next;           /* the queue of the next task submitted from outside */
+    long int queued;       /* tasks in the queues, below zero for a moment when
+                              a task is taken before its submit has counted it */
+    size_t pending;        /* tasks submitted and not finished */
+    unsigned int sleeping; /* threads that wait for work */
+    bool stop;
+    ds_allocator *allocator; /* the default allocator of the threads */
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+} ds_thread_pool;
+
+DSHDEF int ds_thread_pool_init(ds_thread_pool *pool, unsigned int threads);
+DSHDEF int ds_thread_pool_submit(ds_thread_pool *pool, ds_thread_pool_task task, void *arg);
+DSHDEF void ds_thread_pool_wait(ds_thread_pool *pool);
+DSHDEF void ds_thread_pool_free(ds_thread_pool *pool);
 
 // JSON
 //
 // Json loader from string. This utility will load a string into a JSON Object
 // data structure. The allowed json objects are mappings, arrays, string,
 // numbers, null or boolean.
+//
+// Strings, arrays and maps can be shared between JSON Objects using
+// json_object_clone. A shared object is copied on write: the functions that
+// change an object, and the getters that return a reference into a container,
+// first copy one level of the tree with json_object_unshare and keep sharing
+// the children. A change made through the reference of a getter therefore
+// never reaches the other clones.
+//
+// When loaded with keep_source, each value also remembers the text it was
+// parsed from. A minified dump copies that text as it is for the values that
+// did not change, instead of writing them again. The values changed with the
+// functions of this module forget their text, and so do the containers that a
+// getter returns a reference into, since the reference can be used to change
+// them; so the text of a value is only kept while nothing below it can have
+// changed. Call json_object_touch after changing the fields of a value
+// directly.
 
 typedef enum {
     JSON_OBJECT_STRING,
@@ -360,20 +660,293 @@ typedef struct json_object {
         ds_dynamic_array array; /* json_object */
         ds_hashmap map; /* <char* , json_object> */
     };
+    unsigned int *refcount; /* NULL if the object is not shared */
+    const char *source; /* text the value was loaded from, NULL if unknown */
+    size_t source_len;
 } json_object;
 
-DSHDEF int json_object_load(char *buffer, unsigned int buffer_len, json_object *object);
+// Memory usage of a loaded JSON Object, split by category. The used field is
+// the number of bytes that hold data and the reserved field is the number of
+// bytes that are allocated for it (for example array capacity that is not used
+// yet).
+typedef struct json_memory_usage {
+    size_t used;
+    size_t reserved;
+} json_memory_usage;
+
+typedef struct json_memory_stats {
+    json_memory_usage nodes;   /* root and map value nodes, reference counters */
+    json_memory_usage strings; /* string values and map keys */
+    json_memory_usage buckets; /* map entries and hash slots */
+    json_memory_usage arrays;  /* array items storage including slack */
+    json_memory_usage total;
+    size_t allocations;
+} json_memory_stats;
+
+// Options of json_object_dump_with_options. A minified output has no
+// whitespace at all, a pretty output has one item per line indented by indent
+// spaces. The keys of maps are written in insertion order, sorted by their
+// bytes, or sorted by their UTF-16 code units as RFC 8785 does. Numbers are
+// written in their shortest round-trip form when precision is negative, or
+// with precision digits after the decimal point. With ascii_only the
+// characters outside of ASCII are written as \uXXXX escapes. With exact_size
+// the length of the output is computed first, so that it is written into a
+// single allocation of the exact size. With threads greater than 1 the
+// containers with at least JSON_OBJECT_DUMP_PARALLEL_MIN items are split in
+// chunks that are written on pool, a started thread pool, or when pool is NULL
+// on a pool of that many threads started for the dump. With canonical the
+// output is the RFC 8785 canonical form: minified, without a trailing newline,
+// with the keys in the canonical order and the numbers as ECMAScript writes
+// them. A canonical dump fails on NaN and infinite numbers, which have no
+// canonical form.
+typedef enum {
+    JSON_DUMP_KEYS_INSERTION,
+    JSON_DUMP_KEYS_SORTED,
+    JSON_DUMP_KEYS_CANONICAL
+} json_dump_key_order;
+
+typedef struct json_dump_options {
+    bool minified;
+    unsigned int indent;
+    bool trailing_newline;
+    json_dump_key_order key_order;
+    int precision;
+    bool ascii_only;
+    bool exact_size;
+    unsigned int threads;
+    ds_thread_pool *pool;
+    bool canonical;
+} json_dump_options;
+
+// Options of json_object_load_with_options. With keep_source the values point
+// into the buffer, which must outlive the JSON Object.
+typedef struct json_load_options {
+    bool keep_source;
+} json_load_options;
+
+DSHDEF int json_object_load(char *buffer, size_t buffer_len, json_object *object);
+DSHDEF int json_object_load_with_options(char *buffer, size_t buffer_len, const json_load_options *options, json_object *object);
 DSHDEF int json_object_dump(json_object *object, char **buffer);
+DSHDEF void json_dump_options_init(json_dump_options *options);
+DSHDEF int json_object_dump_with_options(json_object *object, const json_dump_options *options, char **buffer);
+DSHDEF int json_object_dump_size(json_object *object, const json_dump_options *options, size_t *size);
+DSHDEF int json_object_dump_to(json_object *object, const json_dump_options *options, char *buffer, size_t size, size_t *written);
+DSHDEF int json_object_dump_fd(json_object *object, const json_dump_options *options, int fd);
+DSHDEF int json_object_dump_file(json_object *object, const json_dump_options *options, const char *filename);
 DSHDEF int json_object_debug(json_object *object);
+DSHDEF int json_object_memory_stats(json_object *object, json_memory_stats *stats);
+DSHDEF int json_object_clone(json_object *object, json_object *clone);
+DSHDEF int json_object_unshare(json_object *object);
+DSHDEF void json_object_touch(json_object *object);
 DSHDEF int json_object_free(json_object *object);
 
+// Build and edit JSON Objects in place. The setters take ownership of the
+// given value, and the finders and the getters return references into the
+// container that are valid until the container is changed.
+DSHDEF int json_object_init_string(json_object *object, const char *string);
+DSHDEF void json_object_init_number(json_object *object, double number);
+DSHDEF void json_object_init_boolean(json_object *object, bool boolean);
+DSHDEF void json_object_init_null(json_object *object);
+DSHDEF void json_object_init_array(json_object *object);
+DSHDEF int json_object_init_map(json_object *object);
+DSHDEF int json_object_map_find(const json_object *object, const char *key, const json_object **value);
+DSHDEF int json_object_map_get(json_object *object, const char *key, json_object **value);
+DSHDEF int json_object_map_set(json_object *object, const char *key, json_object *value);
+DSHDEF int json_object_map_remove(json_object *object, const char *key);
+DSHDEF int json_object_array_find(const json_object *object, size_t index, const json_object **item);
+DSHDEF int json_object_array_get(json_object *object, size_t index, json_object **item);
+DSHDEF int json_object_array_push(json_object *object, json_object *item);
+DSHDEF int json_object_array_insert(json_object *object, size_t index, json_object *item);
+DSHDEF int json_object_array_remove(json_object *object, size_t index);
+
+// JSON PATH
+//
+// A compiled path to a value inside a JSON Object, for example "a.b[3].c" or
+// "a[\"key.with.dots\"]". The path keeps the length and the hash of each key
+// so that it can be evaluated on many objects without hashing the keys again.
+typedef enum {
+    JSON_PATH_KEY,
+    JSON_PATH_INDEX
+} json_path_segment_kind;
+
+typedef struct json_path_segment {
+    json_path_segment_kind kind;
+    const char *key;
+    size_t len;
+    unsigned int hash;
+    size_t index;
+} json_path_segment;
+
+typedef struct json_path {
+    char *buffer;
+    ds_dynamic_array segments; /* json_path_segment */
+} json_path;
+
+DSHDEF int json_path_compile(const char *path, json_path *compiled);
+DSHDEF int json_path_find(const json_path *path, const json_object *object, const json_object **value);
+DSHDEF int json_path_get(json_path *path, json_object *object, json_object **value);
+DSHDEF void json_path_free(json_path *path);
+
+// JSON WRITER
+//
+// Write JSON directly to a buffer or a file descriptor without building a JSON
+// Object first. The writer keeps a small stack with the state of each open
+// container and checks that the calls are nested correctly: keys are only
+// written inside objects and are followed by a value, containers are closed in
+// the order they were opened, and there is a single root value.
+#ifndef JSON_WRITER_MAX_DEPTH
+#define JSON_WRITER_MAX_DEPTH 128
+#endif // JSON_WRITER_MAX_DEPTH
+
+// Output buffer of the JSON writers. Bytes are appended directly into a single
+// growable buffer that is always kept NUL terminated, so that it can be handed
+// to the caller without a copy. When flush is set the buffer has a fixed
+// capacity instead, and it is written to fd each time it fills; a negative fd
+// only counts the bytes. When fixed is set the buffer belongs to the caller
+// and running out of space is an error.
+typedef struct json_buffer {
+    char *data;
+    size_t count;
+    size_t capacity;
+    bool flush;
+    bool fixed;
+    int fd;
+    size_t flushed; /* bytes flushed so far */
+} json_buffer;
+
+typedef struct json_writer {
+    json_buffer buffer;
+    json_dump_options options;
+    unsigned char stack[JSON_WRITER_MAX_DEPTH + 1];
+    unsigned int depth;
+} json_writer;
+
+DSHDEF int json_writer_init(json_writer *writer, const json_dump_options *options);
+DSHDEF int json_writer_init_fd(json_writer *writer, const json_dump_options *options, int fd);
+DSHDEF int json_writer_begin_object(json_writer *writer);
+DSHDEF int json_writer_end_object(json_writer *writer);
+DSHDEF int json_writer_begin_array(json_writer *writer);
+DSHDEF int json_writer_end_array(json_writer *writer);
+DSHDEF int json_writer_key(json_writer *writer, const char *key);
+DSHDEF int json_writer_string(json_writer *writer, const char *string);
+DSHDEF int json_writer_number(json_writer *writer, double number);
+DSHDEF int json_writer_boolean(json_writer *writer, bool boolean);
+DSHDEF int json_writer_null(json_writer *writer);
+DSHDEF int json_writer_value(json_writer *writer, json_object *object);
+DSHDEF int json_writer_finish(json_writer *writer, char **buffer);
+DSHDEF void json_writer_free(json_writer *writer);
+
+// JSON BINARY
+//
+// A binary form of a JSON Object that can be used in place, without parsing.
+// The file starts with a header of JSON_BINARY_HEADER_SIZE bytes: the magic
+// JSON_BINARY_MAGIC, the version, the offset of the root value and the size
+// of the file. Each value starts at an offset that is a multiple of 8 with its
+// kind and a count, followed by its payload:
+// - strings: count bytes and a NUL terminator
+// - numbers: the double
+// - booleans: no payload, the count is the value
+// - arrays: the offsets of the count items
+// - maps: count pairs of key and value offsets, sorted by the bytes of the
+//   keys, which are string values
+//
+// The offsets and the numbers are in the byte order of the machine that wrote
+// the file, and the file is limited to 4 GiB. A json_binary is opened with
+// mmap, or uses a buffer owned by the caller. The values are checked when they
+// are reached, so a damaged file fails the lookup instead of reading outside
+// of the buffer.
+#define JSON_BINARY_MAGIC "JSNB"
+#define JSON_BINARY_VERSION 1
+#define JSON_BINARY_HEADER_SIZE 16
+
+typedef struct json_binary {
+    const char *data;
+    size_t size;     /* the size written in the header */
+    size_t capacity; /* the length of the mapping */
+    bool mapped;
+} json_binary;
+
+typedef struct json_binary_value {
+    const json_binary *binary;
+    json_object_kind kind;
+    unsigned int count;
+    const char *payload;
+} json_binary_value;
+
+DSHDEF int json_object_dump_binary(json_object *object, char **buffer, size_t *size);
+DSHDEF int json_object_dump_binary_file(json_object *object, const char *filename);
+DSHDEF int json_binary_init(json_binary *binary, const char *data, size_t size);
+DSHDEF int json_binary_open(json_binary *binary, const char *filename);
+DSHDEF void json_binary_close(json_binary *binary);
+DSHDEF int json_binary_root(const json_binary *binary, json_binary_value *value);
+DSHDEF int json_binary_string(const json_binary_value *value, const char **string, unsigned int *len);
+DSHDEF int json_binary_number(const json_binary_value *value, double *number);
+DSHDEF int json_binary_boolean(const json_binary_value *value, bool *boolean);
+DSHDEF unsigned int json_binary_count(const json_binary_value *value);
+DSHDEF int json_binary_array_get(const json_binary_value *value, unsigned int index, json_binary_value *item);
+DSHDEF int json_binary_map_get(const json_binary_value *value, const char *key, json_binary_value *item);
+DSHDEF int json_binary_map_entry(const json_binary_value *value, unsigned int index, const char **key, json_binary_value *item);
+DSHDEF int json_binary_to_object(const json_binary_value *value, json_object *object);
+
+// MESSAGEPACK AND CBOR
+//
+// Encode JSON Objects as MessagePack or CBOR and decode them back, without
+// going through the text form. The encoders write through the same buffers as
+// the JSON dump, into memory or to a file descriptor. The implementation is
+// included with DS_MP_IMPLEMENTATION for MessagePack and DS_CB_IMPLEMENTATION
+// for CBOR. As with the text form, the decoders reject strings that hold a NUL
+// byte.
+#ifndef JSON_DECODE_MAX_DEPTH
+#define JSON_DECODE_MAX_DEPTH 512
+#endif // JSON_DECODE_MAX_DEPTH
+
+DSHDEF int json_object_dump_msgpack(json_object *object, char **buffer, size_t *size);
+DSHDEF int json_object_dump_msgpack_fd(json_object *object, int fd);
+DSHDEF int json_object_load_msgpack(const char *buffer, size_t size, json_object *object);
+DSHDEF int json_object_dump_cbor(json_object *object, char **buffer, size_t *size);
+DSHDEF int json_object_dump_cbor_fd(json_object *object, int fd);
+DSHDEF int json_object_load_cbor(const char *buffer, size_t size, json_object *object);
+
 #ifndef JSON_OBJECT_DUMP_INDENT
 #define JSON_OBJECT_DUMP_INDENT 2
 #endif // JSON_OBJECT_DUMP_INDENT
 
-#ifndef JSON_OBJECT_MAP_MAX_CAPACITY
-#define JSON_OBJECT_MAP_MAX_CAPACITY 100
-#endif // JSON_OBJECT_MAP_MAX_CAPACITY
+// Digits after the decimal point of dumped numbers. A negative precision
+// writes the shortest representation that reads back to the same value.
+#ifndef JSON_OBJECT_DUMP_PRECISION
+#define JSON_OBJECT_DUMP_PRECISION -1
+#endif // JSON_OBJECT_DUMP_PRECISION
+
+#ifndef JSON_OBJECT_DUMP_FD_BUFFER_SIZE
+#define JSON_OBJECT_DUMP_FD_BUFFER_SIZE 65536
+#endif // JSON_OBJECT_DUMP_FD_BUFFER_SIZE
+
+#ifndef JSON_OBJECT_DUMP_PARALLEL_MIN
+#define JSON_OBJECT_DUMP_PARALLEL_MIN 4096
+#endif // JSON_OBJECT_DUMP_PARALLEL_MIN
+
+// Chunks per thread of a parallel dump, more chunks balance the work better
+#ifndef JSON_OBJECT_DUMP_PARALLEL_CHUNKS
+#define JSON_OBJECT_DUMP_PARALLEL_CHUNKS 4
+#endif // JSON_OBJECT_DUMP_PARALLEL_CHUNKS
+
+// Bytes of finished chunks that a parallel dump holds before they are
+// appended in order. No chunk is started while more than this is held.
+#ifndef JSON_OBJECT_DUMP_PARALLEL_BYTES
+#define JSON_OBJECT_DUMP_PARALLEL_BYTES (16 * 1024 * 1024)
+#endif // JSON_OBJECT_DUMP_PARALLEL_BYTES
+
+#ifndef JSON_BUFFER_INIT_CAPACITY
+#define JSON_BUFFER_INIT_CAPACITY 4096
+#endif // JSON_BUFFER_INIT_CAPACITY
+
+#ifndef JSON_OBJECT_MAP_INIT_CAPACITY
+#define JSON_OBJECT_MAP_INIT_CAPACITY 4
+#endif // JSON_OBJECT_MAP_INIT_CAPACITY
+
+#ifndef JSON_OBJECT_ARRAY_INIT_CAPACITY
+#define JSON_OBJECT_ARRAY_INIT_CAPACITY 4
+#endif // JSON_OBJECT_ARRAY_INIT_CAPACITY
 
 // RETURN DEFER
 //
@@ -412,6 +985,25 @@ DSHDEF int json_object_free(json_object *object);
     } while (0)
 #endif
 
+#if defined(DS_MEMMOVE)
+// ok
+#elif !defined(DS_MEMMOVE) && !defined(DS_NO_STDLIB)
+#define DS_MEMMOVE(dst, src, sz) memmove(dst, src, sz)
+#elif defined(DS_NO_STDLIB)
+#define DS_MEMMOVE(dst, src, sz)                                               \
+    do {                                                                       \
+        if ((char *)dst < (char *)src) {                                       \
+            for (unsigned int i = 0; i < sz; i++) {                            \
+                ((char *)dst)[i] = ((char *)src)[i];                           \
+            }                                                                  \
+        } else {                                                               \
+            for (unsigned int i = sz; i > 0; i--) {                            \
+                ((char *)dst)[i - 1] = ((char *)src)[i - 1];                   \
+            }                                                                  \
+        }                                                                      \
+    } while (0)
+#endif
+
 #if defined(DS_MEMCMP)
 // ok
 #elif !defined(DS_MEMCMP) && !defined(DS_NO_STDLIB)
@@ -450,8 +1042,8 @@ DSHDEF int json_object_free(json_object *object);
 #endif
 
 #ifndef DS_REALLOC
-static inline void *ds_realloc(void *a, void *ptr, unsigned int old_sz,
-                               unsigned int new_sz) {
+static inline void *ds_realloc(void *a, void *ptr, size_t old_sz,
+                               size_t new_sz) {
     void *new_ptr = DS_MALLOC(a, new_sz);
     if (new_ptr == NULL) {
         DS_FREE(a, ptr);
@@ -580,7 +1172,7 @@ static inline void *ds_realloc(void *a, void *ptr, unsigned int old_sz,
 #define ds_da_append(da, item)                                                 \
     do {                                                                       \
         if ((da)->count >= (da)->capacity) {                                   \
-            unsigned int new_capacity = (da)->capacity * 2;                    \
+            size_t new_capacity = (da)->capacity * 2;                          \
             if (new_capacity == 0) {                                           \
                 new_capacity = DS_DA_INIT_CAPACITY;                            \
             }                                                                  \
@@ -632,14 +1224,40 @@ static inline void *ds_realloc(void *a, void *ptr, unsigned int old_sz,
 #define DS_LL_IMPLEMENTATION
 #define DS_HM_IMPLEMENTATION
 #define DS_AP_IMPLEMENTATION
+#define DS_RB_IMPLEMENTATION
 #define DS_IO_IMPLEMENTATION
+#define DS_TP_IMPLEMENTATION
 #define DS_JS_IMPLEMENTATION
+#define DS_MP_IMPLEMENTATION
+#define DS_CB_IMPLEMENTATION
 #endif // DS_IMPLEMENTATION
 
+#ifdef DS_MP_IMPLEMENTATION
+#define DS_JS_IMPLEMENTATION
+#endif // DS_MP_IMPLEMENTATION
+
+#ifdef DS_CB_IMPLEMENTATION
+#define DS_JS_IMPLEMENTATION
+#endif // DS_CB_IMPLEMENTATION
+
+#ifdef DS_JS_IMPLEMENTATION
+#define DS_TP_IMPLEMENTATION
+#endif // DS_JS_IMPLEMENTATION
+
 #ifdef DS_PQ_IMPLEMENTATION
 #define DS_DA_IMPLEMENTATION
 #endif // DS_PQ_IMPLEMENTATION
 
+#ifdef DS_IO_IMPLEMENTATION
+#define DS_SB_IMPLEMENTATION
+#define DS_RB_IMPLEMENTATION
+#define DS_TP_IMPLEMENTATION
+#endif // DS_IO_IMPLEMENTATION
+
+#ifdef DS_TP_IMPLEMENTATION
+#define DS_RB_IMPLEMENTATION
+#endif // DS_TP_IMPLEMENTATION
+
 #ifdef DS_SB_IMPLEMENTATION
 #define DS_DA_IMPLEMENTATION
 #endif // DS_SB_IMPLEMENTATION
@@ -652,10 +1270,6 @@ static inline void *ds_realloc(void *a, void *ptr, unsigned int old_sz,
 #define DS_DA_IMPLEMENTATION
 #endif // DS_AP_IMPLEMENTATION
 
-#ifdef DS_IO_IMPLEMENTATION
-#define DS_SB_IMPLEMENTATION
-#endif // DS_IO_IMPLEMENTATION
-
 #ifdef DS_JS_IMPLEMENTATION
 #define DS_DA_IMPLEMENTATION
 #define DS_SB_IMPLEMENTATION
@@ -665,6 +1279,10 @@ static inline void *ds_realloc(void *a, void *ptr, unsigned int old_sz,
 
 #ifdef DS_AL_IMPLEMENTATION
 
+#ifdef DS_AL_THREAD_SAFE
+#include <sched.h>
+#endif // DS_AL_THREAD_SAFE
+
 static void uint64_read_le(unsigned char *data, unsigned long int *value) {
     *value = ((unsigned long int)data[0] << 0) | ((unsigned long int)data[1] << 8) |
              ((unsigned long int)data[2] << 16) | ((unsigned long int)data[3] << 24) |
@@ -724,6 +1342,35 @@ static void block_write(unsigned char *data, block_t *block) {
     uint32_write_le(data + 24, block->free);
 }
 
+// The allocator used by the calling thread for a NULL allocator
+static __thread ds_allocator *ds_allocator_thread_default = NULL;
+
+static ds_allocator *allocator_resolve(ds_allocator *allocator) {
+    return (allocator != NULL) ? allocator : ds_allocator_thread_default;
+}
+
+// A spin lock that gives up the CPU while it waits, so that a thread holding
+// it that was preempted can finish
+static void allocator_lock(ds_allocator *allocator) {
+#ifdef DS_AL_THREAD_SAFE
+    while (__atomic_exchange_n(&allocator->lock, 1, __ATOMIC_ACQUIRE) != 0) {
+        while (__atomic_load_n(&allocator->lock, __ATOMIC_RELAXED) != 0) {
+            sched_yield();
+        }
+    }
+#else
+    (void)allocator;
+#endif
+}
+
+static void allocator_unlock(ds_allocator *allocator) {
+#ifdef DS_AL_THREAD_SAFE
+    __atomic_store_n(&allocator->lock, 0, __ATOMIC_RELEASE);
+#else
+    (void)allocator;
+#endif
+}
+
 // Initialize the allocator
 //
 // The start parameter is the start of the memory block to allocate from, and
@@ -734,6 +1381,25 @@ DSHDEF void ds_allocator_init(ds_allocator *allocator, unsigned char *start,
     allocator->prev = NULL;
     allocator->top = start;
     allocator->size = size;
+    allocator->lock = 0;
+}
+
+// Set the default allocator of the calling thread
+//
+// The allocator is used for the calls that pass a NULL allocator on this
+// thread, so that each thread can allocate from its own arena without a lock.
+// Passing NULL removes the default allocator.
+//
+// Returns the previous default allocator of the thread
+DSHDEF ds_allocator *ds_allocator_set_thread_default(ds_allocator *allocator) {
+    ds_allocator *previous = ds_allocator_thread_default;
+    ds_allocator_thread_default = allocator;
+    return previous;
+}
+
+// Get the default allocator of the calling thread, or NULL if it has none
+DSHDEF ds_allocator *ds_allocator_get_thread_default(void) {
+    return ds_allocator_thread_default;
 }
 
 // Dump the allocator to stdout
@@ -797,13 +1463,17 @@ static int allocator_find_block(ds_allocator *allocator, unsigned long int size,
 
             block_write(ptr, block);
 
-            block_t next = {0};
-            block_read(allocator->start + old_next, &next);
+            if (old_next != BLOCK_INDEX_UNDEFINED) {
+                block_t next = {0};
+                block_read(allocator->start + old_next, &next);
 
-            next.prev =
-                (unsigned long int)(ptr - allocator->start) + BLOCK_METADATA_SIZE + size;
+                next.prev =
+                    (unsigned long int)(ptr - allocator->start) + BLOCK_METADATA_SIZE + size;
 
-            block_write(allocator->start + old_next, &next);
+                block_write(allocator->start + old_next, &next);
+            } else {
+                allocator->prev = ptr + BLOCK_METADATA_SIZE + size;
+            }
 
             return 1;
         }
@@ -825,17 +1495,26 @@ static int allocator_find_block(ds_allocator *allocator, unsigned long int size,
 
 // Allocate memory from the allocator
 //
-// This function allocates memory from the allocator. If the allocator is unable
-// to allocate the memory, it returns NULL.
+// This function allocates memory from the allocator, or from the default
+// allocator of the thread if allocator is NULL. If the allocator is unable to
+// allocate the memory, it returns NULL.
 DSHDEF void *ds_allocator_alloc(ds_allocator *allocator, unsigned long int size) {
+    void *result = NULL;
     block_t block = {0};
+
+    allocator = allocator_resolve(allocator);
+    if (allocator == NULL) {
+        return NULL;
+    }
+    allocator_lock(allocator);
+
     if (allocator_find_block(allocator, size, &block) != 0) {
-        return block.data;
+        return_defer(block.data);
     }
 
     if (allocator->top + size + BLOCK_METADATA_SIZE >
         allocator->start + allocator->size) {
-        return NULL;
+        return_defer(NULL);
     }
 
     block.next = BLOCK_INDEX_UNDEFINED;
@@ -859,16 +1538,32 @@ DSHDEF void *ds_allocator_alloc(ds_allocator *allocator, unsigned long int size)
 
     allocator->prev = allocator->top;
     allocator->top += size + BLOCK_METADATA_SIZE;
+    result = block.data;
 
-    return block.data;
+defer:
+    allocator_unlock(allocator);
+    return result;
 }
 
 // Free memory from the allocator
 //
-// This function frees memory from the allocator. If the pointer is not within
-// the bounds of the allocator, it does nothing.
+// This function frees memory from the allocator, or from the default allocator
+// of the thread if allocator is NULL. A NULL pointer is ignored. A pointer that
+// is not within the bounds of the allocator is reported and not freed, since
+// it was allocated by another allocator.
 DSHDEF void ds_allocator_free(ds_allocator *allocator, void *ptr) {
-    if ((unsigned char *)ptr > allocator->top || (unsigned char *)ptr < allocator->start) {
+    if (ptr == NULL) {
+        return;
+    }
+    allocator = allocator_resolve(allocator);
+    if (allocator == NULL) {
+        DS_LOG_ERROR("Failed to free %p: the thread has no default allocator", ptr);
+        return;
+    }
+    allocator_lock(allocator);
+    if ((unsigned char *)ptr >= allocator->top || (unsigned char *)ptr < allocator->start + BLOCK_METADATA_SIZE) {
+        allocator_unlock(allocator);
+        DS_LOG_ERROR("Failed to free %p: it does not belong to the allocator", ptr);
         return;
     }
 
@@ -886,12 +1581,16 @@ DSHDEF void ds_allocator_free(ds_allocator *allocator, void *ptr) {
 
             unsigned char *mptr = allocator->start + block.prev;
 
-            block_t next = {0};
-            block_read(allocator->start + block.next, &next);
+            if (block.next != BLOCK_INDEX_UNDEFINED) {
+                block_t next = {0};
+                block_read(allocator->start + block.next, &next);
 
-            next.prev = (unsigned long int)((unsigned char *)mptr - allocator->start);
+                next.prev = (unsigned long int)((unsigned char *)mptr - allocator->start);
 
-            block_write(allocator->start + block.next, &next);
+                block_write(allocator->start + block.next, &next);
+            } else {
+                allocator->prev = mptr;
+            }
             block_write(allocator->start + block.prev, &prev);
 
             block = prev;
@@ -904,14 +1603,18 @@ DSHDEF void ds_allocator_free(ds_allocator *allocator, void *ptr) {
         block_read(allocator->start + block.next, &next);
 
         if (next.free) {
-            block_t next_next = {0};
-            block_read(allocator->start + next.next, &next_next);
-
             unsigned char *mptr = ptr - BLOCK_METADATA_SIZE;
 
-            next_next.prev = (unsigned long int)((unsigned char *)mptr - allocator->start);
+            if (next.next != BLOCK_INDEX_UNDEFINED) {
+                block_t next_next = {0};
+                block_read(allocator->start + next.next, &next_next);
+
+                next_next.prev = (unsigned long int)((unsigned char *)mptr - allocator->start);
 
-            block_write(allocator->start + next.next, &next_next);
+                block_write(allocator->start + next.next, &next_next);
+            } else {
+                allocator->prev = mptr;
+            }
 
             block.next = next.next;
             block.size += next.size + BLOCK_METADATA_SIZE;
@@ -919,6 +1622,7 @@ DSHDEF void ds_allocator_free(ds_allocator *allocator, void *ptr) {
     }
 
     block_write(ptr - BLOCK_METADATA_SIZE, &block);
+    allocator_unlock(allocator);
 }
 
 #endif // DS_AL_IMPLEMENTATION
@@ -929,7 +1633,7 @@ DSHDEF void ds_allocator_free(ds_allocator *allocator, void *ptr) {
 //
 // The item_size parameter is the size of each item in the array.
 DSHDEF void ds_dynamic_array_init_allocator(ds_dynamic_array *da,
-                                            unsigned int item_size,
+                                            size_t item_size,
                                             struct ds_allocator *allocator) {
     da->allocator = allocator;
     da->items = NULL;
@@ -942,7 +1646,7 @@ DSHDEF void ds_dynamic_array_init_allocator(ds_dynamic_array *da,
 //
 // The item_size parameter is the size of each item in the array.
 DSHDEF void ds_dynamic_array_init(ds_dynamic_array *da,
-                                  unsigned int item_size) {
+                                  size_t item_size) {
     ds_dynamic_array_init_allocator(da, item_size, NULL);
 }
 
@@ -954,7 +1658,7 @@ DSHDEF int ds_dynamic_array_append(ds_dynamic_array *da, const void *item) {
     int result = 0;
 
     if (da->count >= da->capacity) {
-        unsigned int new_capacity = da->capacity * 2;
+        size_t new_capacity = da->capacity * 2;
         if (new_capacity == 0) {
             new_capacity = DS_DA_INIT_CAPACITY;
         }
@@ -1006,7 +1710,7 @@ defer:
 // Returns 0 if the items were appended successfully, 1 if the array could not
 // be reallocated.
 DSHDEF int ds_dynamic_array_append_many(ds_dynamic_array *da, void **new_items,
-                                        unsigned int new_items_count) {
+                                        size_t new_items_count) {
     int result = 0;
 
     if (da->count + new_items_count > da->capacity) {
@@ -1038,7 +1742,7 @@ defer:
 //
 // Returns 0 if the item was retrieved successfully, 1 if the index is out of
 // bounds.
-DSHDEF int ds_dynamic_array_get(ds_dynamic_array *da, unsigned int index,
+DSHDEF int ds_dynamic_array_get(ds_dynamic_array *da, size_t index,
                                 void *item) {
     int result = 0;
 
@@ -1054,12 +1758,12 @@ defer:
 }
 
 // Get a reference to an item from the dynamic array
-DSHDEF int ds_dynamic_array_get_ref(ds_dynamic_array *da, unsigned int index,
+DSHDEF int ds_dynamic_array_get_ref(ds_dynamic_array *da, size_t index,
                                     void **item) {
     int result = 0;
 
     if (index >= da->count) {
-        DS_LOG_ERROR("Index out of bounds %d %d", index, da->count);
+        DS_LOG_ERROR("Index out of bounds %zu %zu", index, da->count);
         return_defer(1);
     }
 
@@ -1107,8 +1811,8 @@ DSHDEF void ds_dynamic_array_sort(ds_dynamic_array *da,
 DSHDEF int ds_dynamic_array_reverse(ds_dynamic_array *da) {
     int result = 0;
 
-    for (unsigned int i = 0; i < da->count / 2; i++) {
-        unsigned int j = da->count - i - 1;
+    for (size_t i = 0; i < da->count / 2; i++) {
+        size_t j = da->count - i - 1;
 
         if (ds_dynamic_array_swap(da, i, j) != 0) {
             DS_LOG_ERROR("Failed to swap items");
@@ -1124,8 +1828,8 @@ defer:
 //
 // Returns 0 if the items were swapped successfully, 1 if the index is out of
 // bounds or if the temporary item could not be allocated.
-DSHDEF int ds_dynamic_array_swap(ds_dynamic_array *da, unsigned int index1,
-                                 unsigned int index2) {
+DSHDEF int ds_dynamic_array_swap(ds_dynamic_array *da, size_t index1,
+                                 size_t index2) {
     int result = 0;
 
     if (index1 >= da->count || index2 >= da->count) {
@@ -1169,7 +1873,7 @@ defer:
 // Delete an item from the dynamic array
 //
 // Returns 0 in case of succsess. Returns 1 if the index is out of bounds
-DSHDEF int ds_dynamic_array_delete(ds_dynamic_array *da, unsigned int index) {
+DSHDEF int ds_dynamic_array_delete(ds_dynamic_array *da, size_t index) {
     int result = 0;
 
     if (index >= da->count) {
@@ -1177,7 +1881,7 @@ DSHDEF int ds_dynamic_array_delete(ds_dynamic_array *da, unsigned int index) {
         return_defer(1);
     }
 
-    unsigned int n = da->count - index - 1;
+    size_t n = da->count - index - 1;
 
     if (n > 0) {
         void *dest = NULL;
@@ -1192,7 +1896,33 @@ DSHDEF int ds_dynamic_array_delete(ds_dynamic_array *da, unsigned int index) {
             return_defer(1);
         }
 
-        DS_MEMCPY(dest, src, n * da->item_size);
+        DS_MEMMOVE(dest, src, n * da->item_size);
+    }
+
+    da->count -= 1;
+
+defer:
+    return result;
+}
+
+// Delete an item from the dynamic array by moving the last item in its place
+//
+// This does not keep the order of the items, but it takes constant time.
+//
+// Returns 0 in case of succsess. Returns 1 if the index is out of bounds
+DSHDEF int ds_dynamic_array_delete_unordered(ds_dynamic_array *da,
+                                             size_t index) {
+    int result = 0;
+
+    if (index >= da->count) {
+        DS_LOG_ERROR("Index out of bounds");
+        return_defer(1);
+    }
+
+    if (index != da->count - 1) {
+        DS_MEMCPY((char *)da->items + index * da->item_size,
+                  (char *)da->items + (da->count - 1) * da->item_size,
+                  da->item_size);
     }
 
     da->count -= 1;
@@ -1201,6 +1931,64 @@ defer:
     return result;
 }
 
+// Insert an item in the dynamic array at the given index
+//
+// The items after the index are moved one position to the right. Inserting at
+// index count is the same as appending.
+//
+// Returns 0 in case of succsess. Returns 1 if the index is out of bounds or if
+// the array could not be reallocated.
+DSHDEF int ds_dynamic_array_insert(ds_dynamic_array *da, size_t index,
+                                   const void *item) {
+    int result = 0;
+
+    if (index > da->count) {
+        DS_LOG_ERROR("Index out of bounds");
+        return_defer(1);
+    }
+
+    if (ds_dynamic_array_append(da, item) != 0) {
+        return_defer(1);
+    }
+
+    if (index < da->count - 1) {
+        char *dest = (char *)da->items + index * da->item_size;
+
+        DS_MEMMOVE(dest + da->item_size, dest,
+                   (da->count - 1 - index) * da->item_size);
+        DS_MEMCPY(dest, item, da->item_size);
+    }
+
+defer:
+    return result;
+}
+
+// Reserve space for at least capacity items in the dynamic array
+//
+// Returns 0 in case of succsess. Returns 1 if the array could not be
+// reallocated.
+DSHDEF int ds_dynamic_array_reserve(ds_dynamic_array *da,
+                                    size_t capacity) {
+    int result = 0;
+
+    if (capacity <= da->capacity) {
+        return_defer(0);
+    }
+
+    da->items = DS_REALLOC(da->allocator, da->items,
+                           da->capacity * da->item_size,
+                           capacity * da->item_size);
+    if (da->items == NULL) {
+        DS_LOG_ERROR("Failed to reallocate dynamic array");
+        return_defer(1);
+    }
+
+    da->capacity = capacity;
+
+defer:
+    return result;
+}
+
 // Free the dynamic array
 DSHDEF void ds_dynamic_array_free(ds_dynamic_array *da) {
     if (da->items != NULL) {
@@ -1218,7 +2006,7 @@ DSHDEF void ds_dynamic_array_free(ds_dynamic_array *da) {
 // Initialize the priority queue with a custom allocator
 DSHDEF void ds_priority_queue_init_allocator(
     ds_priority_queue *pq, int (*compare)(const void *, const void *),
-    unsigned int item_size, struct ds_allocator *allocator) {
+    size_t item_size, struct ds_allocator *allocator) {
     ds_dynamic_array_init_allocator(&pq->items, item_size, allocator);
 
     pq->compare = compare;
@@ -1227,7 +2015,7 @@ DSHDEF void ds_priority_queue_init_allocator(
 // Initialize the priority queue
 DSHDEF void ds_priority_queue_init(ds_priority_queue *pq,
                                    int (*compare)(const void *, const void *),
-                                   unsigned int item_size) {
+                                   size_t item_size) {
     ds_priority_queue_init_allocator(pq, compare, item_size, NULL);
 }
 
@@ -1387,7 +2175,7 @@ DSHDEF void ds_string_builder_init(ds_string_builder *sb) {
 //
 // Returns 0 if the string was appended successfully.
 DSHDEF int ds_string_builder_appendn(ds_string_builder *sb, const char *str,
-                                     unsigned int len) {
+                                     size_t len) {
     return ds_dynamic_array_append_many(&sb->items, (void **)str, len);
 }
 
@@ -1462,7 +2250,7 @@ DSHDEF void ds_string_builder_free(ds_string_builder *sb) {
 #ifdef DS_SS_IMPLEMENTATION
 
 DSHDEF void ds_string_slice_init_allocator(ds_string_slice *ss, char *str,
-                                           unsigned int len,
+                                           size_t len,
                                            struct ds_allocator *allocator) {
     ss->allocator = allocator;
     ss->str = str;
@@ -1471,7 +2259,7 @@ DSHDEF void ds_string_slice_init_allocator(ds_string_slice *ss, char *str,
 
 // Initialize the string slice
 DSHDEF void ds_string_slice_init(ds_string_slice *ss, char *str,
-                                 unsigned int len) {
+                                 size_t len) {
     ds_string_slice_init_allocator(ss, str, len, NULL);
 }
 
@@ -1489,7 +2277,7 @@ DSHDEF int ds_string_slice_tokenize(ds_string_slice *ss, char delimiter,
     token->str = ss->str;
     token->len = 0;
 
-    for (unsigned int i = 0; i < ss->len; i++) {
+    for (size_t i = 0; i < ss->len; i++) {
         if (ss->str[i] == delimiter) {
             token->len = i;
             ss->str += i + 1;
@@ -1519,7 +2307,7 @@ DSHDEF int ds_string_slice_take_while_pred(ds_string_slice *ss, int (*predicate)
     token->str = ss->str;
     token->len = 0;
 
-    for (unsigned int i = 0; i < ss->len; i++) {
+    for (size_t i = 0; i < ss->len; i++) {
         if (predicate(ss->str[i]) == 0) {
             token->len = i;
             ss->str += i;
@@ -1670,7 +2458,7 @@ DSHDEF void ds_string_slice_free(ds_string_slice *ss) {
 //
 // The item_size parameter is the size of each item in the list.
 DSHDEF void ds_linked_list_init_allocator(ds_linked_list *ll,
-                                          unsigned int item_size,
+                                          size_t item_size,
                                           struct ds_allocator *allocator) {
     ll->allocator = allocator;
     ll->item_size = item_size;
@@ -1681,7 +2469,7 @@ DSHDEF void ds_linked_list_init_allocator(ds_linked_list *ll,
 // Initialize the linked list
 //
 // The item_size parameter is the size of each item in the list.
-DSHDEF void ds_linked_list_init(ds_linked_list *ll, unsigned int item_size) {
+DSHDEF void ds_linked_list_init(ds_linked_list *ll, size_t item_size) {
     ds_linked_list_init_allocator(ll, item_size, NULL);
 }
 
@@ -1864,8 +2652,99 @@ DSHDEF void ds_linked_list_free(ds_linked_list *ll) {
 
 #ifdef DS_HM_IMPLEMENTATION
 
+#ifndef DS_HASHMAP_LINEAR_MAX
+#define DS_HASHMAP_LINEAR_MAX 8
+#endif // DS_HASHMAP_LINEAR_MAX
+
+#define DS_HASHMAP_SLOT_EMPTY 0
+#define DS_HASHMAP_SLOT_DELETED 0xFFFFFFFF
+
+static unsigned int hashmap_slots_capacity(unsigned int count) {
+    unsigned int capacity = DS_HASHMAP_LINEAR_MAX * 2;
+    while (capacity < count * 2) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+static int hashmap_find(ds_hashmap *map, const void *key, unsigned int hash,
+                        unsigned int *entry, unsigned int *slot) {
+    ds_hashmap_kv *entries = (ds_hashmap_kv *)map->entries.items;
+
+    if (map->slots == NULL) {
+        for (unsigned int i = 0; i < map->entries.count; i++) {
+            if (entries[i].key != NULL && entries[i].hash == hash &&
+                map->compare(key, entries[i].key) == 0) {
+                *entry = i;
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    unsigned int mask = map->capacity - 1;
+    for (unsigned int i = hash & mask;; i = (i + 1) & mask) {
+        unsigned int index = map->slots[i];
+        if (index == DS_HASHMAP_SLOT_EMPTY) {
+            return 1;
+        }
+
+        if (index != DS_HASHMAP_SLOT_DELETED && entries[index - 1].hash == hash &&
+            map->compare(key, entries[index - 1].key) == 0) {
+            *entry = index - 1;
+            *slot = i;
+            return 0;
+        }
+    }
+}
+
+// Drop the deleted entries and rebuild the slots table with the new capacity
+static int hashmap_rebuild(ds_hashmap *map, unsigned int capacity) {
+    int result = 0;
+    ds_hashmap_kv *entries = (ds_hashmap_kv *)map->entries.items;
+    unsigned int count = 0;
+
+    unsigned int *slots = DS_MALLOC(map->allocator, capacity * sizeof(unsigned int));
+    if (slots == NULL) {
+        DS_LOG_ERROR("Failed to allocate hashmap slots");
+        return_defer(1);
+    }
+
+    for (unsigned int i = 0; i < map->entries.count; i++) {
+        if (entries[i].key != NULL) {
+            entries[count++] = entries[i];
+        }
+    }
+    map->entries.count = count;
+
+    for (unsigned int i = 0; i < capacity; i++) {
+        slots[i] = DS_HASHMAP_SLOT_EMPTY;
+    }
+
+    unsigned int mask = capacity - 1;
+    for (size_t i = 0; i < count; i++) {
+        unsigned int j = entries[i].hash & mask;
+        while (slots[j] != DS_HASHMAP_SLOT_EMPTY) {
+            j = (j + 1) & mask;
+        }
+        slots[j] = i + 1;
+    }
+
+    if (map->slots != NULL) {
+        DS_FREE(map->allocator, map->slots);
+    }
+    map->slots = slots;
+    map->capacity = capacity;
+
+defer:
+    return result;
+}
+
 // Initialize the hashmap using an allocator
 //
+// The capacity parameter is the number of items to reserve space for, the map
+// grows as needed.
+//
 // Returns 0 if the initialization was succsess. Returns 1 if it failed to
 // allocate the hashmap
 DSHDEF int ds_hashmap_init_allocator(ds_hashmap *map, unsigned int capacity,
@@ -1875,21 +2754,18 @@ DSHDEF int ds_hashmap_init_allocator(ds_hashmap *map, unsigned int capacity,
     int result = 0;
 
     map->allocator = allocator;
-    map->capacity = capacity;
+    map->slots = NULL;
+    map->capacity = 0;
+    map->count = 0;
+    map->hash = hash;
+    map->compare = compare;
 
-    map->buckets = DS_MALLOC(map->allocator, capacity * sizeof(ds_dynamic_array));
-    if (map->buckets == NULL) {
-        DS_LOG_ERROR("Failed to allocate hashmap buckets");
+    ds_dynamic_array_init_allocator(&map->entries, sizeof(ds_hashmap_kv), map->allocator);
+    if (ds_dynamic_array_reserve(&map->entries, capacity) != 0) {
+        DS_LOG_ERROR("Failed to allocate hashmap entries");
         return_defer(1);
     }
 
-    for (unsigned int i = 0; i < map->capacity; i++) {
-        ds_dynamic_array_init_allocator(map->buckets + i, sizeof(ds_hashmap_kv), map->allocator);
-    }
-
-    map->hash = hash;
-    map->compare = compare;
-
 defer:
     return result;
 }
@@ -1908,77 +2784,121 @@ DSHDEF int ds_hashmap_init(ds_hashmap *map, unsigned int capacity,
 //
 // Returns 0 for succsess. Returns 1 if it failed to add the item
 DSHDEF int ds_hashmap_insert(ds_hashmap *map, ds_hashmap_kv *kv) {
+    kv->hash = map->hash(kv->key);
+
+    return ds_hashmap_insert_hashed(map, kv);
+}
+
+// Insert a key value pair into the hashmap using the hash stored in the pair
+//
+// This can be used when the hash of the key is already known. It must be the
+// same value that the hash function of the map returns for the key.
+//
+// Returns 0 for succsess. Returns 1 if it failed to add the item
+DSHDEF int ds_hashmap_insert_hashed(ds_hashmap *map, ds_hashmap_kv *kv) {
     int result = 0;
 
-    unsigned int index = map->hash(kv->key) % map->capacity;
+    if (map->entries.capacity == 0) {
+        if (ds_dynamic_array_reserve(&map->entries, DS_HASHMAP_LINEAR_MAX) != 0) {
+            DS_LOG_ERROR("Failed to allocate hashmap entries");
+            return_defer(1);
+        }
+    }
+
+    if ((map->slots == NULL && map->entries.count >= DS_HASHMAP_LINEAR_MAX) ||
+        (map->slots != NULL && (map->entries.count + 1) * 4 > map->capacity * 3)) {
+        if (hashmap_rebuild(map, hashmap_slots_capacity(map->count + 1)) != 0) {
+            return_defer(1);
+        }
+    }
 
-    if (ds_dynamic_array_append(map->buckets + index, kv) != 0) {
-        DS_LOG_ERROR("Failed to insert item into bucket");
+    if (ds_dynamic_array_append(&map->entries, kv) != 0) {
+        DS_LOG_ERROR("Failed to insert item into hashmap");
         return_defer(1);
     }
 
+    if (map->slots != NULL) {
+        unsigned int mask = map->capacity - 1;
+        unsigned int i = kv->hash & mask;
+        while (map->slots[i] != DS_HASHMAP_SLOT_EMPTY) {
+            i = (i + 1) & mask;
+        }
+        map->slots[i] = map->entries.count;
+    }
+
+    map->count += 1;
+
 defer:
     return result;
 }
 
 // Get an item from the hashmap using the key
 //
-// Returns 0 if it found the item. Returns 1 in case of an error
+// Returns 0 if it found the item. Returns 1 if the key is missing or in case
+// of an error
 DSHDEF int ds_hashmap_get(ds_hashmap *map, ds_hashmap_kv *kv) {
     int result = 0;
-    int found = 0;
-
-    unsigned int index = map->hash(kv->key) % map->capacity;
-    ds_dynamic_array *bucket = map->buckets + index;
-
-    for (int i = 0; bucket->count; i++) {
-        ds_hashmap_kv tmp = {0};
-        if (ds_dynamic_array_get(bucket, i, &tmp) != 0) {
-            return_defer(1);
-        }
-
-        if (map->compare(kv->key, tmp.key) == 0) {
-            kv->value = tmp.value;
-            found = 1;
-            break;
-        }
-    }
+    ds_hashmap_kv *ref = NULL;
 
-    if (found == 0) {
-        DS_LOG_ERROR("Failed to find item in hashmap");
+    if (ds_hashmap_get_ref(map, kv->key, map->hash(kv->key), &ref) != 0) {
         return_defer(1);
     }
 
+    kv->value = ref->value;
+    kv->hash = ref->hash;
+
 defer:
     return result;
 }
 
+// Get a reference to the stored key value pair using the key and its hash
+//
+// The reference is valid until the next insert or delete.
+//
+// Returns 0 if it found the item. Returns 1 if the key is missing
+DSHDEF int ds_hashmap_get_ref(ds_hashmap *map, const void *key,
+                              unsigned int hash, ds_hashmap_kv **kv) {
+    unsigned int entry = 0;
+    unsigned int slot = 0;
+
+    if (hashmap_find(map, key, hash, &entry, &slot) != 0) {
+        return 1;
+    }
+
+    *kv = (ds_hashmap_kv *)map->entries.items + entry;
+    return 0;
+}
+
 // Delete a key from the hashmap (this does not free the memory)
 //
+// The item is marked as deleted. The deleted items are dropped when the map
+// grows, or when there are more deleted items than items left.
+//
 // Returns 0 if it found the item. Returns 1 in case of an error
 DSHDEF int ds_hashmap_delete(ds_hashmap *map, const void *key) {
     int result = 0;
-    int found = 0;
+    unsigned int entry = 0;
+    unsigned int slot = 0;
 
-    unsigned int index = map->hash(key) % map->capacity;
-    ds_dynamic_array *bucket = map->buckets + index;
+    if (hashmap_find(map, key, map->hash(key), &entry, &slot) != 0) {
+        DS_LOG_ERROR("Failed to find item in hashmap");
+        return_defer(1);
+    }
 
-    for (int i = 0; bucket->count; i++) {
-        ds_hashmap_kv tmp = {0};
-        if (ds_dynamic_array_get(bucket, i, &tmp) != 0) {
-            return_defer(1);
-        }
+    map->count -= 1;
 
-        if (map->compare(key, tmp.key) == 0) {
-            ds_dynamic_array_delete(bucket, i);
-            found = 1;
-            break;
-        }
+    if (map->slots == NULL) {
+        ds_dynamic_array_delete(&map->entries, entry);
+        return_defer(0);
     }
 
-    if (found == 0) {
-        DS_LOG_ERROR("Failed to find item in hashmap");
-        return_defer(1);
+    ((ds_hashmap_kv *)map->entries.items)[entry] = (ds_hashmap_kv){0};
+    map->slots[slot] = DS_HASHMAP_SLOT_DELETED;
+
+    if (map->entries.count - map->count > map->count + DS_HASHMAP_LINEAR_MAX) {
+        if (hashmap_rebuild(map, hashmap_slots_capacity(map->count)) != 0) {
+            return_defer(1);
+        }
     }
 
 defer:
@@ -1989,24 +2909,19 @@ defer:
 //
 // Returns the number of items.
 DSHDEF unsigned int ds_hashmap_count(ds_hashmap *map) {
-    unsigned int count = 0;
-
-    for (unsigned int i = 0; i < map->capacity; i++) {
-        count += map->buckets[i].count;
-    }
-
-    return count;
+    return map->count;
 }
 
 // Free the hashmap (this does not free the values or the keys)
 DSHDEF void ds_hashmap_free(ds_hashmap *map) {
-    for (unsigned int i = 0; i < map->capacity; i++) {
-        ds_dynamic_array_free(map->buckets + i);
-    }
+    ds_dynamic_array_free(&map->entries);
 
-    if (map->buckets != NULL) {
-        DS_FREE(map->allocator, map->buckets);
+    if (map->slots != NULL) {
+        DS_FREE(map->allocator, map->slots);
     }
+    map->slots = NULL;
+    map->capacity = 0;
+    map->count = 0;
 }
 
 #endif // DS_HM_IMPLEMENTATION
@@ -2599,12 +3514,621 @@ DSHDEF void ds_argparse_print_version(ds_argparse_parser *parser) {
 // Arguments:
 // - parser: argument parser
 DSHDEF void ds_argparse_parser_free(ds_argparse_parser *parser) {
+    for (size_t i = 0; i < parser->arguments.count; i++) {
+        ds_argument *item = NULL;
+        if (ds_dynamic_array_get_ref(&parser->arguments, i, (void **)&item) == 0) {
+            ds_dynamic_array_free(&item->values);
+        }
+    }
     ds_dynamic_array_free(&parser->arguments);
 }
 
 #endif // DS_AP_IMPLEMENTATION
 
-#ifdef DS_IO_IMPLEMENTATION
+#ifdef DS_RB_IMPLEMENTATION
+
+// The smallest power of two that is at least capacity
+static size_t ds_ring_capacity(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    return size;
+}
+
+// Initialize a single producer and single consumer ring buffer
+//
+// Arguments:
+// - ring: the ring buffer to initialize
+// - item_size: the size of an item
+// - capacity: the number of items, rounded up to a power of two
+//
+// Returns 0 if the ring buffer was allocated. Returns 1 if it failed
+DSHDEF int ds_spsc_ring_init(ds_spsc_ring *ring, size_t item_size, size_t capacity) {
+    int result = 0;
+
+    memset(ring, 0, sizeof(*ring));
+    capacity = ds_ring_capacity(capacity);
+    ring->items = DS_MALLOC(NULL, capacity * item_size);
+    if (ring->items == NULL) {
+        DS_LOG_ERROR("Failed to allocate the ring buffer");
+        return_defer(1);
+    }
+    ring->item_size = item_size;
+    ring->mask = capacity - 1;
+
+defer:
+    return result;
+}
+
+// Copy items in or out of the ring, from position pos, wrapping at the end
+static void ds_spsc_ring_copy(ds_spsc_ring *ring, size_t pos, char *items, size_t count, bool in) {
+    size_t start = pos & ring->mask;
+    size_t first = ring->mask + 1 - start;
+    if (first > count) {
+        first = count;
+    }
+
+    char *slot = ring->items + start * ring->item_size;
+    if (in == true) {
+        DS_MEMCPY(slot, items, first * ring->item_size);
+        DS_MEMCPY(ring->items, items + first * ring->item_size, (count - first) * ring->item_size);
+    } else {
+        DS_MEMCPY(items, slot, first * ring->item_size);
+        DS_MEMCPY(items + first * ring->item_size, ring->items, (count - first) * ring->item_size);
+    }
+}
+
+// Push items
+//
+// Copies as many of the items as there is room for, and makes them visible to
+// the consumer at once. Only one thread may push.
+//
+// Returns the number of items that were pushed
+DSHDEF size_t ds_spsc_ring_push(ds_spsc_ring *ring, const void *items, size_t count) {
+    size_t capacity = ring->mask + 1;
+    size_t head = ring->head;
+
+    // Read the tail again only when the copy seen before looks full
+    if (capacity - (head - ring->tail_seen) < count) {
+        ring->tail_seen = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    }
+    size_t room = capacity - (head - ring->tail_seen);
+    if (count > room) {
+        count = room;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    ds_spsc_ring_copy(ring, head, (char *)items, count, true);
+    __atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+
+    return count;
+}
+
+// Pop items
+//
+// Copies out up to count of the oldest items. Only one thread may pop.
+//
+// Returns the number of items that were popped
+DSHDEF size_t ds_spsc_ring_pop(ds_spsc_ring *ring, void *items, size_t count) {
+    size_t tail = ring->tail;
+
+    if (ring->head_seen - tail < count) {
+        ring->head_seen = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    }
+    size_t available = ring->head_seen - tail;
+    if (count > available) {
+        count = available;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    ds_spsc_ring_copy(ring, tail, (char *)items, count, false);
+    __atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+
+    return count;
+}
+
+// Check if the ring has no items, from the side of the consumer
+DSHDEF bool ds_spsc_ring_empty(ds_spsc_ring *ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail;
+}
+
+DSHDEF void ds_spsc_ring_free(ds_spsc_ring *ring) {
+    if (ring->items != NULL) {
+        DS_FREE(NULL, ring->items);
+    }
+    memset(ring, 0, sizeof(*ring));
+}
+
+// Initialize a ring buffer for many producers and many consumers
+//
+// Arguments:
+// - ring: the ring buffer to initialize
+// - item_size: the size of an item
+// - capacity: the number of items, rounded up to a power of two
+//
+// Returns 0 if the ring buffer was allocated. Returns 1 if it failed
+DSHDEF int ds_mpmc_ring_init(ds_mpmc_ring *ring, size_t item_size, size_t capacity) {
+    int result = 0;
+
+    memset(ring, 0, sizeof(*ring));
+    capacity = ds_ring_capacity(capacity);
+    ring->slot_size = (sizeof(size_t) + item_size + sizeof(size_t) - 1) / sizeof(size_t) * sizeof(size_t);
+    ring->slots = DS_MALLOC(NULL, capacity * ring->slot_size);
+    if (ring->slots == NULL) {
+        DS_LOG_ERROR("Failed to allocate the ring buffer");
+        return_defer(1);
+    }
+    ring->item_size = item_size;
+    ring->mask = capacity - 1;
+
+    // A slot is free for the push at position pos when its sequence is pos,
+    // and holds an item for the pop at position pos when it is pos + 1
+    for (size_t i = 0; i < capacity; i++) {
+        *(size_t *)(ring->slots + i * ring->slot_size) = i;
+    }
+
+defer:
+    return result;
+}
+
+// The slot of a position of the ring
+#define ds_mpmc_ring_slot(ring, pos) ((ring)->slots + ((pos) & (ring)->mask) * (ring)->slot_size)
+
+// Push items
+//
+// Finds the run of free slots from the head, up to count, and claims all of
+// them with a single compare and swap of the head. The items are then copied
+// and each slot is published on its own. Any number of threads may push at
+// the same time.
+//
+// Returns the number of items that were pushed, fewer than count if the ring
+// is full
+DSHDEF size_t ds_mpmc_ring_push(ds_mpmc_ring *ring, const void *items, size_t count) {
+    size_t pushed = 0;
+    size_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    while (pushed < count) {
+        size_t sequence = __atomic_load_n((size_t *)ds_mpmc_ring_slot(ring, pos), __ATOMIC_ACQUIRE);
+        long int diff = (long int)(sequence - pos);
+
+        if (diff < 0) {
+            break;
+        } else if (diff > 0) {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        size_t claim = 1;
+        while (pushed + claim < count &&
+               __atomic_load_n((size_t *)ds_mpmc_ring_slot(ring, pos + claim), __ATOMIC_ACQUIRE) == pos + claim) {
+            claim += 1;
+        }
+
+        if (__atomic_compare_exchange_n(&ring->head, &pos, pos + claim, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            for (size_t i = 0; i < claim; i++) {
+                char *slot = ds_mpmc_ring_slot(ring, pos + i);
+                DS_MEMCPY(slot + sizeof(size_t), (const char *)items + (pushed + i) * ring->item_size, ring->item_size);
+                __atomic_store_n((size_t *)slot, pos + i + 1, __ATOMIC_RELEASE);
+            }
+            pushed += claim;
+            pos += claim;
+        }
+    }
+
+    return pushed;
+}
+
+// Pop items
+//
+// Finds the run of full slots from the tail, up to count, and claims all of
+// them with a single compare and swap of the tail. The items are then copied
+// out and each slot is freed on its own. Any number of threads may pop at the
+// same time.
+//
+// Returns the number of items that were popped, fewer than count if the ring
+// is empty
+DSHDEF size_t ds_mpmc_ring_pop(ds_mpmc_ring *ring, void *items, size_t count) {
+    size_t popped = 0;
+    size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+    while (popped < count) {
+        size_t sequence = __atomic_load_n((size_t *)ds_mpmc_ring_slot(ring, pos), __ATOMIC_ACQUIRE);
+        long int diff = (long int)(sequence - (pos + 1));
+
+        if (diff < 0) {
+            break;
+        } else if (diff > 0) {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        size_t claim = 1;
+        while (popped + claim < count &&
+               __atomic_load_n((size_t *)ds_mpmc_ring_slot(ring, pos + claim), __ATOMIC_ACQUIRE) == pos + claim + 1) {
+            claim += 1;
+        }
+
+        if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + claim, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            for (size_t i = 0; i < claim; i++) {
+                char *slot = ds_mpmc_ring_slot(ring, pos + i);
+                DS_MEMCPY((char *)items + (popped + i) * ring->item_size, slot + sizeof(size_t), ring->item_size);
+                __atomic_store_n((size_t *)slot, pos + i + ring->mask + 1, __ATOMIC_RELEASE);
+            }
+            popped += claim;
+            pos += claim;
+        }
+    }
+
+    return popped;
+}
+
+DSHDEF void ds_mpmc_ring_free(ds_mpmc_ring *ring) {
+    if (ring->slots != NULL) {
+        DS_FREE(NULL, ring->slots);
+    }
+    memset(ring, 0, sizeof(*ring));
+}
+
+#endif // DS_RB_IMPLEMENTATION
+
+#ifdef DS_IO_IMPLEMENTATION
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+
+#ifdef DS_IO_ZLIB
+#include <zlib.h>
+#endif // DS_IO_ZLIB
+
+#ifdef DS_IO_ZSTD
+#include <zstd.h>
+#endif // DS_IO_ZSTD
+
+#if defined(DS_IO_ZLIB) || defined(DS_IO_ZSTD)
+// Magic bytes of the enabled compressed formats
+static const struct {
+    ds_io_format format;
+    unsigned char bytes[4];
+    size_t len;
+} ds_io_magics[] = {
+#ifdef DS_IO_ZLIB
+    {DS_IO_FORMAT_GZIP, {0x1F, 0x8B}, 2},
+#endif // DS_IO_ZLIB
+#ifdef DS_IO_ZSTD
+    {DS_IO_FORMAT_ZSTD, {0x28, 0xB5, 0x2F, 0xFD}, 4},
+#endif // DS_IO_ZSTD
+};
+
+// Find the format whose magic bytes start the data
+static ds_io_format ds_io_format_of(const unsigned char *data, size_t size) {
+    for (size_t i = 0; i < sizeof(ds_io_magics) / sizeof(ds_io_magics[0]); i++) {
+        if (size >= ds_io_magics[i].len && memcmp(data, ds_io_magics[i].bytes, ds_io_magics[i].len) == 0) {
+            return ds_io_magics[i].format;
+        }
+    }
+    return DS_IO_FORMAT_PLAIN;
+}
+
+// Check if the data is too short to tell, because it is the start of the magic
+// bytes of a format but not all of them
+static bool ds_io_format_pending(const unsigned char *data, size_t size) {
+    for (size_t i = 0; i < sizeof(ds_io_magics) / sizeof(ds_io_magics[0]); i++) {
+        if (size < ds_io_magics[i].len && memcmp(data, ds_io_magics[i].bytes, size) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+// Check the magic bytes of a regular file without moving its offset
+static bool ds_io_is_compressed(int fd) {
+#if defined(DS_IO_ZLIB) || defined(DS_IO_ZSTD)
+    unsigned char magic[4] = {0};
+    ssize_t count = pread(fd, magic, sizeof(magic), 0);
+    return count > 0 && ds_io_format_of(magic, count) != DS_IO_FORMAT_PLAIN;
+#else
+    (void)fd;
+    return false;
+#endif
+}
+
+// Initialize a source
+//
+// Nothing is read until the first call to ds_io_source_read. The file
+// descriptor is not closed by ds_io_source_free.
+//
+// Arguments:
+// - source: the source to initialize
+// - fd: the file descriptor to read
+DSHDEF void ds_io_source_init(ds_io_source *source, int fd) {
+    *source = (ds_io_source){.fd = fd, .wake = -1};
+}
+
+// Wait until the file descriptor can be read or the wake pipe is written, so
+// that a read blocked on a pipe can be cancelled from another thread.
+//
+// Returns 0 if the file descriptor can be read. Returns 1 with errno set to
+// ECANCELED if the wake pipe was written
+static int ds_io_source_poll(ds_io_source *source) {
+    struct pollfd fds[2] = {
+        {.fd = source->fd, .events = POLLIN},
+        {.fd = source->wake, .events = POLLIN},
+    };
+
+    if (source->wake < 0) {
+        return 0;
+    }
+
+    while (poll(fds, 2, -1) < 0) {
+        if (errno != EINTR) {
+            return 1;
+        }
+    }
+
+    if (fds[1].revents != 0) {
+        errno = ECANCELED;
+        return 1;
+    }
+
+    return 0;
+}
+
+#if defined(DS_IO_ZLIB) || defined(DS_IO_ZSTD)
+// Read more data into the input buffer, after the data that is not used yet
+static int ds_io_source_fill(ds_io_source *source) {
+    if (source->input_pos > 0) {
+        memmove(source->input, source->input + source->input_pos, source->input_size - source->input_pos);
+        source->input_size -= source->input_pos;
+        source->input_pos = 0;
+    }
+
+    for (;;) {
+        if (ds_io_source_poll(source) != 0) {
+            return 1;
+        }
+        ssize_t count = read(source->fd, source->input + source->input_size, DS_IO_SOURCE_BUFFER_SIZE - source->input_size);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            return 1;
+        }
+        if (count == 0) {
+            source->eof = true;
+        }
+        source->input_size += count;
+        return 0;
+    }
+}
+#endif
+
+// Read the magic bytes and start the decompressor they call for
+static int ds_io_source_detect(ds_io_source *source) {
+    int result = 0;
+
+    source->detected = true;
+#if defined(DS_IO_ZLIB) || defined(DS_IO_ZSTD)
+    source->input = DS_MALLOC(NULL, DS_IO_SOURCE_BUFFER_SIZE);
+    if (source->input == NULL) {
+        DS_LOG_ERROR("Failed to allocate the input buffer");
+        return_defer(1);
+    }
+
+    // Stop reading as soon as the bytes so far can not be the start of a magic,
+    // so that a short record on a pipe is not held back
+    while (source->eof == false && ds_io_format_pending((unsigned char *)source->input, source->input_size)) {
+        if (ds_io_source_fill(source) != 0) {
+            return_defer(1);
+        }
+    }
+    source->format = ds_io_format_of((unsigned char *)source->input, source->input_size);
+
+#ifdef DS_IO_ZLIB
+    if (source->format == DS_IO_FORMAT_GZIP) {
+        z_stream *stream = DS_MALLOC(NULL, sizeof(z_stream));
+        if (stream == NULL) {
+            DS_LOG_ERROR("Failed to allocate the gzip stream");
+            return_defer(1);
+        }
+        memset(stream, 0, sizeof(z_stream));
+        // 15 bits of window, plus 32 to accept both the gzip and zlib headers
+        if (inflateInit2(stream, 15 + 32) != Z_OK) {
+            DS_LOG_ERROR("Failed to start the gzip decompressor");
+            DS_FREE(NULL, stream);
+            return_defer(1);
+        }
+        source->state = stream;
+    }
+#endif // DS_IO_ZLIB
+
+#ifdef DS_IO_ZSTD
+    if (source->format == DS_IO_FORMAT_ZSTD) {
+        ZSTD_DStream *stream = ZSTD_createDStream();
+        if (stream == NULL || ZSTD_isError(ZSTD_initDStream(stream))) {
+            DS_LOG_ERROR("Failed to start the zstd decompressor");
+            ZSTD_freeDStream(stream);
+            return_defer(1);
+        }
+        source->state = stream;
+    }
+#endif // DS_IO_ZSTD
+
+defer:
+#endif
+    return result;
+}
+
+#ifdef DS_IO_ZLIB
+// Run inflate on the input until some output is written. A new member is
+// started after the end of one, since gzip files can be concatenated.
+static long int ds_io_source_inflate(ds_io_source *source, char *buffer, size_t size) {
+    z_stream *stream = (z_stream *)source->state;
+    unsigned int avail = size > UINT_MAX ? UINT_MAX : size;
+
+    stream->next_out = (Bytef *)buffer;
+    stream->avail_out = avail;
+
+    for (;;) {
+        if (source->finished == true && source->input_pos < source->input_size) {
+            inflateReset(stream);
+            source->finished = false;
+        }
+
+        if (source->finished == false) {
+            stream->next_in = (Bytef *)source->input + source->input_pos;
+            stream->avail_in = source->input_size - source->input_pos;
+            int status = inflate(stream, Z_NO_FLUSH);
+            source->input_pos = source->input_size - stream->avail_in;
+            if (status == Z_STREAM_END) {
+                source->finished = true;
+            } else if (status != Z_OK && status != Z_BUF_ERROR) {
+                source->error = stream->msg != NULL ? stream->msg : "invalid gzip data";
+                return -1;
+            }
+        }
+
+        if (stream->avail_out < avail) {
+            return avail - stream->avail_out;
+        }
+
+        if (source->input_pos == source->input_size && source->eof == true) {
+            if (source->finished == false) {
+                source->error = "unexpected end of gzip data";
+                return -1;
+            }
+            return 0;
+        }
+
+        if (source->input_pos == source->input_size && ds_io_source_fill(source) != 0) {
+            return -1;
+        }
+    }
+}
+#endif // DS_IO_ZLIB
+
+#ifdef DS_IO_ZSTD
+// Run the zstd decompressor on the input until some output is written. The
+// decompressor goes on to the next frame by itself.
+static long int ds_io_source_zstd(ds_io_source *source, char *buffer, size_t size) {
+    ZSTD_DStream *stream = (ZSTD_DStream *)source->state;
+    ZSTD_outBuffer out = {.dst = buffer, .size = size, .pos = 0};
+
+    for (;;) {
+        ZSTD_inBuffer in = {.src = source->input + source->input_pos, .size = source->input_size - source->input_pos, .pos = 0};
+        size_t status = ZSTD_decompressStream(stream, &out, &in);
+        source->input_pos += in.pos;
+        if (ZSTD_isError(status)) {
+            source->error = ZSTD_getErrorName(status);
+            return -1;
+        }
+        if (in.pos > 0 || out.pos > 0) {
+            source->finished = (status == 0);
+        }
+
+        if (out.pos > 0) {
+            return out.pos;
+        }
+
+        if (source->input_pos == source->input_size && source->eof == true) {
+            if (source->finished == false) {
+                source->error = "unexpected end of zstd data";
+                return -1;
+            }
+            return 0;
+        }
+
+        if (source->input_pos == source->input_size && ds_io_source_fill(source) != 0) {
+            return -1;
+        }
+    }
+}
+#endif // DS_IO_ZSTD
+
+// Read from a source
+//
+// Reads up to size bytes, decompressed if the input is compressed. Like read,
+// it can return fewer bytes than asked for before the end of the input.
+//
+// Arguments:
+// - source: the source to read from
+// - buffer: the buffer to read into
+// - size: the size of the buffer
+//
+// Returns:
+// - the number of bytes read, 0 at the end of the input, or -1 if it failed,
+// with source->error set if the input could not be decompressed and errno set
+// otherwise
+DSHDEF long int ds_io_source_read(ds_io_source *source, char *buffer, size_t size) {
+    if (source->detected == false && ds_io_source_detect(source) != 0) {
+        return -1;
+    }
+
+    switch (source->format) {
+#ifdef DS_IO_ZLIB
+    case DS_IO_FORMAT_GZIP:
+        return ds_io_source_inflate(source, buffer, size);
+#endif // DS_IO_ZLIB
+#ifdef DS_IO_ZSTD
+    case DS_IO_FORMAT_ZSTD:
+        return ds_io_source_zstd(source, buffer, size);
+#endif // DS_IO_ZSTD
+    default:
+        break;
+    }
+
+    // Plain input: first the bytes read for the magic, then straight from fd
+    if (source->input_pos < source->input_size) {
+        size_t count = source->input_size - source->input_pos;
+        if (count > size) {
+            count = size;
+        }
+        DS_MEMCPY(buffer, source->input + source->input_pos, count);
+        source->input_pos += count;
+        return count;
+    }
+
+    for (;;) {
+        if (ds_io_source_poll(source) != 0) {
+            return -1;
+        }
+        ssize_t count = read(source->fd, buffer, size);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        return count;
+    }
+}
+
+// Free the decompressor and the buffers of a source
+DSHDEF void ds_io_source_free(ds_io_source *source) {
+#ifdef DS_IO_ZLIB
+    if (source->format == DS_IO_FORMAT_GZIP && source->state != NULL) {
+        inflateEnd((z_stream *)source->state);
+        DS_FREE(NULL, source->state);
+    }
+#endif // DS_IO_ZLIB
+#ifdef DS_IO_ZSTD
+    if (source->format == DS_IO_FORMAT_ZSTD && source->state != NULL) {
+        ZSTD_freeDStream((ZSTD_DStream *)source->state);
+    }
+#endif // DS_IO_ZSTD
+    if (source->input != NULL) {
+        DS_FREE(NULL, source->input);
+    }
+    *source = (ds_io_source){0};
+}
 
 // Read a file
 //
@@ -2617,8 +4141,8 @@ DSHDEF void ds_argparse_parser_free(ds_argparse_parser *parser) {
 //
 // Returns:
 // - the number of bytes read
-DSHDEF int ds_io_read(const char *filename, char **buffer, const char *mode) {
-    int result = 0;
+DSHDEF long int ds_io_read(const char *filename, char **buffer, const char *mode) {
+    long int result = 0;
     unsigned long line_size;
     FILE *file = NULL;
     ds_string_builder sb;
@@ -2634,7 +4158,7 @@ DSHDEF int ds_io_read(const char *filename, char **buffer, const char *mode) {
         file = stdin;
     }
 
-    char line[LINE_MAX] = {0};
+    char line[LINE_MAX];
     do {
         line_size = fread(line, sizeof(char), LINE_MAX, file);
 
@@ -2642,8 +4166,6 @@ DSHDEF int ds_io_read(const char *filename, char **buffer, const char *mode) {
             DS_LOG_ERROR("Failed to append line to string builder");
             return_defer(-1);
         }
-
-        memset(line, 0, sizeof(line));
     } while (line_size > 0);
 
     if (ds_string_builder_build(&sb, buffer) != 0) {
@@ -2672,9 +4194,9 @@ defer:
 //
 // Returns:
 // - the number of bytes written
-DSHDEF int ds_io_write(const char *filename, char *buffer, unsigned int buffer_len, const char *mode) {
-    int result = 0;
-    unsigned long buffer_size;
+DSHDEF long int ds_io_write(const char *filename, char *buffer, size_t buffer_len, const char *mode) {
+    long int result = 0;
+    size_t buffer_size;
     FILE *file = NULL;
 
     if (filename != NULL) {
@@ -2697,516 +4219,5928 @@ defer:
     return result;
 }
 
-#endif // DS_IO_IMPLEMENTATION
+// Map a file into memory
+//
+// Regular files are mapped read only with mmap, so the contents are not
+// copied and the pages are read ahead as the buffer is scanned. Files smaller
+// than DS_IO_MAP_MIN_SIZE are read with a single read instead. Other files,
+// like pipes and stdin when filename is NULL, are read into a single buffer
+// that grows geometrically. Compressed files are read through ds_io_source
+// and decompressed straight into the buffer. In both cases the
+// DS_IO_MAP_PADDING bytes after the end are readable and zero, so that
+// vectorized loops can read whole blocks past the end. The buffer must not be
+// written to.
+//
+// Arguments:
+// - filename: name of the file to map, or NULL for stdin
+// - mapping: the mapping to initialize
+//
+// Returns:
+// - 0 if the file was mapped, 1 if it failed
+DSHDEF int ds_io_map(const char *filename, ds_io_mapping *mapping) {
+    int result = 0;
+    int fd = STDIN_FILENO;
+    struct stat st;
+    char *data = MAP_FAILED;
+    size_t capacity = 0;
+    ds_io_source source = {0};
 
-#ifdef DS_JS_IMPLEMENTATION
+    *mapping = (ds_io_mapping){0};
 
-typedef enum json_token_kind {
-    JSON_TOKEN_LBRACE,
-    JSON_TOKEN_RBRACE,
-    JSON_TOKEN_LSQRLY,
-    JSON_TOKEN_RSQRLY,
-    JSON_TOKEN_COLON,
-    JSON_TOKEN_COMMA,
-    JSON_TOKEN_BOOLEAN,
-    JSON_TOKEN_NUMBER,
-    JSON_TOKEN_STRING,
-    JSON_TOKEN_NULL,
-    JSON_TOKEN_EOF,
-    JSON_TOKEN_ILLEGAL,
-} json_token_kind;
+    if (filename != NULL) {
+        fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            DS_LOG_ERROR("Failed to open file %s: %s", filename, strerror(errno));
+            return_defer(1);
+        }
+    }
 
-typedef struct json_token {
-    json_token_kind kind;
-    ds_string_slice value;
-    unsigned int pos;
-} json_token;
+    if (fstat(fd, &st) != 0) {
+        DS_LOG_ERROR("Failed to stat file: %s", strerror(errno));
+        return_defer(1);
+    }
 
-typedef struct json_lexer {
-    const char *buffer;
-    unsigned int buffer_len;
-    unsigned int pos;
-    unsigned int read_pos;
-    char ch;
-} json_lexer;
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size >= DS_IO_MAP_MIN_SIZE && !ds_io_is_compressed(fd)) {
+        unsigned long int page = sysconf(_SC_PAGESIZE);
+        unsigned long int size = st.st_size;
+        int flags = MAP_PRIVATE | MAP_FIXED;
 
-typedef struct json_parser {
-    json_lexer lexer;
-} json_parser;
+        // Reserve zero pages for the file and the padding, then map the file
+        // over the start of them
+        capacity = (size + DS_IO_MAP_PADDING + page - 1) / page * page;
+        data = mmap(NULL, capacity, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED) {
+            DS_LOG_ERROR("Failed to map memory: %s", strerror(errno));
+            return_defer(1);
+        }
 
-static unsigned int json_object_hash(const void *key) {
-    unsigned int hash = 0;
-    char *name = (char *)key;
-    for (unsigned int i = 0; i < strlen(name); i++) {
-        hash = 31 * hash + name[i];
+#ifdef MAP_POPULATE
+        flags |= MAP_POPULATE;
+#endif
+        if (mmap(data, size, PROT_READ, flags, fd, 0) == MAP_FAILED) {
+            DS_LOG_ERROR("Failed to map file: %s", strerror(errno));
+            return_defer(1);
+        }
+        madvise(data, size, MADV_SEQUENTIAL);
+
+        *mapping = (ds_io_mapping){.data = data, .size = size, .capacity = capacity, .mapped = true};
+        data = MAP_FAILED;
+        return_defer(0);
+    }
+
+    // Read the rest in one call when the size is known, with one byte more so
+    // that the read of the end of file does not grow the buffer
+    ds_io_source_init(&source, fd);
+    capacity = S_ISREG(st.st_mode) ? st.st_size + 1 : 0;
+    if (capacity < LINE_MAX) {
+        capacity = LINE_MAX;
+    }
+
+    mapping->data = DS_MALLOC(NULL, capacity + DS_IO_MAP_PADDING);
+    if (mapping->data == NULL) {
+        DS_LOG_ERROR("Failed to allocate buffer");
+        return_defer(1);
+    }
+    mapping->capacity = capacity + DS_IO_MAP_PADDING;
+
+    for (;;) {
+        if (mapping->size == capacity) {
+            char *grown = DS_REALLOC(NULL, mapping->data, mapping->capacity, capacity * 2 + DS_IO_MAP_PADDING);
+            if (grown == NULL) {
+                DS_LOG_ERROR("Failed to reallocate buffer");
+                return_defer(1);
+            }
+            mapping->data = grown;
+            capacity = capacity * 2;
+            mapping->capacity = capacity + DS_IO_MAP_PADDING;
+        }
+
+        long int count = ds_io_source_read(&source, mapping->data + mapping->size, capacity - mapping->size);
+        if (count < 0 && source.error != NULL) {
+            DS_LOG_ERROR("Failed to decompress file: %s", source.error);
+            return_defer(1);
+        }
+        if (count < 0) {
+            DS_LOG_ERROR("Failed to read file: %s", strerror(errno));
+            return_defer(1);
+        }
+        if (count == 0) {
+            break;
+        }
+        mapping->size += count;
     }
-    return hash % JSON_OBJECT_MAP_MAX_CAPACITY;
+
+    memset(mapping->data + mapping->size, 0, DS_IO_MAP_PADDING);
+
+defer:
+    ds_io_source_free(&source);
+    if (data != MAP_FAILED) {
+        munmap(data, capacity);
+    }
+    if (result != 0) {
+        ds_io_unmap(mapping);
+    }
+    if (filename != NULL && fd >= 0) {
+        close(fd);
+    }
+    return result;
 }
 
-static int json_object_compare(const void *k1, const void *k2) {
-    return strcmp((char *)k1, (char *)k2);
+// Release a mapping from ds_io_map
+DSHDEF void ds_io_unmap(ds_io_mapping *mapping) {
+    if (mapping->mapped == true) {
+        munmap(mapping->data, mapping->capacity);
+    } else if (mapping->data != NULL) {
+        DS_FREE(NULL, mapping->data);
+    }
+    *mapping = (ds_io_mapping){0};
 }
 
-static const char* json_token_kind_to_string(json_token_kind kind) {
-    switch (kind) {
-    case JSON_TOKEN_LBRACE: return "[";
-    case JSON_TOKEN_RBRACE: return "]";
-    case JSON_TOKEN_LSQRLY: return "{";
-    case JSON_TOKEN_RSQRLY: return "}";
-    case JSON_TOKEN_COLON: return ":";
-    case JSON_TOKEN_COMMA: return ",";
-    case JSON_TOKEN_BOOLEAN: return "boolean";
-    case JSON_TOKEN_NUMBER: return "number";
-    case JSON_TOKEN_STRING: return "string";
-    case JSON_TOKEN_NULL: return "null";
-    case JSON_TOKEN_EOF: return "<EOF>";
-    case JSON_TOKEN_ILLEGAL: return "ILLEGAL";
+typedef struct ds_io_batch {
+    const char **filenames;
+    size_t count;
+    size_t next;
+    ds_io_batch_callback callback;
+    void *user;
+    int result;
+} ds_io_batch;
+
+static void ds_io_batch_worker(void *arg) {
+    ds_io_batch *batch = (ds_io_batch *)arg;
+    size_t index = 0;
+
+    while ((index = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count) {
+        ds_io_mapping mapping;
+        if (ds_io_map(batch->filenames[index], &mapping) != 0) {
+            __atomic_store_n(&batch->result, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (batch->callback(index, batch->filenames[index], &mapping, batch->user) != 0) {
+            __atomic_store_n(&batch->result, 1, __ATOMIC_RELAXED);
+        }
+        ds_io_unmap(&mapping);
     }
 }
 
-static char json_lexer_peek_ch(json_lexer *lexer) {
-    if (lexer->read_pos >= lexer->buffer_len) {
-        return EOF;
+// Load many files
+//
+// Loads the files with ds_io_map on a thread pool and hands each one to the
+// callback as soon as it is loaded, so that the files can be parsed while the
+// rest are still being read. The files are taken in order, but the callbacks
+// can run at the same time and in any order. A file that fails to load is
+// reported and the rest are still loaded. The thread that calls this loads
+// files too, so the batch goes on even if the pool can not be started.
+//
+// Arguments:
+// - filenames: the names of the files to load
+// - count: the number of files
+// - threads: the number of threads, or 0 for DS_IO_BATCH_THREADS
+// - callback: the function to call for each file
+// - user: the pointer to pass to the callback
+//
+// Returns:
+// - 0 if all the files were loaded and handled, 1 if any of them failed
+DSHDEF int ds_io_map_batch(const char **filenames, size_t count, unsigned int threads, ds_io_batch_callback callback, void *user) {
+    ds_io_batch batch = {.filenames = filenames, .count = count, .callback = callback, .user = user};
+    ds_thread_pool pool = {0};
+
+    if (threads == 0) {
+        threads = DS_IO_BATCH_THREADS;
+    }
+    if (threads > count) {
+        threads = count;
     }
 
-    return lexer->buffer[lexer->read_pos];
-}
+    if (threads > 1 && ds_thread_pool_init(&pool, threads - 1) == 0) {
+        for (unsigned int i = 0; i < threads - 1; i++) {
+            ds_thread_pool_submit(&pool, ds_io_batch_worker, &batch);
+        }
+    }
 
-static char json_lexer_read(json_lexer *lexer) {
-    lexer->ch = json_lexer_peek_ch(lexer);
+    ds_io_batch_worker(&batch);
 
-    lexer->pos = lexer->read_pos;
-    lexer->read_pos += 1;
+    ds_thread_pool_free(&pool);
 
-    return lexer->ch;
+    return batch.result;
 }
 
-static void json_lexer_skip_whitespace(json_lexer *lexer) {
-    while (isspace(lexer->ch)) {
-        json_lexer_read(lexer);
+// Sleep until the condition holds. The waiting flag is set before the
+// condition is checked again, and the other side checks the flag after it
+// publishes its change, so a wake up cannot be missed.
+#define ds_io_stream_wait(stream, waiting, condition)                          \
+    do {                                                                       \
+        if (condition) {                                                       \
+            break;                                                             \
+        }                                                                      \
+        pthread_mutex_lock(&(stream)->lock);                                   \
+        __atomic_store_n(&(stream)->waiting, true, __ATOMIC_SEQ_CST);          \
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);                               \
+        while (!(condition)) {                                                 \
+            pthread_cond_wait(&(stream)->wake, &(stream)->lock);               \
+        }                                                                      \
+        __atomic_store_n(&(stream)->waiting, false, __ATOMIC_SEQ_CST);         \
+        pthread_mutex_unlock(&(stream)->lock);                                 \
+    } while (0)
+
+static void ds_io_stream_wake(ds_io_stream *stream, bool *waiting) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&stream->lock);
+        pthread_cond_broadcast(&stream->wake);
+        pthread_mutex_unlock(&stream->lock);
     }
 }
 
-static int json_lexer_init(json_lexer *lexer, const char *buffer, unsigned int buffer_len) {
-    lexer->buffer = buffer;
-    lexer->buffer_len = buffer_len;
-    lexer->pos = 0;
-    lexer->read_pos = 0;
-    lexer->ch = 0;
+static void *ds_io_stream_reader(void *arg) {
+    ds_io_stream *stream = (ds_io_stream *)arg;
+    ds_io_stream_buffer buffer;
 
-    json_lexer_read(lexer);
+#ifdef DS_AL_IMPLEMENTATION
+    ds_allocator_set_thread_default(stream->allocator);
+#endif // DS_AL_IMPLEMENTATION
 
-    return 0;
+    for (;;) {
+        ds_io_stream_wait(stream, reader_waiting, __atomic_load_n(&stream->stop, __ATOMIC_SEQ_CST) || !ds_spsc_ring_empty(&stream->empty));
+        if (__atomic_load_n(&stream->stop, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+        ds_spsc_ring_pop(&stream->empty, &buffer, 1);
+
+        // Hand over whatever one read returns instead of filling the buffer,
+        // so that data from a slow pipe is not held back
+        long int count = ds_io_source_read(&stream->source, buffer.data, DS_IO_STREAM_BUFFER_SIZE);
+        if (count <= 0) {
+            if (count < 0 && stream->source.error == NULL) {
+                stream->error = errno;
+            }
+            __atomic_store_n(&stream->done, true, __ATOMIC_SEQ_CST);
+            ds_io_stream_wake(stream, &stream->caller_waiting);
+            break;
+        }
+
+        // There is always room, since the rings can hold all the buffers
+        buffer.size = count;
+        ds_spsc_ring_push(&stream->filled, &buffer, 1);
+        ds_io_stream_wake(stream, &stream->caller_waiting);
+    }
+
+    return NULL;
 }
 
-static int json_lexer_tokenize_string(json_lexer *lexer, json_token *token) {
+// Start reading a file ahead
+//
+// Starts a thread that reads the file descriptor into DS_IO_STREAM_BUFFERS
+// buffers of DS_IO_STREAM_BUFFER_SIZE bytes, while the caller works on the
+// buffers that were read before. Compressed input is decompressed by the
+// same thread, as with ds_io_source, which uses the default allocator of the
+// calling thread. The file descriptor is not closed.
+//
+// Arguments:
+// - stream: the stream to initialize
+// - fd: the file descriptor to read
+//
+// Returns:
+// - 0 if the stream was started, 1 if it failed
+DSHDEF int ds_io_stream_open(ds_io_stream *stream, int fd) {
     int result = 0;
-    unsigned int position = lexer->pos;
-    char *value = NULL;
 
-    if (lexer->ch != '"') {
-        DS_LOG_ERROR("Failed to parse string: expected '\"' but got '%c'", lexer->ch);
+    *stream = (ds_io_stream){.cancel = {-1, -1}};
+    ds_io_source_init(&stream->source, fd);
+    if (pipe(stream->cancel) != 0) {
+        DS_LOG_ERROR("Failed to create the stream pipe: %s", strerror(errno));
+        stream->cancel[0] = stream->cancel[1] = -1;
         return_defer(1);
     }
+    stream->source.wake = stream->cancel[0];
+#ifdef DS_AL_IMPLEMENTATION
+    stream->allocator = ds_allocator_get_thread_default();
+#endif // DS_AL_IMPLEMENTATION
 
-    json_lexer_read(lexer);
+    stream->data = DS_MALLOC(NULL, (size_t)DS_IO_STREAM_BUFFERS * DS_IO_STREAM_BUFFER_SIZE);
+    if (stream->data == NULL) {
+        DS_LOG_ERROR("Failed to allocate the stream buffers");
+        return_defer(1);
+    }
+    if (ds_spsc_ring_init(&stream->empty, sizeof(ds_io_stream_buffer), DS_IO_STREAM_BUFFERS) != 0 ||
+        ds_spsc_ring_init(&stream->filled, sizeof(ds_io_stream_buffer), DS_IO_STREAM_BUFFERS) != 0) {
+        return_defer(1);
+    }
+    for (size_t i = 0; i < DS_IO_STREAM_BUFFERS; i++) {
+        ds_io_stream_buffer buffer = {.data = stream->data + i * DS_IO_STREAM_BUFFER_SIZE};
+        ds_spsc_ring_push(&stream->empty, &buffer, 1);
+    }
 
-    ds_string_slice slice = { .str = (char *)lexer->buffer + lexer->pos, .len = 0 };
-    while (lexer->ch != '"') {
-        char ch = lexer->ch;
-        slice.len += 1;
-        json_lexer_read(lexer);
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->wake, NULL);
+    if (pthread_create(&stream->thread, NULL, ds_io_stream_reader, stream) != 0) {
+        DS_LOG_ERROR("Failed to start the reader thread");
+        pthread_cond_destroy(&stream->wake);
+        pthread_mutex_destroy(&stream->lock);
+        return_defer(1);
+    }
 
-        if (ch == '\\' && lexer->ch == '"') {
-            slice.len += 1;
-            json_lexer_read(lexer);
+defer:
+    if (result != 0) {
+        ds_spsc_ring_free(&stream->empty);
+        ds_spsc_ring_free(&stream->filled);
+        if (stream->data != NULL) {
+            DS_FREE(NULL, stream->data);
+            stream->data = NULL;
+        }
+        if (stream->cancel[0] >= 0) {
+            close(stream->cancel[0]);
+            close(stream->cancel[1]);
         }
     }
+    return result;
+}
 
-    json_lexer_read(lexer);
+// Get the next buffer of a stream
+//
+// Waits until the reader thread has filled the next buffer. The buffer is
+// valid until ds_io_stream_release is called, and must be released before
+// the next one is taken.
+//
+// Arguments:
+// - stream: the stream to read
+// - data: set to the start of the buffer
+// - size: set to the size of the buffer, or 0 at the end of the file
+//
+// Returns:
+// - 0 if a buffer or the end of the file was reached, 1 if the read failed
+DSHDEF int ds_io_stream_next(ds_io_stream *stream, char **data, size_t *size) {
+    int result = 0;
 
-    *token = (json_token){.kind = JSON_TOKEN_STRING, .value = slice, .pos = position };
+    ds_io_stream_wait(stream, caller_waiting, !ds_spsc_ring_empty(&stream->filled) || __atomic_load_n(&stream->done, __ATOMIC_SEQ_CST));
+
+    // The reader is done only after its last buffer was pushed, so an empty
+    // ring at this point is the end of the file
+    if (ds_spsc_ring_pop(&stream->filled, &stream->current, 1) == 0) {
+        *data = NULL;
+        *size = 0;
+        if (stream->source.error != NULL) {
+            DS_LOG_ERROR("Failed to decompress file: %s", stream->source.error);
+            return_defer(1);
+        }
+        if (stream->error != 0) {
+            DS_LOG_ERROR("Failed to read file: %s", strerror(stream->error));
+            return_defer(1);
+        }
+        return_defer(0);
+    }
+
+    *data = stream->current.data;
+    *size = stream->current.size;
 
 defer:
     return result;
 }
 
-static int json_lexer_tokenize_ident(json_lexer *lexer, json_token *token) {
-    int result = 0;
-    unsigned int position = lexer->pos;
-    char *value = NULL;
+// Give the buffer from ds_io_stream_next back to the reader thread
+DSHDEF void ds_io_stream_release(ds_io_stream *stream) {
+    ds_spsc_ring_push(&stream->empty, &stream->current, 1);
+    ds_io_stream_wake(stream, &stream->reader_waiting);
+}
 
-    if (!islower(lexer->ch)) {
-        DS_LOG_ERROR("Failed to parse ident: expected islower but got '%c'", lexer->ch);
-        return_defer(1);
+// Stop a stream and free its buffers. The buffers that were not taken are
+// dropped. A read that waits for data, on a pipe that the writer keeps open,
+// is cancelled through the stream pipe, so this does not wait for the writer.
+DSHDEF void ds_io_stream_close(ds_io_stream *stream) {
+    if (stream->data == NULL) {
+        return;
     }
 
-    ds_string_slice slice = { .str = (char *)lexer->buffer + lexer->pos, .len = 0 };
-    while (islower(lexer->ch)) {
-        slice.len += 1;
-        json_lexer_read(lexer);
+    __atomic_store_n(&stream->stop, true, __ATOMIC_SEQ_CST);
+    ds_io_stream_wake(stream, &stream->reader_waiting);
+    while (write(stream->cancel[1], "", 1) < 0 && errno == EINTR) {
+        continue;
+    }
+    pthread_join(stream->thread, NULL);
+    close(stream->cancel[0]);
+    close(stream->cancel[1]);
+    pthread_cond_destroy(&stream->wake);
+    pthread_mutex_destroy(&stream->lock);
+    ds_io_source_free(&stream->source);
+    ds_spsc_ring_free(&stream->empty);
+    ds_spsc_ring_free(&stream->filled);
+    DS_FREE(NULL, stream->data);
+    *stream = (ds_io_stream){0};
+}
+
+#endif // DS_IO_IMPLEMENTATION
+
+#ifdef DS_TP_IMPLEMENTATION
+
+#include <unistd.h>
+#include <pthread.h>
+
+// The queue of the pool thread that is running, if any
+static __thread ds_thread_pool_queue *ds_thread_pool_own = NULL;
+
+static bool ds_thread_pool_take(ds_thread_pool *pool, ds_thread_pool_queue *own, ds_thread_pool_job *job) {
+    unsigned int start = own - pool->queues;
+
+    for (unsigned int i = 0; i < pool->count; i++) {
+        if (ds_mpmc_ring_pop(&pool->queues[(start + i) % pool->count].jobs, job, 1) == 1) {
+            return true;
+        }
     }
 
-    if (ds_string_slice_to_owned(&slice, &value) != 0) {
-        DS_LOG_ERROR("Failed to allocate string");
-        return_defer(1);
+    return false;
+}
+
+static void ds_thread_pool_finish(ds_thread_pool *pool) {
+    if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->idle);
+        pthread_mutex_unlock(&pool->lock);
     }
+}
 
-    if (strcmp(value, "null") == 0) {
-        *token = (json_token){.kind = JSON_TOKEN_NULL, .value = 0, .pos = position };
-    } else if (strcmp(value, "true") == 0 || strcmp(value, "false") == 0) {
-        *token = (json_token){.kind = JSON_TOKEN_BOOLEAN, .value = slice, .pos = position };
-    } else {
-        *token = (json_token){.kind = JSON_TOKEN_ILLEGAL, .value = slice, .pos = position };
+static void *ds_thread_pool_worker(void *arg) {
+    ds_thread_pool_queue *own = (ds_thread_pool_queue *)arg;
+    ds_thread_pool *pool = own->pool;
+    ds_thread_pool_job job;
+
+    ds_thread_pool_own = own;
+#ifdef DS_AL_IMPLEMENTATION
+    ds_allocator_set_thread_default(pool->allocator);
+#endif // DS_AL_IMPLEMENTATION
+
+    for (;;) {
+        if (ds_thread_pool_take(pool, own, &job) == true) {
+            __atomic_fetch_sub(&pool->queued, 1, __ATOMIC_SEQ_CST);
+            job.task(job.arg);
+            ds_thread_pool_finish(pool);
+            continue;
+        }
+
+        // Count the thread as sleeping before it checks for work, so that a
+        // submit either sees it sleeping or its task is seen here
+        pthread_mutex_lock(&pool->lock);
+        __atomic_fetch_add(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) <= 0 && pool->stop == false) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        __atomic_fetch_sub(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+        bool stop = pool->stop == true && __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) <= 0;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (stop == true) {
+            break;
+        }
     }
 
-defer:
-    DS_FREE(NULL, value);
-    return result;
+    ds_thread_pool_own = NULL;
+    return NULL;
 }
 
-static int json_lexer_tokenize_number(json_lexer *lexer, json_token *token) {
+// Start a thread pool
+//
+// Starts the threads of the pool, which wait for tasks. The threads use the
+// default allocator of the calling thread.
+//
+// Arguments:
+// - pool: the pool to initialize
+// - threads: the number of threads, or 0 for one per core
+//
+// Returns 0 if the pool was started. Returns 1 if it failed
+DSHDEF int ds_thread_pool_init(ds_thread_pool *pool, unsigned int threads) {
     int result = 0;
-    unsigned int position = lexer->pos;
-    char *value = NULL;
+    unsigned int started = 0;
 
-    int found_dot = 0;
+    *pool = (ds_thread_pool){0};
+#ifdef DS_AL_IMPLEMENTATION
+    pool->allocator = ds_allocator_get_thread_default();
+#endif // DS_AL_IMPLEMENTATION
+    if (threads == 0) {
+        long int cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? cores : 1;
+    }
 
-    if (!(isdigit(lexer->ch) || lexer->ch == '.' || lexer->ch == '-')) {
-        DS_LOG_ERROR("Failed to parse number: expected digit, '.' or '-' but got '%c'", lexer->ch);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    pool->threads = DS_MALLOC(NULL, threads * sizeof(pthread_t));
+    pool->queues = DS_MALLOC(NULL, threads * sizeof(ds_thread_pool_queue));
+    if (pool->threads == NULL || pool->queues == NULL) {
+        DS_LOG_ERROR("Failed to allocate the thread pool");
         return_defer(1);
     }
 
-    ds_string_slice slice = { .str = (char *)lexer->buffer + lexer->pos, .len = 0 };
+    for (; pool->count < threads; pool->count++) {
+        pool->queues[pool->count] = (ds_thread_pool_queue){.pool = pool};
+        if (ds_mpmc_ring_init(&pool->queues[pool->count].jobs, sizeof(ds_thread_pool_job), DS_THREAD_POOL_QUEUE_SIZE) != 0) {
+            return_defer(1);
+        }
+    }
 
-    if (lexer->ch == '-') {
-        slice.len += 1;
-        json_lexer_read(lexer);
+    for (; started < threads; started++) {
+        if (pthread_create(&pool->threads[started], NULL, ds_thread_pool_worker, &pool->queues[started]) != 0) {
+            DS_LOG_ERROR("Failed to start a thread of the pool");
+            return_defer(1);
+        }
     }
 
-    while (isdigit(lexer->ch) || (lexer->ch == '.' && found_dot == 0)) {
-        if (lexer->ch == '.') {
-            found_dot = 1;
+defer:
+    if (result != 0) {
+        // Stop the threads that did start
+        pthread_mutex_lock(&pool->lock);
+        pool->stop = true;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+        for (unsigned int i = 0; i < started; i++) {
+            pthread_join(pool->threads[i], NULL);
         }
+        for (unsigned int i = 0; i < pool->count; i++) {
+            ds_mpmc_ring_free(&pool->queues[i].jobs);
+        }
+        if (pool->threads != NULL) {
+            DS_FREE(NULL, pool->threads);
+        }
+        if (pool->queues != NULL) {
+            DS_FREE(NULL, pool->queues);
+        }
+        pthread_cond_destroy(&pool->idle);
+        pthread_cond_destroy(&pool->work);
+        pthread_mutex_destroy(&pool->lock);
+        *pool = (ds_thread_pool){0};
+    }
+    return result;
+}
 
-        slice.len += 1;
-        json_lexer_read(lexer);
+// Submit a task
+//
+// Queues the task to run on one of the threads of the pool. It can be called
+// from a task, and then the task goes to the queue of the same thread. When
+// all the queues are full the task runs before this returns.
+//
+// Arguments:
+// - pool: the thread pool
+// - task: the function to run
+// - arg: the argument to pass to the function
+//
+// Returns 0 if the task was queued or run
+DSHDEF int ds_thread_pool_submit(ds_thread_pool *pool, ds_thread_pool_task task, void *arg) {
+    ds_thread_pool_job job = {.task = task, .arg = arg};
+    ds_thread_pool_queue *queue = ds_thread_pool_own;
+    unsigned int start;
+
+    if (queue != NULL && queue->pool == pool) {
+        start = queue - pool->queues;
+    } else {
+        start = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) % pool->count;
     }
 
-    *token = (json_token){.kind = JSON_TOKEN_NUMBER, .value = slice, .pos = position };
+    // Count the task as pending before any thread can finish it
+    __atomic_fetch_add(&pool->pending, 1, __ATOMIC_SEQ_CST);
 
-defer:
-    return result;
+    for (unsigned int i = 0; i < pool->count; i++) {
+        if (ds_mpmc_ring_push(&pool->queues[(start + i) % pool->count].jobs, &job, 1) == 1) {
+            __atomic_fetch_add(&pool->queued, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&pool->sleeping, __ATOMIC_SEQ_CST) > 0) {
+                pthread_mutex_lock(&pool->lock);
+                pthread_cond_signal(&pool->work);
+                pthread_mutex_unlock(&pool->lock);
+            }
+            return 0;
+        }
+    }
+
+    // Running the task here slows down the submitter until the threads have
+    // caught up, instead of growing the queues without bound
+    task(arg);
+    ds_thread_pool_finish(pool);
+
+    return 0;
 }
 
-static int json_lexer_next(json_lexer *lexer, json_token *token) {
-    int result = 0;
-    json_lexer_skip_whitespace(lexer);
+// Wait until all the tasks that were submitted have finished, including the
+// tasks they submitted. It must not be called from a task of the same pool.
+DSHDEF void ds_thread_pool_wait(ds_thread_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
 
-    unsigned int position = lexer->pos;
-    if (lexer->ch == EOF) {
-        json_lexer_read(lexer);
-        *token = (json_token){.kind = JSON_TOKEN_EOF, .value = 0, .pos = position };
-        return_defer(0);
-    } else if (lexer->ch == '{') {
-        json_lexer_read(lexer);
-        *token = (json_token){.kind = JSON_TOKEN_LSQRLY, .value = 0, .pos = position };
-        return_defer(0);
-    } else if (lexer->ch == '}') {
+// Wait for the tasks to finish, then stop the threads and free the pool
+DSHDEF void ds_thread_pool_free(ds_thread_pool *pool) {
+    if (pool->threads == NULL) {
+        return;
+    }
+
+    ds_thread_pool_wait(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned int i = 0; i < pool->count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    for (unsigned int i = 0; i < pool->count; i++) {
+        ds_mpmc_ring_free(&pool->queues[i].jobs);
+    }
+    DS_FREE(NULL, pool->threads);
+    DS_FREE(NULL, pool->queues);
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    *pool = (ds_thread_pool){0};
+}
+
+#endif // DS_TP_IMPLEMENTATION
+
+#ifdef DS_JS_IMPLEMENTATION
+
+#include <math.h>
+#include <time.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <locale.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif // IOV_MAX
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#endif
+
+typedef enum json_token_kind {
+    JSON_TOKEN_LBRACE,
+    JSON_TOKEN_RBRACE,
+    JSON_TOKEN_LSQRLY,
+    JSON_TOKEN_RSQRLY,
+    JSON_TOKEN_COLON,
+    JSON_TOKEN_COMMA,
+    JSON_TOKEN_BOOLEAN,
+    JSON_TOKEN_NUMBER,
+    JSON_TOKEN_STRING,
+    JSON_TOKEN_NULL,
+    JSON_TOKEN_EOF,
+    JSON_TOKEN_ILLEGAL,
+} json_token_kind;
+
+typedef struct json_token {
+    json_token_kind kind;
+    ds_string_slice value;
+    size_t pos;
+} json_token;
+
+typedef struct json_lexer {
+    const char *buffer;
+    size_t buffer_len;
+    size_t pos;
+    size_t read_pos;
+    char ch;
+    size_t skipped; /* whitespace bytes skipped so far */
+} json_lexer;
+
+typedef struct json_parser {
+    json_lexer lexer;
+    bool keep_source;
+} json_parser;
+
+// Hash function for the map keys
+//
+// This is a wyhash style function: it reads the key 8 bytes at a time and
+// mixes them with 64x64 to 128 bit multiplications. The seed is random for
+// each process, unless JSON_OBJECT_HASH_SEED is defined, so that the hashes of
+// the keys can not be predicted by the input.
+static const unsigned long long json_object_hash_secret[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+    0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull,
+};
+
+static unsigned long long json_object_hash_seed_value = 0;
+
+static unsigned long long json_object_hash_seed(void) {
+    unsigned long long seed = __atomic_load_n(&json_object_hash_seed_value, __ATOMIC_ACQUIRE);
+    if (seed != 0) {
+        return seed;
+    }
+
+#if defined(JSON_OBJECT_HASH_SEED)
+    seed = JSON_OBJECT_HASH_SEED;
+#elif defined(__unix__) || defined(__APPLE__)
+    if (getentropy(&seed, sizeof(seed)) != 0) {
+        seed = (unsigned long long)time(NULL) ^ (unsigned long long)(unsigned long)&seed;
+    }
+#else
+    seed = (unsigned long long)time(NULL) ^ (unsigned long long)(unsigned long)&seed;
+#endif
+    if (seed == 0) {
+        seed = json_object_hash_secret[0];
+    }
+
+    unsigned long long expected = 0;
+    if (!__atomic_compare_exchange_n(&json_object_hash_seed_value, &expected, seed, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        seed = expected;
+    }
+
+    return seed;
+}
+
+static inline void json_object_hash_mum(unsigned long long *a, unsigned long long *b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (unsigned long long)r;
+    *b = (unsigned long long)(r >> 64);
+#else
+    unsigned long long ha = *a >> 32, hb = *b >> 32, la = (unsigned int)*a, lb = (unsigned int)*b;
+    unsigned long long rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    unsigned long long t = rl + (rm0 << 32), c = t < rl;
+    unsigned long long lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline unsigned long long json_object_hash_mix(unsigned long long a, unsigned long long b) {
+    json_object_hash_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline unsigned long long json_object_hash_read8(const unsigned char *p) {
+    unsigned long long v;
+    DS_MEMCPY(&v, p, 8);
+    return v;
+}
+
+static inline unsigned long long json_object_hash_read4(const unsigned char *p) {
+    unsigned int v;
+    DS_MEMCPY(&v, p, 4);
+    return v;
+}
+
+static unsigned int json_object_hash_len(const char *name, size_t len) {
+    const unsigned long long *secret = json_object_hash_secret;
+    const unsigned char *p = (const unsigned char *)name;
+    unsigned long long seed = json_object_hash_seed();
+    unsigned long long a, b;
+
+    seed ^= json_object_hash_mix(seed ^ secret[0], secret[1]);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (json_object_hash_read4(p) << 32) | json_object_hash_read4(p + ((len >> 3) << 2));
+            b = (json_object_hash_read4(p + len - 4) << 32) | json_object_hash_read4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((unsigned long long)p[0] << 16) | ((unsigned long long)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            unsigned long long see1 = seed, see2 = seed;
+            do {
+                seed = json_object_hash_mix(json_object_hash_read8(p) ^ secret[1], json_object_hash_read8(p + 8) ^ seed);
+                see1 = json_object_hash_mix(json_object_hash_read8(p + 16) ^ secret[2], json_object_hash_read8(p + 24) ^ see1);
+                see2 = json_object_hash_mix(json_object_hash_read8(p + 32) ^ secret[3], json_object_hash_read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = json_object_hash_mix(json_object_hash_read8(p) ^ secret[1], json_object_hash_read8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = json_object_hash_read8(p + i - 16);
+        b = json_object_hash_read8(p + i - 8);
+    }
+
+    a ^= secret[1];
+    b ^= seed;
+    json_object_hash_mum(&a, &b);
+    unsigned long long hash = json_object_hash_mix(a ^ secret[0] ^ len, b ^ secret[1]);
+
+    return (unsigned int)(hash ^ (hash >> 32));
+}
+
+static unsigned int json_object_hash(const void *key) {
+    return json_object_hash_len((const char *)key, strlen((const char *)key));
+}
+
+static int json_object_compare(const void *k1, const void *k2) {
+    return strcmp((char *)k1, (char *)k2);
+}
+
+static const char* json_token_kind_to_string(json_token_kind kind) {
+    switch (kind) {
+    case JSON_TOKEN_LBRACE: return "[";
+    case JSON_TOKEN_RBRACE: return "]";
+    case JSON_TOKEN_LSQRLY: return "{";
+    case JSON_TOKEN_RSQRLY: return "}";
+    case JSON_TOKEN_COLON: return ":";
+    case JSON_TOKEN_COMMA: return ",";
+    case JSON_TOKEN_BOOLEAN: return "boolean";
+    case JSON_TOKEN_NUMBER: return "number";
+    case JSON_TOKEN_STRING: return "string";
+    case JSON_TOKEN_NULL: return "null";
+    case JSON_TOKEN_EOF: return "<EOF>";
+    case JSON_TOKEN_ILLEGAL: return "ILLEGAL";
+    }
+}
+
+static char json_lexer_peek_ch(json_lexer *lexer) {
+    if (lexer->read_pos >= lexer->buffer_len) {
+        return EOF;
+    }
+
+    return lexer->buffer[lexer->read_pos];
+}
+
+static char json_lexer_read(json_lexer *lexer) {
+    lexer->ch = json_lexer_peek_ch(lexer);
+
+    lexer->pos = lexer->read_pos;
+    lexer->read_pos += 1;
+
+    return lexer->ch;
+}
+
+static void json_lexer_skip_whitespace(json_lexer *lexer) {
+    while (isspace(lexer->ch)) {
         json_lexer_read(lexer);
-        *token = (json_token){.kind = JSON_TOKEN_RSQRLY, .value = 0, .pos = position };
-        return_defer(0);
-    } else if (lexer->ch == '[') {
+        lexer->skipped += 1;
+    }
+}
+
+static int json_lexer_init(json_lexer *lexer, const char *buffer, size_t buffer_len) {
+    lexer->buffer = buffer;
+    lexer->buffer_len = buffer_len;
+    lexer->pos = 0;
+    lexer->read_pos = 0;
+    lexer->ch = 0;
+
+    json_lexer_read(lexer);
+
+    return 0;
+}
+
+static int json_lexer_pos_to_lc(json_lexer *lexer, size_t pos, size_t *line, size_t *column);
+
+static int json_lexer_tokenize_string(json_lexer *lexer, json_token *token) {
+    int result = 0;
+    size_t position = lexer->pos;
+    char *value = NULL;
+
+    if (lexer->ch != '"') {
+        DS_LOG_ERROR("Failed to parse string: expected '\"' but got '%c'", lexer->ch);
+        return_defer(1);
+    }
+
+    json_lexer_read(lexer);
+
+    ds_string_slice slice = { .str = (char *)lexer->buffer + lexer->pos, .len = 0 };
+    while (lexer->pos < lexer->buffer_len && lexer->ch != '"') {
+        if (lexer->ch == '\0') {
+            size_t line, column;
+            json_lexer_pos_to_lc(lexer, lexer->pos, &line, &column);
+            DS_LOG_ERROR("Unsupported NUL byte in string at %zu:%zu", line, column);
+            return_defer(1);
+        }
+        if (lexer->ch == '\\') {
+            slice.len += 1;
+            json_lexer_read(lexer);
+            if (lexer->pos >= lexer->buffer_len) {
+                break;
+            }
+        }
+
+        slice.len += 1;
         json_lexer_read(lexer);
-        *token = (json_token){.kind = JSON_TOKEN_LBRACE, .value = 0, .pos = position };
-        return_defer(0);
-    } else if (lexer->ch == ']') {
+    }
+
+    if (lexer->pos >= lexer->buffer_len) {
+        size_t line, column;
+        json_lexer_pos_to_lc(lexer, position, &line, &column);
+        DS_LOG_ERROR("Unterminated string at %zu:%zu", line, column);
+        return_defer(1);
+    }
+
+    json_lexer_read(lexer);
+
+    *token = (json_token){.kind = JSON_TOKEN_STRING, .value = slice, .pos = position };
+
+defer:
+    return result;
+}
+
+static int json_lexer_tokenize_ident(json_lexer *lexer, json_token *token) {
+    int result = 0;
+    size_t position = lexer->pos;
+    char *value = NULL;
+
+    if (!islower(lexer->ch)) {
+        DS_LOG_ERROR("Failed to parse ident: expected islower but got '%c'", lexer->ch);
+        return_defer(1);
+    }
+
+    ds_string_slice slice = { .str = (char *)lexer->buffer + lexer->pos, .len = 0 };
+    while (islower(lexer->ch)) {
+        slice.len += 1;
         json_lexer_read(lexer);
-        *token = (json_token){.kind = JSON_TOKEN_RBRACE, .value = 0, .pos = position };
-        return_defer(0);
-    } else if (lexer->ch == ':') {
+    }
+
+    if (ds_string_slice_to_owned(&slice, &value) != 0) {
+        DS_LOG_ERROR("Failed to allocate string");
+        return_defer(1);
+    }
+
+    if (strcmp(value, "null") == 0) {
+        *token = (json_token){.kind = JSON_TOKEN_NULL, .value = 0, .pos = position };
+    } else if (strcmp(value, "true") == 0 || strcmp(value, "false") == 0) {
+        *token = (json_token){.kind = JSON_TOKEN_BOOLEAN, .value = slice, .pos = position };
+    } else {
+        *token = (json_token){.kind = JSON_TOKEN_ILLEGAL, .value = slice, .pos = position };
+    }
+
+defer:
+    DS_FREE(NULL, value);
+    return result;
+}
+
+static int json_lexer_tokenize_number(json_lexer *lexer, json_token *token) {
+    int result = 0;
+    size_t position = lexer->pos;
+    char *value = NULL;
+
+    int found_dot = 0;
+
+    if (!(isdigit(lexer->ch) || lexer->ch == '.' || lexer->ch == '-')) {
+        DS_LOG_ERROR("Failed to parse number: expected digit, '.' or '-' but got '%c'", lexer->ch);
+        return_defer(1);
+    }
+
+    ds_string_slice slice = { .str = (char *)lexer->buffer + lexer->pos, .len = 0 };
+
+    if (lexer->ch == '-') {
+        slice.len += 1;
         json_lexer_read(lexer);
-        *token = (json_token){.kind = JSON_TOKEN_COLON, .value = 0, .pos = position };
-        return_defer(0);
-    } else if (lexer->ch == ',') {
+    }
+
+    while (isdigit(lexer->ch) || (lexer->ch == '.' && found_dot == 0)) {
+        if (lexer->ch == '.') {
+            found_dot = 1;
+        }
+
+        slice.len += 1;
         json_lexer_read(lexer);
-        *token = (json_token){.kind = JSON_TOKEN_COMMA, .value = 0, .pos = position };
-        return_defer(0);
-    } else if (lexer->ch == '"') {
-        return_defer(json_lexer_tokenize_string(lexer, token));
-    } else if (islower(lexer->ch)) {
-        return_defer(json_lexer_tokenize_ident(lexer, token));
-    } else if (isdigit(lexer->ch) || lexer->ch == '.' || lexer->ch == '-') {
-        return_defer(json_lexer_tokenize_number(lexer, token));
-    } else {
-        char *value = NULL;
-        ds_string_slice slice = { .str = (char *)lexer->buffer + lexer->pos, .len = 1 };
+    }
 
+    if (lexer->ch == 'e' || lexer->ch == 'E') {
+        slice.len += 1;
         json_lexer_read(lexer);
 
-        *token = (json_token){.kind = JSON_TOKEN_ILLEGAL, .value = slice, .pos = position };
+        if (lexer->ch == '+' || lexer->ch == '-') {
+            slice.len += 1;
+            json_lexer_read(lexer);
+        }
+
+        while (isdigit(lexer->ch)) {
+            slice.len += 1;
+            json_lexer_read(lexer);
+        }
+    }
+
+    *token = (json_token){.kind = JSON_TOKEN_NUMBER, .value = slice, .pos = position };
+
+defer:
+    return result;
+}
+
+static int json_lexer_next(json_lexer *lexer, json_token *token) {
+    int result = 0;
+    json_lexer_skip_whitespace(lexer);
+
+    size_t position = lexer->pos;
+    if (lexer->ch == EOF) {
+        json_lexer_read(lexer);
+        *token = (json_token){.kind = JSON_TOKEN_EOF, .value = 0, .pos = position };
+        return_defer(0);
+    } else if (lexer->ch == '{') {
+        json_lexer_read(lexer);
+        *token = (json_token){.kind = JSON_TOKEN_LSQRLY, .value = 0, .pos = position };
+        return_defer(0);
+    } else if (lexer->ch == '}') {
+        json_lexer_read(lexer);
+        *token = (json_token){.kind = JSON_TOKEN_RSQRLY, .value = 0, .pos = position };
+        return_defer(0);
+    } else if (lexer->ch == '[') {
+        json_lexer_read(lexer);
+        *token = (json_token){.kind = JSON_TOKEN_LBRACE, .value = 0, .pos = position };
+        return_defer(0);
+    } else if (lexer->ch == ']') {
+        json_lexer_read(lexer);
+        *token = (json_token){.kind = JSON_TOKEN_RBRACE, .value = 0, .pos = position };
+        return_defer(0);
+    } else if (lexer->ch == ':') {
+        json_lexer_read(lexer);
+        *token = (json_token){.kind = JSON_TOKEN_COLON, .value = 0, .pos = position };
+        return_defer(0);
+    } else if (lexer->ch == ',') {
+        json_lexer_read(lexer);
+        *token = (json_token){.kind = JSON_TOKEN_COMMA, .value = 0, .pos = position };
+        return_defer(0);
+    } else if (lexer->ch == '"') {
+        return_defer(json_lexer_tokenize_string(lexer, token));
+    } else if (islower(lexer->ch)) {
+        return_defer(json_lexer_tokenize_ident(lexer, token));
+    } else if (isdigit(lexer->ch) || lexer->ch == '.' || lexer->ch == '-') {
+        return_defer(json_lexer_tokenize_number(lexer, token));
+    } else {
+        char *value = NULL;
+        ds_string_slice slice = { .str = (char *)lexer->buffer + lexer->pos, .len = 1 };
+
+        json_lexer_read(lexer);
+
+        *token = (json_token){.kind = JSON_TOKEN_ILLEGAL, .value = slice, .pos = position };
+
+        return_defer(0);
+    }
+
+defer:
+    return result;
+}
+
+static int json_lexer_peek(json_lexer *lexer, json_token *token) {
+    size_t pos = lexer->pos;
+    size_t read_pos = lexer->read_pos;
+    unsigned int ch = lexer->ch;
+    size_t skipped = lexer->skipped;
+
+    int result = json_lexer_next(lexer, token);
+
+    lexer->pos = pos;
+    lexer->read_pos = read_pos;
+    lexer->ch = ch;
+    lexer->skipped = skipped;
+
+    return result;
+}
+
+static int json_lexer_pos_to_lc(json_lexer *lexer, size_t pos, size_t *line, size_t *column) {
+    int result = 0;
+    size_t n = (pos > lexer->buffer_len) ? lexer->buffer_len : pos;
+
+    *line = 1;
+    *column = 1;
+
+    for (size_t i = 0; i < n; i++) {
+        if (lexer->buffer[i] == '\n') {
+            *line += 1;
+            *column = 0;
+        } else {
+            *column += 1;
+        }
+    }
+
+defer:
+    return result;
+}
+
+static void json_lexer_free(json_lexer *lexer) {
+    lexer->buffer = NULL;
+    lexer->buffer_len = 0;
+    lexer->pos = 0;
+    lexer->read_pos = 0;
+    lexer->ch = 0;
+}
+
+static int json_parser_init(json_parser *parser, json_lexer lexer) {
+    parser->lexer = lexer;
+
+    return 0;
+}
+
+static int json_hex_digit(char ch) {
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    } else if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    } else if (ch >= 'A' && ch <= 'F') {
+        return ch - 'A' + 10;
+    }
+    return -1;
+}
+
+// Read the 4 hex digits of a \u escape
+static int json_string_read_hex4(const char *str, unsigned int len, unsigned int *code) {
+    *code = 0;
+
+    if (len < 4) {
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < 4; i++) {
+        int digit = json_hex_digit(str[i]);
+        if (digit < 0) {
+            return 1;
+        }
+        *code = (*code << 4) | digit;
+    }
+
+    return 0;
+}
+
+static unsigned int json_utf8_encode(unsigned int code, char *out) {
+    if (code < 0x80) {
+        out[0] = (char)code;
+        return 1;
+    } else if (code < 0x800) {
+        out[0] = (char)(0xC0 | (code >> 6));
+        out[1] = (char)(0x80 | (code & 0x3F));
+        return 2;
+    } else if (code < 0x10000) {
+        out[0] = (char)(0xE0 | (code >> 12));
+        out[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (code & 0x3F));
+        return 3;
+    } else {
+        out[0] = (char)(0xF0 | (code >> 18));
+        out[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+        out[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+        out[3] = (char)(0x80 | (code & 0x3F));
+        return 4;
+    }
+}
+
+// Decode the escape sequences of a string token into an owned string
+//
+// The runs between escapes are copied as they are. A \u escape is written as
+// UTF-8, surrogate pairs are combined and lone surrogates become U+FFFD. The
+// decoded string is never longer than the token.
+//
+// Returns 0 if the string is valid. Returns 1 if it has an invalid escape
+static int json_string_unescape(ds_string_slice *slice, char **string, size_t *len) {
+    int result = 0;
+    const char *src = slice->str;
+    size_t n = slice->len;
+    size_t i = 0;
+    size_t j = 0;
+    char *dst = NULL;
+
+    dst = DS_MALLOC(NULL, n + 1);
+    if (dst == NULL) {
+        DS_LOG_ERROR("Failed to allocate string");
+        return_defer(1);
+    }
+
+    while (i < n) {
+        const char *escape = memchr(src + i, '\\', n - i);
+        size_t run = (escape != NULL) ? (size_t)(escape - (src + i)) : n - i;
+
+        DS_MEMCPY(dst + j, src + i, run);
+        i += run;
+        j += run;
+
+        if (i >= n) {
+            break;
+        }
+
+        // The lexer ensures that a backslash is always followed by a character
+        char ch = src[i + 1];
+        i += 2;
+
+        switch (ch) {
+        case '"': dst[j++] = '"'; break;
+        case '\\': dst[j++] = '\\'; break;
+        case '/': dst[j++] = '/'; break;
+        case 'b': dst[j++] = '\b'; break;
+        case 'f': dst[j++] = '\f'; break;
+        case 'n': dst[j++] = '\n'; break;
+        case 'r': dst[j++] = '\r'; break;
+        case 't': dst[j++] = '\t'; break;
+        case 'u': {
+            unsigned int code = 0;
+            if (json_string_read_hex4(src + i, n - i, &code) != 0) {
+                DS_LOG_ERROR("Invalid unicode escape in string");
+                return_defer(1);
+            }
+            i += 4;
+
+            // The strings and keys end at their first NUL, which would cut
+            // them short
+            if (code == 0) {
+                DS_LOG_ERROR("Unsupported \\u0000 escape in string");
+                return_defer(1);
+            }
+
+            if (code >= 0xD800 && code <= 0xDBFF) {
+                unsigned int low = 0;
+                if (i + 6 <= n && src[i] == '\\' && src[i + 1] == 'u' &&
+                    json_string_read_hex4(src + i + 2, n - i - 2, &low) == 0 &&
+                    low >= 0xDC00 && low <= 0xDFFF) {
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    i += 6;
+                } else {
+                    code = 0xFFFD;
+                }
+            } else if (code >= 0xDC00 && code <= 0xDFFF) {
+                code = 0xFFFD;
+            }
+
+            j += json_utf8_encode(code, dst + j);
+            break;
+        }
+        default:
+            DS_LOG_ERROR("Invalid escape sequence '\\%c' in string", ch);
+            return_defer(1);
+        }
+    }
+
+    dst[j] = '\0';
+    *string = dst;
+    *len = j;
+    dst = NULL;
+
+defer:
+    if (dst != NULL) {
+        DS_FREE(NULL, dst);
+    }
+    return result;
+}
+
+static int json_parser_parse_object(json_parser *parser, json_object *object);
+static int json_parser_parse_map(json_parser *parser, json_object *object);
+static int json_parser_parse_array(json_parser *parser, json_object *object);
+
+static int json_parser_parse_object(json_parser *parser, json_object *object) {
+    int result = 0;
+    json_token token = {0};
+    size_t skipped = 0;
+
+    *object = (json_object){0};
+
+    if (json_lexer_next(&parser->lexer, &token) != 0) {
+        DS_LOG_ERROR("Failed to get the next token");
+        return_defer(1);
+    }
+    skipped = parser->lexer.skipped;
+
+    if (token.kind == JSON_TOKEN_LSQRLY) {
+        result = json_parser_parse_map(parser, object);
+    } else if (token.kind == JSON_TOKEN_LBRACE) {
+        result = json_parser_parse_array(parser, object);
+    } else if (token.kind == JSON_TOKEN_STRING) {
+        size_t len = 0;
+        object->kind = JSON_OBJECT_STRING;
+        if (json_string_unescape(&token.value, &object->string, &len) != 0) {
+            DS_LOG_ERROR("Failed to decode string");
+            return_defer(1);
+        }
+    } else if (token.kind == JSON_TOKEN_NUMBER) {
+        char *value = NULL;
+        object->kind = JSON_OBJECT_NUMBER;
+        if (ds_string_slice_to_owned(&token.value, &value) != 0) {
+            DS_LOG_ERROR("Failed to allocate string");
+            return_defer(1);
+        }
+        object->number = atof(value);
+        DS_FREE(NULL, value);
+    } else if (token.kind == JSON_TOKEN_BOOLEAN) {
+        char *value = NULL;
+        object->kind = JSON_OBJECT_BOOLEAN;
+        if (ds_string_slice_to_owned(&token.value, &value) != 0) {
+            DS_LOG_ERROR("Failed to allocate string");
+            return_defer(1);
+        }
+        object->boolean = (strcmp(value, "true") == 0) ? true : false;
+        DS_FREE(NULL, value);
+    } else if (token.kind == JSON_TOKEN_NULL) {
+        object->kind = JSON_OBJECT_NULL;
+    } else {
+        size_t line, column;
+        json_lexer_pos_to_lc(&parser->lexer, token.pos, &line, &column);
+        DS_LOG_ERROR("Expected a json object but found %s at %zu:%zu", json_token_kind_to_string(token.kind), line, column);
+        return_defer(1);
+    }
+
+    // Only the values without whitespace keep their text, so that a minified
+    // dump stays minified
+    if (result == 0 && parser->keep_source == true && parser->lexer.skipped == skipped) {
+        object->source = parser->lexer.buffer + token.pos;
+        object->source_len = parser->lexer.pos - token.pos;
+    }
+
+defer:
+    return result;
+}
+
+static int json_parser_parse_map(json_parser *parser, json_object *object) {
+    int result = 0;
+    json_token token = {0};
+
+    object->kind = JSON_OBJECT_MAP;
+    ds_hashmap_init(&object->map, JSON_OBJECT_MAP_INIT_CAPACITY, json_object_hash, json_object_compare);
+
+    if (json_lexer_next(&parser->lexer, &token) != 0) {
+        DS_LOG_ERROR("Failed to get the next token");
+        return_defer(1);
+    }
+
+    if (token.kind == JSON_TOKEN_RSQRLY) {
+        return_defer(0);
+    }
+
+    while (token.kind != JSON_TOKEN_RSQRLY) {
+        ds_hashmap_kv kv = {0};
+
+        if (token.kind != JSON_TOKEN_STRING) {
+            size_t line, column;
+            json_lexer_pos_to_lc(&parser->lexer, token.pos, &line, &column);
+            DS_LOG_ERROR("Expected a string but found %s at %zu:%zu", json_token_kind_to_string(token.kind), line, column);
+            return_defer(1);
+        }
+
+        size_t key_len = 0;
+        if (json_string_unescape(&token.value, (char **)&kv.key, &key_len) != 0) {
+            DS_LOG_ERROR("Failed to decode key");
+            return_defer(1);
+        }
+        kv.hash = json_object_hash_len((const char *)kv.key, key_len);
+
+        if (json_lexer_next(&parser->lexer, &token) != 0) {
+            DS_LOG_ERROR("Failed to get the next token");
+            return_defer(1);
+        }
+
+        if (token.kind != JSON_TOKEN_COLON) {
+            size_t line, column;
+            json_lexer_pos_to_lc(&parser->lexer, token.pos, &line, &column);
+            DS_LOG_ERROR("Expected a colon but found %s at %zu:%zu", json_token_kind_to_string(token.kind), line, column);
+            return_defer(1);
+        }
+
+        kv.value = DS_MALLOC(NULL, sizeof(json_object));
+        if (kv.value == NULL) {
+            DS_LOG_ERROR("Failed to allocate value for map");
+            return_defer(1);
+        }
+
+        if (json_parser_parse_object(parser, (json_object *)kv.value) != 0) {
+            DS_LOG_ERROR("Failed to parse map value");
+            return_defer(1);
+        }
+
+        if (ds_hashmap_insert_hashed(&object->map, &kv) != 0) {
+            DS_LOG_ERROR("Failed to insert item to map");
+            return_defer(1);
+        }
+
+        if (json_lexer_next(&parser->lexer, &token) != 0) {
+            DS_LOG_ERROR("Failed to get the next token");
+            return_defer(1);
+        }
+
+        if (token.kind == JSON_TOKEN_RSQRLY) {
+            break;
+        }
+
+        if (token.kind != JSON_TOKEN_COMMA) {
+            size_t line, column;
+            json_lexer_pos_to_lc(&parser->lexer, token.pos, &line, &column);
+            DS_LOG_ERROR("Expected a comma but found %s at %zu:%zu", json_token_kind_to_string(token.kind), line, column);
+            return_defer(1);
+        }
+
+        if (json_lexer_next(&parser->lexer, &token) != 0) {
+            DS_LOG_ERROR("Failed to get the next token");
+            return_defer(1);
+        }
+    }
+
+defer:
+    return result;
+}
+
+static int json_parser_parse_array(json_parser *parser, json_object *object) {
+    int result = 0;
+    json_token token = {0};
+
+    object->kind = JSON_OBJECT_ARRAY;
+    ds_dynamic_array_init(&object->array, sizeof(json_object));
+    if (ds_dynamic_array_reserve(&object->array, JSON_OBJECT_ARRAY_INIT_CAPACITY) != 0) {
+        DS_LOG_ERROR("Failed to allocate array");
+        return_defer(1);
+    }
+
+    if (json_lexer_peek(&parser->lexer, &token) != 0) {
+        DS_LOG_ERROR("Failed to get the next token");
+        return_defer(1);
+    }
+
+    if (token.kind == JSON_TOKEN_RBRACE) {
+        if (json_lexer_next(&parser->lexer, &token) != 0) {
+            DS_LOG_ERROR("Failed to get the next token");
+            return_defer(1);
+        }
+        return_defer(0);
+    }
+
+    while (token.kind != JSON_TOKEN_RBRACE) {
+        json_object item = {0};
+        if (json_parser_parse_object(parser, &item) != 0) {
+            DS_LOG_ERROR("Failed to parse array item");
+            return_defer(1);
+        }
+
+        if (ds_dynamic_array_append(&object->array, &item) != 0) {
+            DS_LOG_ERROR("Failed to add item to array");
+            return_defer(1);
+        }
+
+        if (json_lexer_next(&parser->lexer, &token) != 0) {
+            DS_LOG_ERROR("Failed to get the next token");
+            return_defer(1);
+        }
+
+        if (token.kind == JSON_TOKEN_RBRACE) {
+            break;
+        }
+
+        if (token.kind != JSON_TOKEN_COMMA) {
+            size_t line, column;
+            json_lexer_pos_to_lc(&parser->lexer, token.pos, &line, &column);
+            DS_LOG_ERROR("Expected a comma but found %s at %zu:%zu", json_token_kind_to_string(token.kind), line, column);
+            return_defer(1);
+        }
+    }
+
+defer:
+    return result;
+}
+
+static int json_parser_parse(json_parser *parser, json_object *object) {
+    int result = 0;
+    json_token token = {0};
+
+    if (json_parser_parse_object(parser, object) != 0) {
+        DS_LOG_ERROR("Failed to parse json object");
+        return_defer(1);
+    }
+
+    if (json_lexer_next(&parser->lexer, &token) != 0) {
+        DS_LOG_ERROR("Failed to get the next token");
+        return_defer(1);
+    }
+
+    if (token.kind != JSON_TOKEN_EOF) {
+        size_t line, column;
+        json_lexer_pos_to_lc(&parser->lexer, token.pos, &line, &column);
+        DS_LOG_ERROR("Expected end of file but found %s at %zu:%zu", json_token_kind_to_string(token.kind), line, column);
+        return_defer(1);
+    }
+
+defer:
+    return result;
+}
+
+static void json_parser_free(json_parser *parser) { }
+
+static int json_object_debug_indent(json_object *object, int indent) {
+    int result = 0;
+
+    switch (object->kind) {
+    case JSON_OBJECT_STRING:
+        printf("%*s[STRING]: \'%s\'\n", indent, "", object->string);
+        break;
+    case JSON_OBJECT_NUMBER:
+        printf("%*s[NUMBER]: %f\n", indent, "", object->number);
+        break;
+    case JSON_OBJECT_BOOLEAN:
+        printf("%*s[BOOLEAN]: %s\n", indent, "", object->boolean == true ? "true" : "false");
+        break;
+    case JSON_OBJECT_NULL:
+        printf("%*s[NULL]\n", indent, "");
+        break;
+    case JSON_OBJECT_ARRAY:
+        printf("%*s[ARRAY]: [\n", indent, "");
+        for (size_t i = 0; i < object->array.count; i++) {
+            json_object item = {0};
+            if (ds_dynamic_array_get(&object->array, i, &item) != 0) {
+                DS_LOG_ERROR("Failed to get item from array");
+                return_defer(1);
+            }
+
+            if (json_object_debug_indent(&item, indent + JSON_OBJECT_DUMP_INDENT) != 0) {
+                return_defer(1);
+            }
+        }
+        printf("%*s]\n", indent, "");
+        break;
+    case JSON_OBJECT_MAP:
+        printf("%*s[MAP]: {\n", indent, "");
+        for (size_t i = 0; i < object->map.entries.count; i++) {
+            ds_hashmap_kv kv = {0};
+            if (ds_dynamic_array_get(&object->map.entries, i, &kv) != 0) {
+                DS_LOG_ERROR("Failed to get item from array");
+                return_defer(1);
+            }
+
+            if (kv.key == NULL) {
+                continue;
+            }
+
+            printf("%*s[KEY]: \'%s\'\n", indent, "", (char *)kv.key);
+            if (json_object_debug_indent((json_object*)kv.value, indent + JSON_OBJECT_DUMP_INDENT) != 0) {
+                return_defer(1);
+            }
+        }
+        printf("%*s}\n", indent, "");
+        break;
+    }
+
+defer:
+    return result;
+}
+
+// A newline followed by the indentation. Deeper levels are written in chunks.
+#define JSON_BUFFER_INDENT_MAX 64
+static const char json_buffer_indent[JSON_BUFFER_INDENT_MAX + 2] =
+    "\n                                                                ";
+
+// Write all the vectors to the file descriptor, retrying partial writes. A
+// negative file descriptor discards the bytes and only counts them.
+static int json_buffer_writev(json_buffer *buffer, struct iovec *iov, int iovcnt) {
+    int result = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        buffer->flushed += iov[i].iov_len;
+    }
+
+    if (buffer->fd < 0) {
+        return_defer(0);
+    }
+
+    while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+
+        ssize_t written = writev(buffer->fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DS_LOG_ERROR("Failed to write to file descriptor %d: %s", buffer->fd, strerror(errno));
+            return_defer(1);
+        }
+
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+defer:
+    return result;
+}
+
+// Write the buffered bytes followed by extra to the file descriptor
+static int json_buffer_flush(json_buffer *buffer, const char *extra, size_t extra_len) {
+    int result = 0;
+    struct iovec iov[2] = {
+        {.iov_base = buffer->data, .iov_len = buffer->count},
+        {.iov_base = (void *)extra, .iov_len = extra_len},
+    };
+
+    if (json_buffer_writev(buffer, iov, 2) != 0) {
+        return_defer(1);
+    }
+
+    buffer->count = 0;
+
+defer:
+    return result;
+}
+
+// Make room for size more bytes and the NUL terminator
+static int json_buffer_reserve(json_buffer *buffer, size_t size) {
+    int result = 0;
+    size_t capacity = buffer->capacity;
+
+    if (buffer->count + size + 1 <= buffer->capacity) {
+        return_defer(0);
+    }
+
+    if (buffer->flush == true && buffer->count > 0) {
+        if (json_buffer_flush(buffer, NULL, 0) != 0) {
+            return_defer(1);
+        }
+        if (size + 1 <= buffer->capacity) {
+            return_defer(0);
+        }
+    }
+
+    if (buffer->fixed == true) {
+        DS_LOG_ERROR("The buffer of %zu bytes is too small", buffer->capacity);
+        return_defer(1);
+    }
+
+    if (capacity == 0) {
+        capacity = JSON_BUFFER_INIT_CAPACITY;
+    }
+    while (buffer->count + size + 1 > capacity) {
+        capacity = capacity * 2;
+    }
+
+    char *data = DS_REALLOC(NULL, buffer->data, buffer->capacity, capacity);
+    if (data == NULL) {
+        DS_LOG_ERROR("Failed to reallocate buffer");
+        return_defer(1);
+    }
+
+    buffer->data = data;
+    buffer->capacity = capacity;
+
+defer:
+    return result;
+}
+
+static inline int json_buffer_append(json_buffer *buffer, const char *str, size_t len) {
+    // Large strings are written as they are instead of going through the buffer
+    if (buffer->flush == true && buffer->count + len + 1 > buffer->capacity && len >= buffer->capacity / 2) {
+        return json_buffer_flush(buffer, str, len);
+    }
+
+    if (json_buffer_reserve(buffer, len) != 0) {
+        return 1;
+    }
+
+    DS_MEMCPY(buffer->data + buffer->count, str, len);
+    buffer->count += len;
+    buffer->data[buffer->count] = '\0';
+
+    return 0;
+}
+
+static inline int json_buffer_appendc(json_buffer *buffer, char ch) {
+    if (json_buffer_reserve(buffer, 1) != 0) {
+        return 1;
+    }
+
+    buffer->data[buffer->count++] = ch;
+    buffer->data[buffer->count] = '\0';
+
+    return 0;
+}
+
+// Write a newline followed by indent spaces
+static int json_buffer_newline(json_buffer *buffer, unsigned int indent) {
+    unsigned int len = indent < JSON_BUFFER_INDENT_MAX ? indent : JSON_BUFFER_INDENT_MAX;
+
+    if (json_buffer_append(buffer, json_buffer_indent, len + 1) != 0) {
+        return 1;
+    }
+
+    for (indent -= len; indent > 0; indent -= len) {
+        len = indent < JSON_BUFFER_INDENT_MAX ? indent : JSON_BUFFER_INDENT_MAX;
+        if (json_buffer_append(buffer, json_buffer_indent + 1, len) != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Allocate a fixed buffer that is flushed to the file descriptor
+static int json_buffer_init_fd(json_buffer *buffer, int fd) {
+    *buffer = (json_buffer){.flush = true, .fd = fd};
+
+    buffer->data = DS_MALLOC(NULL, JSON_OBJECT_DUMP_FD_BUFFER_SIZE);
+    if (buffer->data == NULL) {
+        DS_LOG_ERROR("Failed to allocate buffer");
+        return 1;
+    }
+    buffer->capacity = JSON_OBJECT_DUMP_FD_BUFFER_SIZE;
+
+    return 0;
+}
+
+static void json_buffer_free(json_buffer *buffer) {
+    if (buffer->data != NULL) {
+        DS_FREE(NULL, buffer->data);
+    }
+    *buffer = (json_buffer){0};
+}
+
+// Shortest round-trip formatting of doubles
+//
+// This is the Grisu3 algorithm of Florian Loitsch. The value and its rounding
+// boundaries are scaled by a cached power of ten into 64 bit fixed point, and
+// the shortest digit string inside the boundaries is generated, so that
+// reading the digits back gives the same double. Grisu3 knows when the error
+// of the fixed point numbers could make the digits longer than needed or not
+// the closest ones, which happens for about 0.5% of the values; those are
+// done again exactly with the correctly rounded printf of the C library.
+typedef struct json_dtoa_fp {
+    unsigned long long f;
+    int e;
+} json_dtoa_fp;
+
+// Normalized 10^k for k = -348, -340, ..., 340
+static const unsigned long long json_dtoa_cached_powers_f[] = {
+    0xfa8fd5a0081c0288ull, 0xbaaee17fa23ebf76ull, 0x8b16fb203055ac76ull,
+    0xcf42894a5dce35eaull, 0x9a6bb0aa55653b2dull, 0xe61acf033d1a45dfull,
+    0xab70fe17c79ac6caull, 0xff77b1fcbebcdc4full, 0xbe5691ef416bd60cull,
+    0x8dd01fad907ffc3cull, 0xd3515c2831559a83ull, 0x9d71ac8fada6c9b5ull,
+    0xea9c227723ee8bcbull, 0xaecc49914078536dull, 0x823c12795db6ce57ull,
+    0xc21094364dfb5637ull, 0x9096ea6f3848984full, 0xd77485cb25823ac7ull,
+    0xa086cfcd97bf97f4ull, 0xef340a98172aace5ull, 0xb23867fb2a35b28eull,
+    0x84c8d4dfd2c63f3bull, 0xc5dd44271ad3cdbaull, 0x936b9fcebb25c996ull,
+    0xdbac6c247d62a584ull, 0xa3ab66580d5fdaf6ull, 0xf3e2f893dec3f126ull,
+    0xb5b5ada8aaff80b8ull, 0x87625f056c7c4a8bull, 0xc9bcff6034c13053ull,
+    0x964e858c91ba2655ull, 0xdff9772470297ebdull, 0xa6dfbd9fb8e5b88full,
+    0xf8a95fcf88747d94ull, 0xb94470938fa89bcfull, 0x8a08f0f8bf0f156bull,
+    0xcdb02555653131b6ull, 0x993fe2c6d07b7facull, 0xe45c10c42a2b3b06ull,
+    0xaa242499697392d3ull, 0xfd87b5f28300ca0eull, 0xbce5086492111aebull,
+    0x8cbccc096f5088ccull, 0xd1b71758e219652cull, 0x9c40000000000000ull,
+    0xe8d4a51000000000ull, 0xad78ebc5ac620000ull, 0x813f3978f8940984ull,
+    0xc097ce7bc90715b3ull, 0x8f7e32ce7bea5c70ull, 0xd5d238a4abe98068ull,
+    0x9f4f2726179a2245ull, 0xed63a231d4c4fb27ull, 0xb0de65388cc8ada8ull,
+    0x83c7088e1aab65dbull, 0xc45d1df942711d9aull, 0x924d692ca61be758ull,
+    0xda01ee641a708deaull, 0xa26da3999aef774aull, 0xf209787bb47d6b85ull,
+    0xb454e4a179dd1877ull, 0x865b86925b9bc5c2ull, 0xc83553c5c8965d3dull,
+    0x952ab45cfa97a0b3ull, 0xde469fbd99a05fe3ull, 0xa59bc234db398c25ull,
+    0xf6c69a72a3989f5cull, 0xb7dcbf5354e9beceull, 0x88fcf317f22241e2ull,
+    0xcc20ce9bd35c78a5ull, 0x98165af37b2153dfull, 0xe2a0b5dc971f303aull,
+    0xa8d9d1535ce3b396ull, 0xfb9b7cd9a4a7443cull, 0xbb764c4ca7a44410ull,
+    0x8bab8eefb6409c1aull, 0xd01fef10a657842cull, 0x9b10a4e5e9913129ull,
+    0xe7109bfba19c0c9dull, 0xac2820d9623bf429ull, 0x80444b5e7aa7cf85ull,
+    0xbf21e44003acdd2dull, 0x8e679c2f5e44ff8full, 0xd433179d9c8cb841ull,
+    0x9e19db92b4e31ba9ull, 0xeb96bf6ebadf77d9ull, 0xaf87023b9bf0ee6bull
+};
+
+static const short json_dtoa_cached_powers_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static const unsigned long long json_dtoa_pow10[] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull,
+    10000000ull, 100000000ull, 1000000000ull, 10000000000ull,
+    100000000000ull, 1000000000000ull, 10000000000000ull,
+    100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+    100000000000000000ull, 1000000000000000000ull, 10000000000000000000ull,
+};
+
+// Multiply the significands and keep the high 64 bits, rounded to nearest
+static json_dtoa_fp json_dtoa_fp_multiply(json_dtoa_fp a, json_dtoa_fp b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t p = (__uint128_t)a.f * b.f;
+    unsigned long long h = (unsigned long long)(p >> 64);
+    unsigned long long l = (unsigned long long)p;
+
+    if (l & (1ull << 63)) {
+        h += 1;
+    }
+#else
+    unsigned long long ah = a.f >> 32, al = (unsigned int)a.f, bh = b.f >> 32, bl = (unsigned int)b.f;
+    unsigned long long hh = ah * bh, hl = ah * bl, lh = al * bh, ll = al * bl;
+    // Bits 32 to 63 of the product, plus the rounding bit below the high half
+    unsigned long long mid = (ll >> 32) + (unsigned int)hl + (unsigned int)lh + (1ull << 31);
+    unsigned long long h = hh + (hl >> 32) + (lh >> 32) + (mid >> 32);
+#endif
+
+    return (json_dtoa_fp){.f = h, .e = a.e + b.e + 64};
+}
+
+static json_dtoa_fp json_dtoa_fp_normalize(json_dtoa_fp x) {
+    int shift = __builtin_clzll(x.f);
+    return (json_dtoa_fp){.f = x.f << shift, .e = x.e - shift};
+}
+
+// Move the last digit down while that brings it closer to the value, and
+// report whether the result is surely the shortest and closest, as the
+// RoundWeed step of Grisu3 does. All the quantities are in units of the
+// scaled boundaries, and unit is the size of their error.
+static bool json_dtoa_round(char *digits, int len, unsigned long long distance_high_w, unsigned long long unsafe, unsigned long long rest, unsigned long long ten_kappa, unsigned long long unit) {
+    unsigned long long small_distance = distance_high_w - unit;
+    unsigned long long big_distance = distance_high_w + unit;
+
+    while (rest < small_distance && unsafe - rest >= ten_kappa &&
+           (rest + ten_kappa < small_distance || small_distance - rest >= rest + ten_kappa - small_distance)) {
+        digits[len - 1]--;
+        rest += ten_kappa;
+    }
+
+    if (rest < big_distance && unsafe - rest >= ten_kappa &&
+        (rest + ten_kappa < big_distance || big_distance - rest > rest + ten_kappa - big_distance)) {
+        return false;
+    }
+
+    return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+
+static bool json_dtoa_digits(json_dtoa_fp low, json_dtoa_fp w, json_dtoa_fp high, char *digits, int *len, int *k) {
+    unsigned long long unit = 1;
+    json_dtoa_fp too_high = {.f = high.f + unit, .e = high.e};
+    unsigned long long unsafe = too_high.f - (low.f - unit);
+    json_dtoa_fp one = {.f = 1ull << -w.e, .e = w.e};
+    unsigned int p1 = (unsigned int)(too_high.f >> -one.e);
+    unsigned long long p2 = too_high.f & (one.f - 1);
+    int kappa = 1;
+
+    while (kappa < 10 && p1 >= json_dtoa_pow10[kappa]) {
+        kappa += 1;
+    }
+
+    *len = 0;
+    while (kappa > 0) {
+        unsigned int d = p1 / json_dtoa_pow10[kappa - 1];
+        p1 %= json_dtoa_pow10[kappa - 1];
+        digits[(*len)++] = '0' + d;
+        kappa -= 1;
+
+        unsigned long long rest = ((unsigned long long)p1 << -one.e) + p2;
+        if (rest < unsafe) {
+            *k += kappa;
+            return json_dtoa_round(digits, *len, too_high.f - w.f, unsafe, rest, (unsigned long long)json_dtoa_pow10[kappa] << -one.e, unit);
+        }
+    }
+
+    for (;;) {
+        p2 *= 10;
+        unit *= 10;
+        unsafe *= 10;
+        digits[(*len)++] = '0' + (char)(p2 >> -one.e);
+        p2 &= one.f - 1;
+        kappa -= 1;
+        if (p2 < unsafe) {
+            *k += kappa;
+            return json_dtoa_round(digits, *len, (too_high.f - w.f) * unit, unsafe, p2, one.f, unit);
+        }
+    }
+}
+
+// The "C" locale, so that printf and strtod use '.' as the decimal point
+// whatever the program set with setlocale. It is created once and selected
+// only for the calling thread, around the calls that format numbers.
+static locale_t json_number_locale = (locale_t)0;
+static pthread_once_t json_number_locale_once = PTHREAD_ONCE_INIT;
+
+static void json_number_locale_init(void) {
+    json_number_locale = newlocale(LC_NUMERIC_MASK, "C", (locale_t)0);
+}
+
+// Select the "C" locale on the calling thread, and return the locale to
+// restore with json_number_locale_end, or 0 if it could not be created
+static locale_t json_number_locale_begin(void) {
+    pthread_once(&json_number_locale_once, json_number_locale_init);
+    if (json_number_locale == (locale_t)0) {
+        return (locale_t)0;
+    }
+    return uselocale(json_number_locale);
+}
+
+static void json_number_locale_end(locale_t previous) {
+    if (previous != (locale_t)0) {
+        uselocale(previous);
+    }
+}
+
+// Generate the shortest digits of a positive double exactly, by trying more
+// and more digits with printf until they read back to the same value. printf
+// rounds correctly, so the digits that are found are also the closest ones.
+static void json_dtoa_exact(double value, char *digits, int *len, int *k) {
+    char text[32];
+    locale_t previous = json_number_locale_begin();
+
+    for (int precision = 1; precision <= 17; precision++) {
+        snprintf(text, sizeof(text), "%.*e", precision - 1, value);
+        if (precision < 17 && strtod(text, NULL) != value) {
+            continue;
+        }
+
+        // text is d.ddde[+-]x, skip the decimal point
+        digits[0] = text[0];
+        DS_MEMCPY(digits + 1, text + 2, precision - 1);
+        *len = precision;
+        *k = atoi(text + (precision > 1 ? precision + 2 : 2)) - (precision - 1);
+        break;
+    }
+
+    json_number_locale_end(previous);
+}
+
+// Generate the shortest digits of a positive double, value = digits * 10^k
+static void json_dtoa_shortest(double value, char *digits, int *len, int *k) {
+    unsigned long long bits = 0;
+    DS_MEMCPY(&bits, &value, sizeof(bits));
+
+    int biased_e = (int)((bits >> 52) & 0x7FF);
+    unsigned long long significand = bits & ((1ull << 52) - 1);
+    json_dtoa_fp v = {0};
+    if (biased_e != 0) {
+        v = (json_dtoa_fp){.f = significand | (1ull << 52), .e = biased_e - 1075};
+    } else {
+        v = (json_dtoa_fp){.f = significand, .e = -1074};
+    }
+
+    // Boundaries of the rounding interval, with the same exponent
+    json_dtoa_fp plus = {.f = (v.f << 1) + 1, .e = v.e - 1};
+    while (!(plus.f & (1ull << 53))) {
+        plus.f <<= 1;
+        plus.e -= 1;
+    }
+    plus.f <<= 10;
+    plus.e -= 10;
+
+    // The boundary below is closer when the exponent steps down, except for
+    // the smallest normal exponent, below which the denormals have the same
+    // spacing
+    json_dtoa_fp minus = {0};
+    if (v.f == (1ull << 52) && biased_e > 1) {
+        minus = (json_dtoa_fp){.f = (v.f << 2) - 1, .e = v.e - 2};
+    } else {
+        minus = (json_dtoa_fp){.f = (v.f << 1) - 1, .e = v.e - 1};
+    }
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+
+    // Pick the cached power that brings the exponent in [-60, -32]
+    double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+    int ki = (int)dk;
+    if (dk - ki > 0.0) {
+        ki += 1;
+    }
+    unsigned int index = (unsigned int)((ki >> 3) + 1);
+    json_dtoa_fp c_mk = {.f = json_dtoa_cached_powers_f[index], .e = json_dtoa_cached_powers_e[index]};
+    *k = -(-348 + (int)(index << 3));
+
+    json_dtoa_fp w = json_dtoa_fp_multiply(json_dtoa_fp_normalize(v), c_mk);
+    json_dtoa_fp wp = json_dtoa_fp_multiply(plus, c_mk);
+    json_dtoa_fp wm = json_dtoa_fp_multiply(minus, c_mk);
+
+    if (json_dtoa_digits(wm, w, wp, digits, len, k) == false) {
+        json_dtoa_exact(value, digits, len, k);
+    }
+}
+
+static int json_dtoa_exponent(int e, char *out) {
+    int len = 0;
+
+    *out++ = 'e';
+    len += 1;
+    if (e < 0) {
+        *out++ = '-';
+        len += 1;
+        e = -e;
+    }
+
+    if (e >= 100) {
+        *out++ = '0' + e / 100;
+        e %= 100;
+        *out++ = '0' + e / 10;
+        *out++ = '0' + e % 10;
+        len += 3;
+    } else if (e >= 10) {
+        *out++ = '0' + e / 10;
+        *out++ = '0' + e % 10;
+        len += 2;
+    } else {
+        *out++ = '0' + e;
+        len += 1;
+    }
+
+    return len;
+}
+
+// Lay out the digits * 10^k as a JSON number, in plain notation when the
+// decimal point is close to the digits and in exponent notation otherwise.
+static int json_dtoa_format(char *out, int len, int k) {
+    int kk = len + k;
+
+    if (k >= 0 && kk <= 21) {
+        // 1234e5 -> 123400000
+        for (int i = len; i < kk; i++) {
+            out[i] = '0';
+        }
+        return kk;
+    } else if (kk > 0 && kk <= 21) {
+        // 1234e-2 -> 12.34
+        DS_MEMMOVE(out + kk + 1, out + kk, len - kk);
+        out[kk] = '.';
+        return len + 1;
+    } else if (kk > -6 && kk <= 0) {
+        // 1234e-6 -> 0.001234
+        int offset = 2 - kk;
+        DS_MEMMOVE(out + offset, out, len);
+        out[0] = '0';
+        out[1] = '.';
+        for (int i = 2; i < offset; i++) {
+            out[i] = '0';
+        }
+        return len + offset;
+    } else if (len == 1) {
+        // 1e30
+        return 1 + json_dtoa_exponent(kk - 1, out + 1);
+    } else {
+        // 1234e30 -> 1.234e33
+        DS_MEMMOVE(out + 2, out + 1, len - 1);
+        out[1] = '.';
+        return len + 1 + json_dtoa_exponent(kk - 1, out + len + 1);
+    }
+}
+
+// Write the shortest representation of a double that reads back to the same
+// value. The output needs at most JSON_DTOA_BUFFER_SIZE bytes. Infinity and
+// NaN are not valid JSON and are written as null.
+#define JSON_DTOA_BUFFER_SIZE 32
+static int json_dtoa(double value, char *out) {
+    int len = 0;
+    int k = 0;
+
+    if (isnan(value) || isinf(value)) {
+        DS_MEMCPY(out, "null", 4);
+        return 4;
+    }
+
+    if (signbit(value)) {
+        *out++ = '-';
+        len += 1;
+        value = -value;
+    }
+
+    if (value == 0) {
+        *out = '0';
+        return len + 1;
+    }
+
+    // Integers are written exactly, without going through Grisu
+    if (value < 9007199254740992.0 && value == (double)(unsigned long long)value) {
+        char digits[20];
+        int count = 0;
+        unsigned long long n = (unsigned long long)value;
+
+        while (n > 0) {
+            digits[count++] = '0' + n % 10;
+            n /= 10;
+        }
+        for (int i = 0; i < count; i++) {
+            out[i] = digits[count - 1 - i];
+        }
+        return len + count;
+    }
+
+    int count = 0;
+    json_dtoa_shortest(value, out, &count, &k);
+    return len + json_dtoa_format(out, count, k);
+}
+
+// Write a number, in the shortest form that reads back to the same value when
+// precision is negative, or with precision digits after the decimal point
+static int json_object_dump_number(double number, const json_dump_options *options, json_buffer *buffer) {
+    int result = 0;
+    int precision = options->precision;
+    char digits[64];
+    int len = 0;
+    locale_t previous = (locale_t)0;
+
+    if (options->canonical == true) {
+        if (isnan(number) || isinf(number)) {
+            DS_LOG_ERROR("NaN and infinite numbers have no canonical form");
+            return_defer(1);
+        }
+
+        // ECMAScript has no negative zero and signs the positive exponents
+        len = json_dtoa(number == 0 ? 0.0 : number, digits);
+
+        char *exponent = memchr(digits, 'e', len);
+        if (exponent != NULL && exponent[1] != '-') {
+            DS_MEMMOVE(exponent + 2, exponent + 1, digits + len - (exponent + 1));
+            exponent[1] = '+';
+            len += 1;
+        }
+
+        return_defer(json_buffer_append(buffer, digits, len));
+    }
+
+    if (precision < 0 || isnan(number) || isinf(number)) {
+        return_defer(json_buffer_append(buffer, digits, json_dtoa(number, digits)));
+    }
+
+    previous = json_number_locale_begin();
+    len = snprintf(digits, sizeof(digits), "%.*f", precision, number);
+    if (len < 0) {
+        DS_LOG_ERROR("Failed to format number");
+        return_defer(1);
+    }
+
+    if ((unsigned int)len < sizeof(digits)) {
+        return_defer(json_buffer_append(buffer, digits, len));
+    }
+
+    // Numbers that do not fit are formatted in place
+    if (json_buffer_reserve(buffer, len) != 0) {
+        return_defer(1);
+    }
+    snprintf(buffer->data + buffer->count, len + 1, "%.*f", precision, number);
+    buffer->count += len;
+
+defer:
+    json_number_locale_end(previous);
+    return result;
+}
+
+// Escapes of the bytes that can not be written as they are in a JSON string:
+// the quote, the backslash and the control characters. The value is the
+// character that follows the backslash, and 'u' for a \u00XX escape.
+static const char json_escape_table[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    ['"'] = '"',
+    ['\\'] = '\\',
+};
+
+static const char json_hex_chars[16] = "0123456789abcdef";
+
+// Find the first byte at or after start that has to be escaped, or len if
+// there is none. The string is scanned in blocks of 32 bytes with AVX2 or
+// SSE2 when available, and byte by byte for the rest.
+static inline size_t json_escape_scan(const unsigned char *str, size_t start, size_t len, bool ascii_only) {
+    size_t i = start;
+
+#if defined(__AVX2__)
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control = _mm256_set1_epi8(0x1F);
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(str + i));
+        __m256i mask = _mm256_or_si256(_mm256_cmpeq_epi8(block, quote), _mm256_cmpeq_epi8(block, backslash));
+        mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(_mm256_max_epu8(block, control), control));
+
+        unsigned int bits = (unsigned int)_mm256_movemask_epi8(mask);
+        if (ascii_only == true) {
+            bits |= (unsigned int)_mm256_movemask_epi8(block);
+        }
+        if (bits != 0) {
+            return i + __builtin_ctz(bits);
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1F);
+
+    for (; i + 32 <= len; i += 32) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(str + i));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(str + i + 16));
+        __m128i mask_lo = _mm_or_si128(_mm_cmpeq_epi8(lo, quote), _mm_cmpeq_epi8(lo, backslash));
+        __m128i mask_hi = _mm_or_si128(_mm_cmpeq_epi8(hi, quote), _mm_cmpeq_epi8(hi, backslash));
+        mask_lo = _mm_or_si128(mask_lo, _mm_cmpeq_epi8(_mm_max_epu8(lo, control), control));
+        mask_hi = _mm_or_si128(mask_hi, _mm_cmpeq_epi8(_mm_max_epu8(hi, control), control));
+
+        unsigned int bits = (unsigned int)_mm_movemask_epi8(mask_lo) | ((unsigned int)_mm_movemask_epi8(mask_hi) << 16);
+        if (ascii_only == true) {
+            bits |= (unsigned int)_mm_movemask_epi8(lo) | ((unsigned int)_mm_movemask_epi8(hi) << 16);
+        }
+        if (bits != 0) {
+            return i + __builtin_ctz(bits);
+        }
+    }
+#endif
+
+    for (; i < len; i++) {
+        if (json_escape_table[str[i]] != 0 || (ascii_only == true && str[i] >= 0x80)) {
+            return i;
+        }
+    }
+
+    return len;
+}
+
+// Decode one UTF-8 sequence. Invalid sequences decode to U+FFFD and consume a
+// single byte.
+static unsigned int json_utf8_decode(const unsigned char *str, unsigned int len, unsigned int *code) {
+    unsigned char ch = str[0];
+    unsigned int size = 0;
+    unsigned int min = 0;
+
+    if (ch >= 0xC2 && ch <= 0xDF) {
+        size = 2;
+        min = 0x80;
+        *code = ch & 0x1F;
+    } else if (ch >= 0xE0 && ch <= 0xEF) {
+        size = 3;
+        min = 0x800;
+        *code = ch & 0x0F;
+    } else if (ch >= 0xF0 && ch <= 0xF4) {
+        size = 4;
+        min = 0x10000;
+        *code = ch & 0x07;
+    } else {
+        *code = 0xFFFD;
+        return 1;
+    }
+
+    if (size > len) {
+        *code = 0xFFFD;
+        return 1;
+    }
+
+    for (unsigned int i = 1; i < size; i++) {
+        if ((str[i] & 0xC0) != 0x80) {
+            *code = 0xFFFD;
+            return 1;
+        }
+        *code = (*code << 6) | (str[i] & 0x3F);
+    }
+
+    if (*code < min || *code > 0x10FFFF || (*code >= 0xD800 && *code <= 0xDFFF)) {
+        *code = 0xFFFD;
+        return 1;
+    }
+
+    return size;
+}
+
+static inline int json_buffer_append_u(json_buffer *buffer, unsigned int code) {
+    char escape[6] = {
+        '\\', 'u',
+        json_hex_chars[(code >> 12) & 0xF], json_hex_chars[(code >> 8) & 0xF],
+        json_hex_chars[(code >> 4) & 0xF], json_hex_chars[code & 0xF],
+    };
+
+    return json_buffer_append(buffer, escape, 6);
+}
+
+// Write a quoted string, escaping the bytes that need it. The runs of bytes
+// that do not need escapes are copied at once. With ascii_only the non ASCII
+// characters are written as \uXXXX escapes, using surrogate pairs above the
+// basic multilingual plane.
+static int json_object_dump_string(const char *string, bool ascii_only, json_buffer *buffer) {
+    const unsigned char *str = (const unsigned char *)string;
+    size_t len = strlen(string);
+    size_t start = 0;
+
+    if (json_buffer_appendc(buffer, '"') != 0) {
+        return 1;
+    }
+
+    while (start < len) {
+        size_t i = json_escape_scan(str, start, len, ascii_only);
+
+        if (json_buffer_append(buffer, string + start, i - start) != 0) {
+            return 1;
+        }
+
+        if (i >= len) {
+            break;
+        }
+
+        char escape = json_escape_table[str[i]];
+        if (escape == 'u') {
+            if (json_buffer_append_u(buffer, str[i]) != 0) {
+                return 1;
+            }
+            start = i + 1;
+        } else if (escape != 0) {
+            char pair[2] = {'\\', escape};
+            if (json_buffer_append(buffer, pair, 2) != 0) {
+                return 1;
+            }
+            start = i + 1;
+        } else {
+            unsigned int code = 0;
+            start = i + json_utf8_decode(str + i, len - i, &code);
+
+            if (code >= 0x10000) {
+                code -= 0x10000;
+                if (json_buffer_append_u(buffer, 0xD800 + (code >> 10)) != 0 ||
+                    json_buffer_append_u(buffer, 0xDC00 + (code & 0x3FF)) != 0) {
+                    return 1;
+                }
+            } else {
+                if (json_buffer_append_u(buffer, code) != 0) {
+                    return 1;
+                }
+            }
+        }
+    }
+
+    return json_buffer_appendc(buffer, '"');
+}
+
+// A map entry with the first bytes of its key, or the first UTF-16 code units
+// for the canonical order, packed so that most keys compare as one integer
+typedef struct json_dump_key {
+    unsigned long long prefix;
+    ds_hashmap_kv *kv;
+} json_dump_key;
+
+// Read the next UTF-16 code unit of a key. A character outside of the BMP is
+// read as a surrogate pair, the low surrogate is kept in *low for the next
+// call. Returns 0 at the end of the key.
+static unsigned int json_utf16_next(const unsigned char **str, unsigned int *low) {
+    unsigned int code = 0;
+
+    if (*low != 0) {
+        code = *low;
+        *low = 0;
+        return code;
+    }
+
+    if (**str < 0x80) {
+        code = **str;
+        if (code != 0) {
+            *str += 1;
+        }
+        return code;
+    }
+
+    *str += json_utf8_decode(*str, 4, &code);
+    if (code >= 0x10000) {
+        code -= 0x10000;
+        *low = 0xDC00 + (code & 0x3FF);
+        code = 0xD800 + (code >> 10);
+    }
+
+    return code;
+}
+
+static int json_utf16_compare(const char *a, const char *b) {
+    const unsigned char *s1 = (const unsigned char *)a;
+    const unsigned char *s2 = (const unsigned char *)b;
+    unsigned int low1 = 0;
+    unsigned int low2 = 0;
+
+    for (;;) {
+        unsigned int c1 = json_utf16_next(&s1, &low1);
+        unsigned int c2 = json_utf16_next(&s2, &low2);
+
+        if (c1 != c2) {
+            return c1 < c2 ? -1 : 1;
+        }
+        if (c1 == 0) {
+            return 0;
+        }
+    }
+}
+
+static unsigned long long json_dump_key_prefix(const char *key, json_dump_key_order order) {
+    const unsigned char *str = (const unsigned char *)key;
+    unsigned long long prefix = 0;
+
+    if (order == JSON_DUMP_KEYS_CANONICAL) {
+        unsigned int low = 0;
+        for (int i = 0; i < 4; i++) {
+            prefix = (prefix << 16) | json_utf16_next(&str, &low);
+        }
+    } else {
+        for (int i = 0; i < 8; i++) {
+            prefix = (prefix << 8) | *str;
+            if (*str != '\0') {
+                str += 1;
+            }
+        }
+    }
+
+    return prefix;
+}
+
+static int json_dump_key_compare_bytes(const void *a, const void *b) {
+    const json_dump_key *k1 = (const json_dump_key *)a;
+    const json_dump_key *k2 = (const json_dump_key *)b;
+
+    if (k1->prefix != k2->prefix) {
+        return k1->prefix < k2->prefix ? -1 : 1;
+    }
+
+    return strcmp((const char *)k1->kv->key, (const char *)k2->kv->key);
+}
+
+static int json_dump_key_compare_utf16(const void *a, const void *b) {
+    const json_dump_key *k1 = (const json_dump_key *)a;
+    const json_dump_key *k2 = (const json_dump_key *)b;
+
+    if (k1->prefix != k2->prefix) {
+        return k1->prefix < k2->prefix ? -1 : 1;
+    }
+
+    return json_utf16_compare((const char *)k1->kv->key, (const char *)k2->kv->key);
+}
+
+// Collect the entries of a map in the order in which they are written. With
+// the insertion order the entries are used in place and *sorted is NULL,
+// otherwise *sorted is an allocated array of count entries.
+//
+// The keys are sorted together with a prefix computed once per key, so that
+// the full comparison only runs for keys that share their first bytes.
+static int json_object_dump_entries(json_object *object, const json_dump_options *options, ds_hashmap_kv ***sorted, size_t *count) {
+    int result = 0;
+    json_dump_key *keys = NULL;
+
+    *sorted = NULL;
+    *count = object->map.entries.count;
+
+    if (options->key_order == JSON_DUMP_KEYS_INSERTION) {
+        return_defer(0);
+    }
+
+    keys = DS_MALLOC(NULL, ds_hashmap_count(&object->map) * sizeof(json_dump_key));
+    *sorted = DS_MALLOC(NULL, ds_hashmap_count(&object->map) * sizeof(ds_hashmap_kv *));
+    if (keys == NULL || *sorted == NULL) {
+        DS_LOG_ERROR("Failed to allocate sorted keys");
+        return_defer(1);
+    }
+
+    *count = 0;
+    for (size_t i = 0; i < object->map.entries.count; i++) {
+        ds_hashmap_kv *kv = (ds_hashmap_kv *)object->map.entries.items + i;
+        if (kv->key != NULL) {
+            keys[*count].prefix = json_dump_key_prefix((const char *)kv->key, options->key_order);
+            keys[*count].kv = kv;
+            *count += 1;
+        }
+    }
+
+    if (options->key_order == JSON_DUMP_KEYS_CANONICAL) {
+        qsort(keys, *count, sizeof(json_dump_key), json_dump_key_compare_utf16);
+    } else {
+        qsort(keys, *count, sizeof(json_dump_key), json_dump_key_compare_bytes);
+    }
+
+    for (size_t i = 0; i < *count; i++) {
+        (*sorted)[i] = keys[i].kv;
+    }
+
+defer:
+    if (keys != NULL) {
+        DS_FREE(NULL, keys);
+    }
+    if (result != 0 && *sorted != NULL) {
+        DS_FREE(NULL, *sorted);
+        *sorted = NULL;
+    }
+    return result;
+}
+
+static inline int json_object_dump_scalar(json_object *object, const json_dump_options *options, json_buffer *buffer) {
+    switch (object->kind) {
+    case JSON_OBJECT_STRING:
+        return json_object_dump_string(object->string, options->ascii_only, buffer);
+    case JSON_OBJECT_NUMBER:
+        return json_object_dump_number(object->number, options, buffer);
+    case JSON_OBJECT_BOOLEAN:
+        if (object->boolean == true) {
+            return json_buffer_append(buffer, "true", 4);
+        }
+        return json_buffer_append(buffer, "false", 5);
+    case JSON_OBJECT_NULL:
+        return json_buffer_append(buffer, "null", 4);
+    default:
+        return 1;
+    }
+}
+
+// The source text can be copied when the output would have the same meaning:
+// the keys in their original order, the strings escaped as in the source and
+// the numbers not rounded
+static inline bool json_dump_options_passthrough(const json_dump_options *options) {
+    return options->key_order == JSON_DUMP_KEYS_INSERTION && options->ascii_only == false && options->precision < 0;
+}
+
+// A range of the items of a large container, written by one thread into its
+// own buffer
+typedef struct json_dump_chunk {
+    json_object *object;
+    ds_hashmap_kv **sorted;
+    size_t first; /* the first item of the container, written without a separator */
+    size_t start;
+    size_t end;
+    unsigned int indent;
+    const json_dump_options *options;
+    json_buffer buffer;
+    int result;
+    bool done;
+} json_dump_chunk;
+
+// The chunks of a large container. The pool tasks and the thread that dumps
+// the container take the chunks in order, and that thread appends the
+// finished chunks in order. The tasks can start after the container is done,
+// so the chunks are freed by the last of them or by the dumping thread.
+typedef struct json_dump_tasks {
+    json_dump_chunk *chunks;
+    size_t count;
+    size_t next;         /* the next chunk to take */
+    size_t finished;     /* chunks taken and written */
+    size_t buffered;     /* bytes of the finished chunks not appended yet */
+    bool failed;
+    unsigned int active; /* tasks submitted and not returned */
+    unsigned int refs;
+    json_dump_options options;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} json_dump_tasks;
+
+static int json_object_dump_compact(json_object *object, const json_dump_options *options, json_buffer *buffer);
+static int json_object_dump_pretty(json_object *object, unsigned int indent, const json_dump_options *options, json_buffer *buffer);
+
+static inline bool json_dump_options_parallel(const json_dump_options *options, size_t count) {
+    return options->threads > 1 && count >= JSON_OBJECT_DUMP_PARALLEL_MIN;
+}
+
+// Write the items of a chunk, each one with the separator before it
+static int json_object_dump_chunk(json_dump_chunk *chunk) {
+    int result = 0;
+    const json_dump_options *options = chunk->options;
+    unsigned int indent = chunk->indent + options->indent;
+    json_buffer *buffer = &chunk->buffer;
+
+    for (size_t i = chunk->start; i < chunk->end; i++) {
+        json_object *value = NULL;
+        ds_hashmap_kv *kv = NULL;
+
+        if (chunk->object->kind == JSON_OBJECT_ARRAY) {
+            value = (json_object *)chunk->object->array.items + i;
+        } else {
+            kv = chunk->sorted != NULL ? chunk->sorted[i] : (ds_hashmap_kv *)chunk->object->map.entries.items + i;
+            if (kv->key == NULL) {
+                continue;
+            }
+            value = (json_object *)kv->value;
+        }
+
+        if (i > chunk->first && json_buffer_appendc(buffer, ',') != 0) {
+            return_defer(1);
+        }
+        if (options->minified == false && json_buffer_newline(buffer, indent) != 0) {
+            return_defer(1);
+        }
+        if (kv != NULL) {
+            if (json_object_dump_string((const char *)kv->key, options->ascii_only, buffer) != 0) {
+                return_defer(1);
+            }
+            if (options->minified == true) {
+                if (json_buffer_appendc(buffer, ':') != 0) {
+                    return_defer(1);
+                }
+            } else {
+                if (json_buffer_append(buffer, ": ", 2) != 0) {
+                    return_defer(1);
+                }
+            }
+        }
+
+        if (options->minified == true) {
+            if (json_object_dump_compact(value, options, buffer) != 0) {
+                return_defer(1);
+            }
+        } else {
+            if (json_object_dump_pretty(value, indent, options, buffer) != 0) {
+                return_defer(1);
+            }
+        }
+    }
+
+defer:
+    return result;
+}
+
+// Take the next chunk if no chunk failed and the finished chunks hold less
+// than JSON_OBJECT_DUMP_PARALLEL_BYTES. It is called with the lock held.
+static json_dump_chunk *json_dump_tasks_take(json_dump_tasks *tasks) {
+    if (tasks->failed == true || tasks->next >= tasks->count || tasks->buffered >= JSON_OBJECT_DUMP_PARALLEL_BYTES) {
+        return NULL;
+    }
+
+    return &tasks->chunks[tasks->next++];
+}
+
+static void json_dump_tasks_run(json_dump_tasks *tasks, json_dump_chunk *chunk) {
+    int result = json_object_dump_chunk(chunk);
+
+    pthread_mutex_lock(&tasks->lock);
+    chunk->result = result;
+    chunk->done = true;
+    tasks->finished += 1;
+    tasks->buffered += chunk->buffer.count;
+    if (result != 0) {
+        tasks->failed = true;
+    }
+    pthread_cond_broadcast(&tasks->wake);
+    pthread_mutex_unlock(&tasks->lock);
+}
+
+static void json_dump_tasks_release(json_dump_tasks *tasks) {
+    if (__atomic_sub_fetch(&tasks->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < tasks->count; i++) {
+        json_buffer_free(&tasks->chunks[i].buffer);
+    }
+    pthread_cond_destroy(&tasks->wake);
+    pthread_mutex_destroy(&tasks->lock);
+    DS_FREE(NULL, tasks->chunks);
+    DS_FREE(NULL, tasks);
+}
+
+// A pool task writes chunks until none can be taken. It never waits, so it
+// can run on a busy pool, or on the dumping thread when the queues are full.
+static void json_object_dump_task(void *arg) {
+    json_dump_tasks *tasks = (json_dump_tasks *)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&tasks->lock);
+        json_dump_chunk *chunk = json_dump_tasks_take(tasks);
+        if (chunk == NULL) {
+            tasks->active -= 1;
+        }
+        pthread_mutex_unlock(&tasks->lock);
+
+        if (chunk == NULL) {
+            break;
+        }
+        json_dump_tasks_run(tasks, chunk);
+    }
+
+    json_dump_tasks_release(tasks);
+}
+
+// Submit tasks until workers of them are active, while there are chunks that
+// can be taken. It is called without the lock.
+static void json_dump_tasks_submit(json_dump_tasks *tasks, ds_thread_pool *pool, unsigned int workers) {
+    unsigned int count = 0;
+
+    pthread_mutex_lock(&tasks->lock);
+    if (tasks->failed == false && tasks->next < tasks->count && tasks->buffered < JSON_OBJECT_DUMP_PARALLEL_BYTES &&
+        tasks->active < workers) {
+        count = workers - tasks->active;
+        tasks->active += count;
+        __atomic_add_fetch(&tasks->refs, count, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&tasks->lock);
+
+    for (unsigned int i = 0; i < count; i++) {
+        ds_thread_pool_submit(pool, json_object_dump_task, tasks);
+    }
+}
+
+// Append the buffers of the chunks in order. A buffer that is flushed to a
+// file descriptor writes its own bytes and the chunks with writev instead, so
+// that the chunks are not copied.
+static int json_buffer_append_chunks(json_buffer *buffer, json_dump_chunk *chunks, size_t count) {
+    int result = 0;
+    struct iovec *iov = NULL;
+    size_t total = 0;
+
+    if (buffer->flush == true) {
+        iov = DS_MALLOC(NULL, (count + 1) * sizeof(struct iovec));
+        if (iov == NULL) {
+            DS_LOG_ERROR("Failed to allocate iovec");
+            return_defer(1);
+        }
+
+        iov[0] = (struct iovec){.iov_base = buffer->data, .iov_len = buffer->count};
+        for (size_t i = 0; i < count; i++) {
+            iov[i + 1] = (struct iovec){.iov_base = chunks[i].buffer.data, .iov_len = chunks[i].buffer.count};
+        }
+
+        if (json_buffer_writev(buffer, iov, count + 1) != 0) {
+            return_defer(1);
+        }
+        buffer->count = 0;
+        return_defer(0);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        total += chunks[i].buffer.count;
+    }
+
+    if (json_buffer_reserve(buffer, total) != 0) {
+        return_defer(1);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        DS_MEMCPY(buffer->data + buffer->count, chunks[i].buffer.data, chunks[i].buffer.count);
+        buffer->count += chunks[i].buffer.count;
+    }
+    buffer->data[buffer->count] = '\0';
+
+defer:
+    if (iov != NULL) {
+        DS_FREE(NULL, iov);
+    }
+    return result;
+}
+
+// Write the items of a large container on a thread pool
+//
+// The items are split in chunks, and each chunk is written into its own buffer
+// by a task of the pool or by the thread that calls this. That thread appends
+// the finished chunks in order, with a single writev when the buffer is
+// flushed to a file descriptor. The chunks are only started while the
+// finished ones hold less than JSON_OBJECT_DUMP_PARALLEL_BYTES, so the memory
+// does not grow with the container. The pool of options->pool is used, or a
+// pool of options->threads threads started at the first large container. If
+// that fails the calling thread writes all the chunks.
+static int json_object_dump_parallel(json_object *object, ds_hashmap_kv **sorted, size_t count, unsigned int indent, const json_dump_options *options, json_buffer *buffer) {
+    int result = 0;
+    json_dump_tasks *tasks = NULL;
+    ds_thread_pool *pool = options->pool;
+    unsigned int workers = 0;
+    size_t head = 0;
+    size_t first = 0;
+
+    if (pool != NULL && (pool->threads != NULL || ds_thread_pool_init(pool, options->threads - 1) == 0)) {
+        workers = options->threads - 1;
+    }
+
+    if (object->kind == JSON_OBJECT_MAP && sorted == NULL) {
+        while (first < count && ((ds_hashmap_kv *)object->map.entries.items)[first].key == NULL) {
+            first += 1;
+        }
+    }
+
+    tasks = DS_MALLOC(NULL, sizeof(json_dump_tasks));
+    if (tasks == NULL) {
+        DS_LOG_ERROR("Failed to allocate chunks");
+        return_defer(1);
+    }
+    *tasks = (json_dump_tasks){.refs = 1, .options = *options};
+
+    // The chunks do not split their large containers again
+    tasks->options.threads = 0;
+
+    tasks->count = options->threads * JSON_OBJECT_DUMP_PARALLEL_CHUNKS;
+    if (tasks->count < count / JSON_OBJECT_DUMP_PARALLEL_MIN) {
+        tasks->count = count / JSON_OBJECT_DUMP_PARALLEL_MIN;
+    }
+    if (tasks->count > count) {
+        tasks->count = count;
+    }
+
+    tasks->chunks = DS_MALLOC(NULL, tasks->count * sizeof(json_dump_chunk));
+    if (tasks->chunks == NULL) {
+        DS_LOG_ERROR("Failed to allocate chunks");
+        DS_FREE(NULL, tasks);
+        tasks = NULL;
+        return_defer(1);
+    }
+    pthread_mutex_init(&tasks->lock, NULL);
+    pthread_cond_init(&tasks->wake, NULL);
+
+    for (size_t i = 0; i < tasks->count; i++) {
+        tasks->chunks[i] = (json_dump_chunk){
+            .object = object,
+            .sorted = sorted,
+            .first = first,
+            .start = (size_t)((unsigned long long)count * i / tasks->count),
+            .end = (size_t)((unsigned long long)count * (i + 1) / tasks->count),
+            .indent = indent,
+            .options = &tasks->options,
+        };
+    }
+
+    while (head < tasks->count) {
+        json_dump_chunk *chunk = NULL;
+        size_t end = head;
+
+        if (workers > 0) {
+            json_dump_tasks_submit(tasks, pool, workers);
+        }
+
+        // Append the chunks that are done, or else write one, or else wait
+        // for the next chunk in order
+        pthread_mutex_lock(&tasks->lock);
+        for (;;) {
+            while (end < tasks->count && tasks->chunks[end].done == true && tasks->chunks[end].result == 0) {
+                end += 1;
+            }
+            if (end > head || tasks->failed == true) {
+                break;
+            }
+            chunk = json_dump_tasks_take(tasks);
+            if (chunk != NULL) {
+                break;
+            }
+            pthread_cond_wait(&tasks->wake, &tasks->lock);
+        }
+        bool failed = tasks->failed;
+        pthread_mutex_unlock(&tasks->lock);
+
+        if (chunk != NULL) {
+            json_dump_tasks_run(tasks, chunk);
+            continue;
+        }
+        if (end == head && failed == true) {
+            break;
+        }
+
+        size_t appended = 0;
+        for (size_t i = head; i < end; i++) {
+            appended += tasks->chunks[i].buffer.count;
+        }
+        if (json_buffer_append_chunks(buffer, tasks->chunks + head, end - head) != 0) {
+            pthread_mutex_lock(&tasks->lock);
+            tasks->failed = true;
+            pthread_mutex_unlock(&tasks->lock);
+            break;
+        }
+        for (size_t i = head; i < end; i++) {
+            json_buffer_free(&tasks->chunks[i].buffer);
+        }
+        head = end;
+
+        pthread_mutex_lock(&tasks->lock);
+        tasks->buffered -= appended;
+        pthread_mutex_unlock(&tasks->lock);
+    }
+
+    // On a failure no more chunks are taken, and the ones that were taken
+    // still use the container until they finish
+    pthread_mutex_lock(&tasks->lock);
+    while (tasks->finished < tasks->next) {
+        pthread_cond_wait(&tasks->wake, &tasks->lock);
+    }
+    if (tasks->failed == true) {
+        for (size_t i = 0; i < tasks->next; i++) {
+            if (tasks->chunks[i].result != 0) {
+                DS_LOG_ERROR("Failed to dump chunk %zu", i);
+            }
+        }
+        result = 1;
+    }
+    pthread_mutex_unlock(&tasks->lock);
+
+defer:
+    if (tasks != NULL) {
+        json_dump_tasks_release(tasks);
+    }
+    return result;
+}
+
+// Write a value without any whitespace
+static int json_object_dump_compact(json_object *object, const json_dump_options *options, json_buffer *buffer) {
+    int result = 0;
+    ds_hashmap_kv **sorted = NULL;
+    size_t count = 0;
+
+    if (object->source != NULL && json_dump_options_passthrough(options)) {
+        return_defer(json_buffer_append(buffer, object->source, object->source_len));
+    }
+
+    switch (object->kind) {
+    case JSON_OBJECT_ARRAY:
+        if (json_buffer_appendc(buffer, '[') != 0) {
+            return_defer(1);
+        }
+        if (json_dump_options_parallel(options, object->array.count)) {
+            if (json_object_dump_parallel(object, NULL, object->array.count, 0, options, buffer) != 0) {
+                return_defer(1);
+            }
+        } else {
+            for (size_t i = 0; i < object->array.count; i++) {
+                if (i > 0 && json_buffer_appendc(buffer, ',') != 0) {
+                    return_defer(1);
+                }
+                if (json_object_dump_compact((json_object *)object->array.items + i, options, buffer) != 0) {
+                    return_defer(1);
+                }
+            }
+        }
+        if (json_buffer_appendc(buffer, ']') != 0) {
+            return_defer(1);
+        }
+        break;
+    case JSON_OBJECT_MAP:
+        if (json_object_dump_entries(object, options, &sorted, &count) != 0) {
+            return_defer(1);
+        }
+
+        if (json_buffer_appendc(buffer, '{') != 0) {
+            return_defer(1);
+        }
+        if (json_dump_options_parallel(options, count)) {
+            if (json_object_dump_parallel(object, sorted, count, 0, options, buffer) != 0) {
+                return_defer(1);
+            }
+        } else {
+            for (size_t i = 0, index = 0; i < count; i++) {
+                ds_hashmap_kv *kv = sorted != NULL ? sorted[i] : (ds_hashmap_kv *)object->map.entries.items + i;
+
+                if (kv->key == NULL) {
+                    continue;
+                }
+
+                if (index > 0 && json_buffer_appendc(buffer, ',') != 0) {
+                    return_defer(1);
+                }
+                if (json_object_dump_string((const char *)kv->key, options->ascii_only, buffer) != 0 ||
+                    json_buffer_appendc(buffer, ':') != 0) {
+                    return_defer(1);
+                }
+                if (json_object_dump_compact((json_object *)kv->value, options, buffer) != 0) {
+                    return_defer(1);
+                }
+                index += 1;
+            }
+        }
+        if (json_buffer_appendc(buffer, '}') != 0) {
+            return_defer(1);
+        }
+        break;
+    default:
+        if (json_object_dump_scalar(object, options, buffer) != 0) {
+            return_defer(1);
+        }
+        break;
+    }
+
+defer:
+    if (sorted != NULL) {
+        DS_FREE(NULL, sorted);
+    }
+    return result;
+}
+
+// Write a value with one item per line; the caller writes the indentation
+// before it
+static int json_object_dump_pretty(json_object *object, unsigned int indent, const json_dump_options *options, json_buffer *buffer) {
+    int result = 0;
+    ds_hashmap_kv **sorted = NULL;
+    size_t count = 0;
+
+    switch (object->kind) {
+    case JSON_OBJECT_ARRAY:
+        if (object->array.count == 0) {
+            if (json_buffer_append(buffer, "[]", 2) != 0) {
+                return_defer(1);
+            }
+            break;
+        }
+
+        if (json_buffer_appendc(buffer, '[') != 0) {
+            return_defer(1);
+        }
+        if (json_dump_options_parallel(options, object->array.count)) {
+            if (json_object_dump_parallel(object, NULL, object->array.count, indent, options, buffer) != 0) {
+                return_defer(1);
+            }
+        } else {
+            for (size_t i = 0; i < object->array.count; i++) {
+                json_object *item = (json_object *)object->array.items + i;
+
+                if (i > 0 && json_buffer_appendc(buffer, ',') != 0) {
+                    return_defer(1);
+                }
+                if (json_buffer_newline(buffer, indent + options->indent) != 0) {
+                    return_defer(1);
+                }
+                if (json_object_dump_pretty(item, indent + options->indent, options, buffer) != 0) {
+                    return_defer(1);
+                }
+            }
+        }
+        if (json_buffer_newline(buffer, indent) != 0 ||
+            json_buffer_appendc(buffer, ']') != 0) {
+            return_defer(1);
+        }
+        break;
+    case JSON_OBJECT_MAP:
+        if (ds_hashmap_count(&object->map) == 0) {
+            if (json_buffer_append(buffer, "{}", 2) != 0) {
+                return_defer(1);
+            }
+            break;
+        }
+
+        if (json_object_dump_entries(object, options, &sorted, &count) != 0) {
+            return_defer(1);
+        }
+
+        if (json_buffer_appendc(buffer, '{') != 0) {
+            return_defer(1);
+        }
+        if (json_dump_options_parallel(options, count)) {
+            if (json_object_dump_parallel(object, sorted, count, indent, options, buffer) != 0) {
+                return_defer(1);
+            }
+        } else {
+            for (size_t i = 0, index = 0; i < count; i++) {
+                ds_hashmap_kv *kv = sorted != NULL ? sorted[i] : (ds_hashmap_kv *)object->map.entries.items + i;
+
+                if (kv->key == NULL) {
+                    continue;
+                }
+
+                if (index > 0 && json_buffer_appendc(buffer, ',') != 0) {
+                    return_defer(1);
+                }
+                if (json_buffer_newline(buffer, indent + options->indent) != 0) {
+                    return_defer(1);
+                }
+                if (json_object_dump_string((const char *)kv->key, options->ascii_only, buffer) != 0 ||
+                    json_buffer_append(buffer, ": ", 2) != 0) {
+                    return_defer(1);
+                }
+                if (json_object_dump_pretty((json_object *)kv->value, indent + options->indent, options, buffer) != 0) {
+                    return_defer(1);
+                }
+                index += 1;
+            }
+        }
+        if (json_buffer_newline(buffer, indent) != 0 ||
+            json_buffer_appendc(buffer, '}') != 0) {
+            return_defer(1);
+        }
+        break;
+    default:
+        if (json_object_dump_scalar(object, options, buffer) != 0) {
+            return_defer(1);
+        }
+        break;
+    }
+
+defer:
+    if (sorted != NULL) {
+        DS_FREE(NULL, sorted);
+    }
+    return result;
+}
+
+// Length of a number as json_object_dump_number writes it
+static int json_object_size_number(double number, const json_dump_options *options, size_t *size) {
+    char digits[JSON_DTOA_BUFFER_SIZE];
+
+    if (options->canonical == true) {
+        if (isnan(number) || isinf(number)) {
+            DS_LOG_ERROR("NaN and infinite numbers have no canonical form");
+            return 1;
+        }
+
+        int len = json_dtoa(number == 0 ? 0.0 : number, digits);
+        char *exponent = memchr(digits, 'e', len);
+        *size += len + (exponent != NULL && exponent[1] != '-');
+        return 0;
+    }
+
+    if (options->precision < 0 || isnan(number) || isinf(number)) {
+        *size += json_dtoa(number, digits);
+        return 0;
+    }
+
+    int len = snprintf(NULL, 0, "%.*f", options->precision, number);
+    if (len < 0) {
+        DS_LOG_ERROR("Failed to format number");
+        return 1;
+    }
+
+    *size += len;
+    return 0;
+}
+
+// Length of a string as json_object_dump_string writes it. The same scan finds
+// the bytes that need escapes, and only the widths of the escapes are added.
+static size_t json_object_size_string(const char *string, bool ascii_only) {
+    const unsigned char *str = (const unsigned char *)string;
+    size_t len = strlen(string);
+    size_t size = len + 2;
+    size_t start = 0;
+
+    while (start < len) {
+        size_t i = json_escape_scan(str, start, len, ascii_only);
+
+        if (i >= len) {
+            break;
+        }
+
+        char escape = json_escape_table[str[i]];
+        if (escape == 'u') {
+            size += 5;
+            start = i + 1;
+        } else if (escape != 0) {
+            size += 1;
+            start = i + 1;
+        } else {
+            unsigned int code = 0;
+            unsigned int consumed = json_utf8_decode(str + i, len - i, &code);
+
+            size += (code >= 0x10000 ? 12 : 6) - consumed;
+            start = i + consumed;
+        }
+    }
+
+    return size;
+}
+
+// Add the length of a value as json_object_dump_compact, or with minified
+// false json_object_dump_pretty, writes it. The order of the keys does not
+// change the length, so the maps are not sorted.
+static int json_object_size_value(json_object *object, unsigned int indent, const json_dump_options *options, size_t *size) {
+    size_t count = 0;
+
+    if (options->minified == true && object->source != NULL && json_dump_options_passthrough(options)) {
+        *size += object->source_len;
+        return 0;
+    }
+
+    switch (object->kind) {
+    case JSON_OBJECT_ARRAY:
+        count = object->array.count;
+        for (size_t i = 0; i < count; i++) {
+            if (json_object_size_value((json_object *)object->array.items + i, indent + options->indent, options, size) != 0) {
+                return 1;
+            }
+        }
+        break;
+    case JSON_OBJECT_MAP:
+        for (size_t i = 0; i < object->map.entries.count; i++) {
+            ds_hashmap_kv *kv = (ds_hashmap_kv *)object->map.entries.items + i;
+
+            if (kv->key == NULL) {
+                continue;
+            }
+
+            *size += json_object_size_string((const char *)kv->key, options->ascii_only);
+            *size += options->minified == true ? 1 : 2;
+            if (json_object_size_value((json_object *)kv->value, indent + options->indent, options, size) != 0) {
+                return 1;
+            }
+            count += 1;
+        }
+        break;
+    case JSON_OBJECT_STRING:
+        *size += json_object_size_string(object->string, options->ascii_only);
+        return 0;
+    case JSON_OBJECT_NUMBER:
+        return json_object_size_number(object->number, options, size);
+    case JSON_OBJECT_BOOLEAN:
+        *size += object->boolean == true ? 4 : 5;
+        return 0;
+    case JSON_OBJECT_NULL:
+        *size += 4;
+        return 0;
+    default:
+        return 1;
+    }
+
+    // The brackets and the separators, and in the pretty form a new line
+    // before each item and before the closing bracket
+    *size += 2 + (count > 0 ? count - 1 : 0);
+    if (options->minified == false && count > 0) {
+        *size += count * (1 + indent + options->indent) + 1 + indent;
+    }
+
+    return 0;
+}
+
+static void json_memory_usage_add(json_memory_usage *usage, size_t used, size_t reserved) {
+    usage->used += used;
+    usage->reserved += reserved;
+}
+
+// The walk keeps the reference counters it has seen in a map, so that the
+// storage shared by clones is counted once, with its counter
+static unsigned int json_memory_stats_hash(const void *key) {
+    unsigned long long value = (uintptr_t)key;
+    return (unsigned int)(value ^ (value >> 32)) * 2654435761u;
+}
+
+static int json_memory_stats_compare(const void *k1, const void *k2) {
+    return k1 != k2;
+}
+
+static int json_object_memory_stats_walk(json_object *object, ds_hashmap *shared, json_memory_stats *stats) {
+    int result = 0;
+
+    if (object->refcount != NULL) {
+        ds_hashmap_kv kv = {.key = object->refcount, .value = NULL};
+        if (ds_hashmap_get(shared, &kv) == 0) {
+            return_defer(0);
+        }
+        if (ds_hashmap_insert(shared, &kv) != 0) {
+            DS_LOG_ERROR("Failed to remember shared json object");
+            return_defer(1);
+        }
+
+        json_memory_usage_add(&stats->nodes, sizeof(unsigned int), sizeof(unsigned int));
+        stats->allocations += 1;
+    }
+
+    switch (object->kind) {
+    case JSON_OBJECT_STRING:
+        json_memory_usage_add(&stats->strings, strlen(object->string) + 1, strlen(object->string) + 1);
+        stats->allocations += 1;
+        break;
+    case JSON_OBJECT_NUMBER:
+        break;
+    case JSON_OBJECT_BOOLEAN:
+        break;
+    case JSON_OBJECT_NULL:
+        break;
+    case JSON_OBJECT_ARRAY:
+        json_memory_usage_add(&stats->arrays, object->array.count * object->array.item_size, object->array.capacity * object->array.item_size);
+        if (object->array.items != NULL) {
+            stats->allocations += 1;
+        }
+
+        for (size_t i = 0; i < object->array.count; i++) {
+            json_object *item = NULL;
+            if (ds_dynamic_array_get_ref(&object->array, i, (void **)&item) != 0) {
+                DS_LOG_ERROR("Failed to get item from array");
+                return_defer(1);
+            }
+
+            if (json_object_memory_stats_walk(item, shared, stats) != 0) {
+                return_defer(1);
+            }
+        }
+        break;
+    case JSON_OBJECT_MAP:
+        json_memory_usage_add(&stats->buckets, object->map.count * sizeof(ds_hashmap_kv), object->map.entries.capacity * sizeof(ds_hashmap_kv));
+        json_memory_usage_add(&stats->buckets, 0, object->map.capacity * sizeof(unsigned int));
+        if (object->map.entries.items != NULL) {
+            stats->allocations += 1;
+        }
+        if (object->map.slots != NULL) {
+            stats->allocations += 1;
+        }
+
+        for (size_t i = 0; i < object->map.entries.count; i++) {
+            ds_hashmap_kv kv = {0};
+            if (ds_dynamic_array_get(&object->map.entries, i, &kv) != 0) {
+                DS_LOG_ERROR("Failed to get item from array");
+                return_defer(1);
+            }
+
+            if (kv.key == NULL) {
+                continue;
+            }
+
+            json_memory_usage_add(&stats->strings, strlen((char *)kv.key) + 1, strlen((char *)kv.key) + 1);
+            json_memory_usage_add(&stats->nodes, sizeof(json_object), sizeof(json_object));
+            stats->allocations += 2;
+
+            if (json_object_memory_stats_walk((json_object *)kv.value, shared, stats) != 0) {
+                return_defer(1);
+            }
+        }
+        break;
+    }
+
+defer:
+    return result;
+}
+
+// Mark the object as shared by one more reference
+//
+// The reference counter is allocated lazily on the first share, and installed
+// with a compare and swap so that concurrent clones of the same object agree
+// on a single counter.
+static int json_object_share(json_object *object) {
+    int result = 0;
+    unsigned int *refcount = NULL;
+
+    if (object->kind != JSON_OBJECT_STRING && object->kind != JSON_OBJECT_ARRAY && object->kind != JSON_OBJECT_MAP) {
+        return_defer(0);
+    }
+
+    if (__atomic_load_n(&object->refcount, __ATOMIC_ACQUIRE) == NULL) {
+        refcount = DS_MALLOC(NULL, sizeof(unsigned int));
+        if (refcount == NULL) {
+            DS_LOG_ERROR("Failed to allocate reference counter");
+            return_defer(1);
+        }
+        *refcount = 1;
+
+        unsigned int *expected = NULL;
+        if (__atomic_compare_exchange_n(&object->refcount, &expected, refcount, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            refcount = NULL;
+        }
+    }
+
+    __atomic_add_fetch(object->refcount, 1, __ATOMIC_ACQ_REL);
+
+defer:
+    if (refcount != NULL) {
+        DS_FREE(NULL, refcount);
+    }
+    return result;
+}
+
+// Load json object from a string
+//
+// Returns 0 if parsing successful. Returns 1 if it failed
+DSHDEF int json_object_load(char *buffer, size_t buffer_len, json_object *object) {
+    return json_object_load_with_options(buffer, buffer_len, NULL, object);
+}
+
+// Load json object from a string using the given options
+//
+// If options is NULL the defaults are used, which do not keep the source.
+// Returns 0 if parsing successful. Returns 1 if it failed
+DSHDEF int json_object_load_with_options(char *buffer, size_t buffer_len, const json_load_options *options, json_object *object) {
+    int result = 0;
+    json_lexer lexer = {0};
+    json_parser parser = {0};
+
+    json_lexer_init(&lexer, buffer, buffer_len);
+    json_parser_init(&parser, lexer);
+    parser.keep_source = (options != NULL) ? options->keep_source : false;
+
+    if (json_parser_parse(&parser, object) != 0) {
+        DS_LOG_ERROR("Failed to parse json");
+        return_defer(1);
+    }
+
+defer:
+    json_parser_free(&parser);
+    json_lexer_free(&lexer);
+    return result;
+}
+
+// Show a debug view of the JSON AST
+//
+// Returns 0 if debug is ok. Returns 1 if it failed
+DSHDEF int json_object_debug(json_object *object) {
+    return json_object_debug_indent(object, 0);
+}
+
+// Copy the options, or the defaults if options is NULL, and apply the
+// settings that the canonical form implies
+static void json_dump_options_resolve(const json_dump_options *options, json_dump_options *resolved) {
+    if (options == NULL) {
+        json_dump_options_init(resolved);
+    } else {
+        *resolved = *options;
+    }
+
+    if (resolved->canonical == true) {
+        resolved->minified = true;
+        resolved->trailing_newline = false;
+        resolved->key_order = JSON_DUMP_KEYS_CANONICAL;
+        resolved->precision = -1;
+        resolved->ascii_only = false;
+    }
+}
+
+// Write the JSON into the buffer using the given options, or the defaults if
+// options is NULL
+static int json_object_dump_buffer(json_object *object, const json_dump_options *options, json_buffer *out) {
+    int result = 0;
+    json_dump_options resolved = {0};
+    ds_thread_pool pool = {0};
+
+    json_dump_options_resolve(options, &resolved);
+    options = &resolved;
+
+    // Started by the first large container, if there is one
+    if (resolved.threads > 1 && resolved.pool == NULL) {
+        resolved.pool = &pool;
+    }
+
+    if (options->minified == true) {
+        if (json_object_dump_compact(object, options, out) != 0) {
+            DS_LOG_ERROR("Failed to dump value");
+            return_defer(1);
+        }
+    } else {
+        if (json_object_dump_pretty(object, 0, options, out) != 0) {
+            DS_LOG_ERROR("Failed to dump value");
+            return_defer(1);
+        }
+    }
+
+    if (options->trailing_newline == true) {
+        if (json_buffer_appendc(out, '\n') != 0) {
+            DS_LOG_ERROR("Failed to dump value");
+            return_defer(1);
+        }
+    }
+
+defer:
+    ds_thread_pool_free(&pool);
+    return result;
+}
+
+// Print the JSON into a string
+//
+// The JSON is written directly into a single growable buffer, which is then
+// handed to the caller. Returns 0 if dump is ok. Returns 1 if it failed
+DSHDEF int json_object_dump(json_object *object, char **buffer) {
+    return json_object_dump_with_options(object, NULL, buffer);
+}
+
+// Print the JSON into a string using the given options
+//
+// If options is NULL the defaults from json_dump_options_init are used.
+// Returns 0 if dump is ok. Returns 1 if it failed
+DSHDEF int json_object_dump_with_options(json_object *object, const json_dump_options *options, char **buffer) {
+    int result = 0;
+    json_buffer out = {0};
+
+    if (options != NULL && options->exact_size == true) {
+        size_t size = 0;
+        if (json_object_dump_size(object, options, &size) != 0) {
+            return_defer(1);
+        }
+
+        out.data = DS_MALLOC(NULL, size + 1);
+        if (out.data == NULL) {
+            DS_LOG_ERROR("Failed to allocate buffer");
+            return_defer(1);
+        }
+        out.capacity = size + 1;
+        out.fixed = true;
+    }
+
+    if (json_object_dump_buffer(object, options, &out) != 0) {
+        return_defer(1);
+    }
+
+    *buffer = out.data;
+    out = (json_buffer){0};
+
+defer:
+    json_buffer_free(&out);
+    return result;
+}
+
+// Compute the length of the dumped JSON
+//
+// The lengths of the values are added up without writing the JSON: strings
+// only count their escapes, numbers are formatted on the stack, and the maps
+// are not sorted. The size does not count the NUL terminator. Returns 0 if
+// dump is ok. Returns 1 if it failed
+DSHDEF int json_object_dump_size(json_object *object, const json_dump_options *options, size_t *size) {
+    int result = 0;
+    json_dump_options resolved = {0};
+    size_t total = 0;
+
+    json_dump_options_resolve(options, &resolved);
+
+    if (json_object_size_value(object, 0, &resolved, &total) != 0) {
+        DS_LOG_ERROR("Failed to dump value");
+        return_defer(1);
+    }
+
+    if (resolved.trailing_newline == true) {
+        total += 1;
+    }
+
+    *size = total;
+
+defer:
+    return result;
+}
+
+// Print the JSON into a buffer of the caller
+//
+// The buffer needs json_object_dump_size + 1 bytes for the JSON and the NUL
+// terminator. The number of bytes written, without the terminator, is stored
+// in written. Returns 0 if dump is ok. Returns 1 if it failed or the buffer is
+// too small
+DSHDEF int json_object_dump_to(json_object *object, const json_dump_options *options, char *buffer, size_t size, size_t *written) {
+    int result = 0;
+    json_buffer out = {.data = buffer, .capacity = size, .fixed = true};
+
+    if (size == 0) {
+        DS_LOG_ERROR("The buffer of 0 bytes is too small");
+        return_defer(1);
+    }
+
+    if (json_object_dump_buffer(object, options, &out) != 0) {
+        return_defer(1);
+    }
+
+    buffer[out.count] = '\0';
+    *written = out.count;
+
+defer:
+    return result;
+}
+
+// Print the JSON to a file descriptor
+//
+// The JSON is written through a buffer of JSON_OBJECT_DUMP_FD_BUFFER_SIZE
+// bytes that is flushed with writev each time it fills, so the memory used
+// does not depend on the size of the output. If options is NULL the defaults
+// are used. Returns 0 if dump is ok. Returns 1 if it failed
+DSHDEF int json_object_dump_fd(json_object *object, const json_dump_options *options, int fd) {
+    int result = 0;
+    json_buffer out = {0};
+
+    if (json_buffer_init_fd(&out, fd) != 0) {
+        return_defer(1);
+    }
+
+    if (json_object_dump_buffer(object, options, &out) != 0) {
+        return_defer(1);
+    }
+
+    if (json_buffer_flush(&out, NULL, 0) != 0) {
+        DS_LOG_ERROR("Failed to flush buffer");
+        return_defer(1);
+    }
+
+defer:
+    json_buffer_free(&out);
+    return result;
+}
+
+// Print the JSON to a file
+//
+// The file is created or truncated. If filename is NULL the JSON is written to
+// stdout. Returns 0 if dump is ok. Returns 1 if it failed
+DSHDEF int json_object_dump_file(json_object *object, const json_dump_options *options, const char *filename) {
+    int result = 0;
+    int fd = STDOUT_FILENO;
+
+    if (filename != NULL) {
+        fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            DS_LOG_ERROR("Failed to open file: %s", filename);
+            return_defer(1);
+        }
+    }
+
+    if (json_object_dump_fd(object, options, fd) != 0) {
+        return_defer(1);
+    }
+
+defer:
+    if (filename != NULL && fd >= 0) {
+        if (close(fd) != 0 && result == 0) {
+            DS_LOG_ERROR("Failed to close file: %s", filename);
+            result = 1;
+        }
+    }
+    return result;
+}
+
+// Initialize the dump options with the defaults
+//
+// The defaults are a pretty printed output indented by JSON_OBJECT_DUMP_INDENT
+// spaces, with a trailing newline, the keys in insertion order and the numbers
+// in JSON_OBJECT_DUMP_PRECISION.
+DSHDEF void json_dump_options_init(json_dump_options *options) {
+    *options = (json_dump_options){
+        .minified = false,
+        .indent = JSON_OBJECT_DUMP_INDENT,
+        .trailing_newline = true,
+        .key_order = JSON_DUMP_KEYS_INSERTION,
+        .precision = JSON_OBJECT_DUMP_PRECISION,
+        .ascii_only = false,
+        .exact_size = false,
+        .threads = 0,
+        .pool = NULL,
+        .canonical = false,
+    };
+}
+
+// Compute the memory used by a JSON object
+//
+// Walks the whole tree and reports the bytes used and reserved by nodes,
+// strings, map tables and arrays, and the number of live allocations. The
+// root node is counted as a node, but not as an allocation, since it is owned
+// by the caller. The storage that clones share is counted once, on the first
+// node that refers to it, together with its reference counter.
+//
+// Returns 0 if the stats were computed. Returns 1 if it failed
+DSHDEF int json_object_memory_stats(json_object *object, json_memory_stats *stats) {
+    int result = 0;
+    ds_hashmap shared = {0};
+
+    *stats = (json_memory_stats){0};
+    json_memory_usage_add(&stats->nodes, sizeof(json_object), sizeof(json_object));
+
+    if (ds_hashmap_init(&shared, 0, json_memory_stats_hash, json_memory_stats_compare) != 0) {
+        DS_LOG_ERROR("Failed to initialize hashmap");
+        return_defer(1);
+    }
+
+    if (json_object_memory_stats_walk(object, &shared, stats) != 0) {
+        DS_LOG_ERROR("Failed to compute memory stats");
+        return_defer(1);
+    }
+
+    json_memory_usage_add(&stats->total, stats->nodes.used, stats->nodes.reserved);
+    json_memory_usage_add(&stats->total, stats->strings.used, stats->strings.reserved);
+    json_memory_usage_add(&stats->total, stats->buckets.used, stats->buckets.reserved);
+    json_memory_usage_add(&stats->total, stats->arrays.used, stats->arrays.reserved);
+
+defer:
+    ds_hashmap_free(&shared);
+    return result;
+}
+
+// Clone the JSON object
+//
+// The clone shares the strings, arrays and maps of the original object, so
+// this takes constant time and no memory is duplicated. Both objects must be
+// freed with json_object_free. The setters and getters unshare them as they
+// go, so that the changes to one of them are not seen by the other.
+//
+// Returns 0 if clone is ok. Returns 1 if it failed
+DSHDEF int json_object_clone(json_object *object, json_object *clone) {
+    int result = 0;
+
+    if (json_object_share(object) != 0) {
+        DS_LOG_ERROR("Failed to share json object");
+        return_defer(1);
+    }
+
+    *clone = *object;
+
+defer:
+    return result;
+}
+
+// Make the JSON object exclusively owned so it can be modified
+//
+// If the object is shared, this copies the top level string, array items or
+// map entries. The children are shared with the other references, and are
+// unshared in turn when they are changed or reached with a getter.
+//
+// Returns 0 if unshare is ok. Returns 1 if it failed
+DSHDEF int json_object_unshare(json_object *object) {
+    int result = 0;
+    json_object copy = {.kind = object->kind, .source = object->source, .source_len = object->source_len};
+
+    if (object->refcount == NULL) {
+        return_defer(0);
+    }
+
+    if (__atomic_load_n(object->refcount, __ATOMIC_ACQUIRE) == 1) {
+        DS_FREE(NULL, object->refcount);
+        object->refcount = NULL;
+        return_defer(0);
+    }
+
+    switch (object->kind) {
+    case JSON_OBJECT_STRING: {
+        ds_string_slice slice = {.str = object->string, .len = strlen(object->string)};
+        if (ds_string_slice_to_owned(&slice, &copy.string) != 0) {
+            DS_LOG_ERROR("Failed to allocate string");
+            return_defer(1);
+        }
+        break;
+    }
+    case JSON_OBJECT_NUMBER:
+        break;
+    case JSON_OBJECT_BOOLEAN:
+        break;
+    case JSON_OBJECT_NULL:
+        break;
+    case JSON_OBJECT_ARRAY:
+        ds_dynamic_array_init(&copy.array, sizeof(json_object));
+        if (ds_dynamic_array_reserve(&copy.array, object->array.count) != 0) {
+            DS_LOG_ERROR("Failed to allocate array");
+            return_defer(1);
+        }
+        for (size_t i = 0; i < object->array.count; i++) {
+            json_object *item = NULL;
+            if (ds_dynamic_array_get_ref(&object->array, i, (void **)&item) != 0) {
+                DS_LOG_ERROR("Failed to get item from array");
+                return_defer(1);
+            }
+
+            json_object clone = {0};
+            if (json_object_clone(item, &clone) != 0) {
+                return_defer(1);
+            }
+
+            if (ds_dynamic_array_append(&copy.array, &clone) != 0) {
+                DS_LOG_ERROR("Failed to add item to array");
+                json_object_free(&clone);
+                return_defer(1);
+            }
+        }
+        break;
+    case JSON_OBJECT_MAP:
+        if (ds_hashmap_init(&copy.map, object->map.count, object->map.hash, object->map.compare) != 0) {
+            DS_LOG_ERROR("Failed to allocate map");
+            return_defer(1);
+        }
+        for (size_t i = 0; i < object->map.entries.count; i++) {
+            ds_hashmap_kv kv = {0};
+            if (ds_dynamic_array_get(&object->map.entries, i, &kv) != 0) {
+                DS_LOG_ERROR("Failed to get item from array");
+                return_defer(1);
+            }
+
+            if (kv.key == NULL) {
+                continue;
+            }
+
+            ds_string_slice slice = {.str = (char *)kv.key, .len = strlen((char *)kv.key)};
+            ds_hashmap_kv clone = {.hash = kv.hash};
+            if (ds_string_slice_to_owned(&slice, (char **)&clone.key) != 0) {
+                DS_LOG_ERROR("Failed to allocate string");
+                return_defer(1);
+            }
+
+            clone.value = DS_MALLOC(NULL, sizeof(json_object));
+            if (clone.value == NULL) {
+                DS_LOG_ERROR("Failed to allocate value for map");
+                DS_FREE(NULL, clone.key);
+                return_defer(1);
+            }
+
+            if (json_object_clone((json_object *)kv.value, (json_object *)clone.value) != 0) {
+                DS_FREE(NULL, clone.key);
+                DS_FREE(NULL, clone.value);
+                return_defer(1);
+            }
+
+            if (ds_hashmap_insert_hashed(&copy.map, &clone) != 0) {
+                DS_LOG_ERROR("Failed to insert item to map");
+                json_object_free((json_object *)clone.value);
+                DS_FREE(NULL, clone.key);
+                DS_FREE(NULL, clone.value);
+                return_defer(1);
+            }
+        }
+        break;
+    }
+
+    // Release our reference to the shared data, the last owner frees it
+    if (json_object_free(object) != 0) {
+        DS_LOG_ERROR("Failed to release shared json object");
+        return_defer(1);
+    }
+
+    *object = copy;
+    copy = (json_object){.kind = JSON_OBJECT_NULL};
+
+defer:
+    json_object_free(&copy);
+    return result;
+}
+
+// Mark the JSON object as changed
+//
+// The object forgets the text it was loaded from, so that a dump writes its
+// current value. The functions of this module that change an object call this
+// already.
+DSHDEF void json_object_touch(json_object *object) {
+    object->source = NULL;
+    object->source_len = 0;
+}
+
+// Free the JSON object
+//
+// If the object is shared, this only releases the reference and the data is
+// freed by the last owner.
+//
+// Returns 0 if free is ok. Returns 1 if it failed
+DSHDEF int json_object_free(json_object *object) {
+    int result = 0;
+
+    if (object->refcount != NULL) {
+        if (__atomic_sub_fetch(object->refcount, 1, __ATOMIC_ACQ_REL) > 0) {
+            object->refcount = NULL;
+            return_defer(0);
+        }
+
+        DS_FREE(NULL, object->refcount);
+        object->refcount = NULL;
+    }
+
+    switch (object->kind) {
+    case JSON_OBJECT_STRING:
+        DS_FREE(NULL, object->string);
+        break;
+    case JSON_OBJECT_NUMBER:
+        break;
+    case JSON_OBJECT_BOOLEAN:
+        break;
+    case JSON_OBJECT_NULL:
+        break;
+    case JSON_OBJECT_ARRAY:
+        for (size_t i = 0; i < object->array.count; i++) {
+            json_object *item = NULL;
+            if (ds_dynamic_array_get_ref(&object->array, i, (void **)&item) != 0) {
+                DS_LOG_ERROR("Failed to get item from array");
+                return_defer(1);
+            }
+
+            if (json_object_free(item) != 0) {
+                DS_LOG_ERROR("Failed to free json object");
+                return_defer(1);
+            }
+        }
+        ds_dynamic_array_free(&object->array);
+        break;
+    case JSON_OBJECT_MAP:
+        for (size_t i = 0; i < object->map.entries.count; i++) {
+            ds_hashmap_kv kv = {0};
+            if (ds_dynamic_array_get(&object->map.entries, i, &kv) != 0) {
+                DS_LOG_ERROR("Failed to get item from array");
+                return_defer(1);
+            }
+
+            if (kv.key == NULL) {
+                continue;
+            }
+
+            DS_FREE(NULL, kv.key);
+            if (json_object_free(kv.value) != 0) {
+                DS_LOG_ERROR("Failed to free json object");
+                return_defer(1);
+            }
+            DS_FREE(NULL, kv.value);
+        }
+        ds_hashmap_free(&object->map);
+        break;
+    }
+
+defer:
+    return result;
+}
+
+// Initialize a JSON string object with a copy of the string
+//
+// Returns 0 if init is ok. Returns 1 if it failed
+DSHDEF int json_object_init_string(json_object *object, const char *string) {
+    int result = 0;
+    ds_string_slice slice = {.str = (char *)string, .len = strlen(string)};
+
+    *object = (json_object){.kind = JSON_OBJECT_STRING};
+    if (ds_string_slice_to_owned(&slice, &object->string) != 0) {
+        DS_LOG_ERROR("Failed to allocate string");
+        object->kind = JSON_OBJECT_NULL;
+        return_defer(1);
+    }
+
+defer:
+    return result;
+}
+
+// Initialize a JSON number object
+DSHDEF void json_object_init_number(json_object *object, double number) {
+    *object = (json_object){.kind = JSON_OBJECT_NUMBER, .number = number};
+}
+
+// Initialize a JSON boolean object
+DSHDEF void json_object_init_boolean(json_object *object, bool boolean) {
+    *object = (json_object){.kind = JSON_OBJECT_BOOLEAN, .boolean = boolean};
+}
+
+// Initialize a JSON null object
+DSHDEF void json_object_init_null(json_object *object) {
+    *object = (json_object){.kind = JSON_OBJECT_NULL};
+}
+
+// Initialize an empty JSON array object
+DSHDEF void json_object_init_array(json_object *object) {
+    *object = (json_object){.kind = JSON_OBJECT_ARRAY};
+    ds_dynamic_array_init(&object->array, sizeof(json_object));
+}
+
+// Initialize an empty JSON map object
+//
+// Returns 0 if init is ok. Returns 1 if it failed
+DSHDEF int json_object_init_map(json_object *object) {
+    int result = 0;
+
+    *object = (json_object){.kind = JSON_OBJECT_MAP};
+    if (ds_hashmap_init(&object->map, JSON_OBJECT_MAP_INIT_CAPACITY, json_object_hash, json_object_compare) != 0) {
+        DS_LOG_ERROR("Failed to allocate map");
+        object->kind = JSON_OBJECT_NULL;
+        return_defer(1);
+    }
+
+defer:
+    return result;
+}
+
+// Find the value of a key in a JSON map without changing the map
+//
+// Unlike json_object_map_get, the map is neither unshared nor made to forget
+// its source text, so the value is read only.
+//
+// Returns 0 if the key was found. Returns 1 if the key is missing or the
+// object is not a map
+DSHDEF int json_object_map_find(const json_object *object, const char *key, const json_object **value) {
+    int result = 0;
+    ds_hashmap_kv *kv = NULL;
+
+    if (object->kind != JSON_OBJECT_MAP) {
+        DS_LOG_ERROR("Expected a json map");
+        return_defer(1);
+    }
+
+    if (ds_hashmap_get_ref((ds_hashmap *)&object->map, key, json_object_hash(key), &kv) != 0) {
+        return_defer(1);
+    }
+
+    *value = (const json_object *)kv->value;
+
+defer:
+    return result;
+}
+
+// Get a reference to the value of a key in a JSON map
+//
+// A shared map is unshared first, so that the value can be changed through the
+// reference without changing the clones of the map, and the map forgets its
+// source text.
+//
+// Returns 0 if the key was found. Returns 1 if the key is missing, the object
+// is not a map or it failed
+DSHDEF int json_object_map_get(json_object *object, const char *key, json_object **value) {
+    int result = 0;
+    ds_hashmap_kv *kv = NULL;
+
+    if (object->kind != JSON_OBJECT_MAP) {
+        DS_LOG_ERROR("Expected a json map");
+        return_defer(1);
+    }
+
+    if (json_object_unshare(object) != 0) {
+        DS_LOG_ERROR("Failed to unshare json object");
+        return_defer(1);
+    }
+    if (object->source != NULL) {
+        json_object_touch(object);
+    }
+
+    if (ds_hashmap_get_ref(&object->map, key, json_object_hash(key), &kv) != 0) {
+        return_defer(1);
+    }
+
+    *value = (json_object *)kv->value;
+
+defer:
+    return result;
+}
+
+// Set the value of a key in a JSON map
+//
+// The map takes ownership of the value. If the key already exists the old
+// value is freed and replaced.
+//
+// Returns 0 if set is ok. Returns 1 if it failed
+DSHDEF int json_object_map_set(json_object *object, const char *key, json_object *value) {
+    int result = 0;
+    ds_hashmap_kv *ref = NULL;
+    ds_hashmap_kv kv = {0};
+
+    if (object->kind != JSON_OBJECT_MAP) {
+        DS_LOG_ERROR("Expected a json map");
+        return_defer(1);
+    }
+
+    if (json_object_unshare(object) != 0) {
+        DS_LOG_ERROR("Failed to unshare json object");
+        return_defer(1);
+    }
+    json_object_touch(object);
+
+    kv.hash = json_object_hash(key);
+    if (ds_hashmap_get_ref(&object->map, key, kv.hash, &ref) == 0) {
+        json_object *old = (json_object *)ref->value;
+        if (json_object_free(old) != 0) {
+            DS_LOG_ERROR("Failed to free json object");
+            return_defer(1);
+        }
+        *old = *value;
+        return_defer(0);
+    }
+
+    ds_string_slice slice = {.str = (char *)key, .len = strlen(key)};
+    if (ds_string_slice_to_owned(&slice, (char **)&kv.key) != 0) {
+        DS_LOG_ERROR("Failed to allocate string");
+        return_defer(1);
+    }
+
+    kv.value = DS_MALLOC(NULL, sizeof(json_object));
+    if (kv.value == NULL) {
+        DS_LOG_ERROR("Failed to allocate value for map");
+        return_defer(1);
+    }
+    *(json_object *)kv.value = *value;
+
+    if (ds_hashmap_insert_hashed(&object->map, &kv) != 0) {
+        DS_LOG_ERROR("Failed to insert item to map");
+        return_defer(1);
+    }
+    kv = (ds_hashmap_kv){0};
+
+defer:
+    if (kv.key != NULL) {
+        DS_FREE(NULL, kv.key);
+    }
+    if (kv.value != NULL) {
+        DS_FREE(NULL, kv.value);
+    }
+    return result;
+}
+
+// Remove a key from a JSON map and free its value
+//
+// Returns 0 if the key was removed. Returns 1 if the key is missing or it
+// failed
+DSHDEF int json_object_map_remove(json_object *object, const char *key) {
+    int result = 0;
+    ds_hashmap_kv *ref = NULL;
+
+    if (object->kind != JSON_OBJECT_MAP) {
+        DS_LOG_ERROR("Expected a json map");
+        return_defer(1);
+    }
+
+    if (json_object_unshare(object) != 0) {
+        DS_LOG_ERROR("Failed to unshare json object");
+        return_defer(1);
+    }
+    json_object_touch(object);
+
+    if (ds_hashmap_get_ref(&object->map, key, json_object_hash(key), &ref) != 0) {
+        return_defer(1);
+    }
+
+    ds_hashmap_kv kv = *ref;
+    if (ds_hashmap_delete(&object->map, kv.key) != 0) {
+        return_defer(1);
+    }
+
+    DS_FREE(NULL, kv.key);
+    if (json_object_free((json_object *)kv.value) != 0) {
+        DS_LOG_ERROR("Failed to free json object");
+        result = 1;
+    }
+    DS_FREE(NULL, kv.value);
+
+defer:
+    return result;
+}
+
+// Find an item of a JSON array without changing the array
+//
+// Unlike json_object_array_get, the array is neither unshared nor made to
+// forget its source text, so the item is read only.
+//
+// Returns 0 if the item was found. Returns 1 if the index is out of bounds or
+// the object is not an array
+DSHDEF int json_object_array_find(const json_object *object, size_t index, const json_object **item) {
+    int result = 0;
+
+    if (object->kind != JSON_OBJECT_ARRAY) {
+        DS_LOG_ERROR("Expected a json array");
+        return_defer(1);
+    }
+
+    if (index >= object->array.count) {
+        return_defer(1);
+    }
+
+    *item = (const json_object *)object->array.items + index;
+
+defer:
+    return result;
+}
+
+// Get a reference to an item of a JSON array
+//
+// A shared array is unshared first, so that the item can be changed through
+// the reference without changing the clones of the array, and the array
+// forgets its source text.
+//
+// Returns 0 if the item was found. Returns 1 if the index is out of bounds,
+// the object is not an array or it failed
+DSHDEF int json_object_array_get(json_object *object, size_t index, json_object **item) {
+    int result = 0;
+
+    if (object->kind != JSON_OBJECT_ARRAY) {
+        DS_LOG_ERROR("Expected a json array");
+        return_defer(1);
+    }
+
+    if (json_object_unshare(object) != 0) {
+        DS_LOG_ERROR("Failed to unshare json object");
+        return_defer(1);
+    }
+    if (object->source != NULL) {
+        json_object_touch(object);
+    }
+
+    if (ds_dynamic_array_get_ref(&object->array, index, (void **)item) != 0) {
+        return_defer(1);
+    }
+
+defer:
+    return result;
+}
+
+// Append an item at the end of a JSON array
+//
+// The array takes ownership of the item.
+//
+// Returns 0 if push is ok. Returns 1 if it failed
+DSHDEF int json_object_array_push(json_object *object, json_object *item) {
+    return json_object_array_insert(object, object->array.count, item);
+}
+
+// Insert an item in a JSON array at the given index
+//
+// The array takes ownership of the item. The items after the index are moved
+// one position to the right.
+//
+// Returns 0 if insert is ok. Returns 1 if it failed
+DSHDEF int json_object_array_insert(json_object *object, size_t index, json_object *item) {
+    int result = 0;
+
+    if (object->kind != JSON_OBJECT_ARRAY) {
+        DS_LOG_ERROR("Expected a json array");
+        return_defer(1);
+    }
+
+    if (json_object_unshare(object) != 0) {
+        DS_LOG_ERROR("Failed to unshare json object");
+        return_defer(1);
+    }
+    json_object_touch(object);
+
+    if (object->array.capacity == 0) {
+        if (ds_dynamic_array_reserve(&object->array, JSON_OBJECT_ARRAY_INIT_CAPACITY) != 0) {
+            DS_LOG_ERROR("Failed to allocate array");
+            return_defer(1);
+        }
+    }
+
+    if (ds_dynamic_array_insert(&object->array, index, item) != 0) {
+        DS_LOG_ERROR("Failed to add item to array");
+        return_defer(1);
+    }
+
+defer:
+    return result;
+}
+
+// Remove an item from a JSON array and free it
+//
+// The items after the index are moved one position to the left.
+//
+// Returns 0 if the item was removed. Returns 1 if it failed
+DSHDEF int json_object_array_remove(json_object *object, size_t index) {
+    int result = 0;
+    json_object item = {0};
+
+    if (object->kind != JSON_OBJECT_ARRAY) {
+        DS_LOG_ERROR("Expected a json array");
+        return_defer(1);
+    }
+
+    if (json_object_unshare(object) != 0) {
+        DS_LOG_ERROR("Failed to unshare json object");
+        return_defer(1);
+    }
+    json_object_touch(object);
+
+    if (ds_dynamic_array_get(&object->array, index, &item) != 0) {
+        return_defer(1);
+    }
+
+    if (ds_dynamic_array_delete(&object->array, index) != 0) {
+        return_defer(1);
+    }
+
+    if (json_object_free(&item) != 0) {
+        DS_LOG_ERROR("Failed to free json object");
+        return_defer(1);
+    }
+
+defer:
+    return result;
+}
+
+static int json_path_add_key(json_path *compiled, char **keys, const char *key, size_t len) {
+    DS_MEMCPY(*keys, key, len);
+    (*keys)[len] = '\0';
+
+    json_path_segment segment = {
+        .kind = JSON_PATH_KEY,
+        .key = *keys,
+        .len = len,
+        .hash = json_object_hash_len(key, len),
+    };
+    *keys += len + 1;
+
+    return ds_dynamic_array_append(&compiled->segments, &segment);
+}
+
+// Compile a path expression
+//
+// The path is a list of keys separated by '.' and of array indices or quoted
+// keys between square brackets, for example "a.b[3].c" or "a[\"b.c\"]". The
+// empty path refers to the object itself.
+//
+// Returns 0 if compile is ok. Returns 1 if the path is invalid or it failed
+DSHDEF int json_path_compile(const char *path, json_path *compiled) {
+    int result = 0;
+    ds_string_slice slice = {.str = (char *)path, .len = strlen(path)};
+    size_t pos = 0;
+
+    ds_dynamic_array_init(&compiled->segments, sizeof(json_path_segment));
+
+    // The keys are copied with a terminator each, which needs at most twice
+    // the length of the path
+    compiled->buffer = DS_MALLOC(NULL, 2 * slice.len + 1);
+    if (compiled->buffer == NULL) {
+        DS_LOG_ERROR("Failed to allocate string");
+        return_defer(1);
+    }
+
+    const char *buffer = path;
+    char *keys = compiled->buffer;
+    while (pos < slice.len) {
+        if (buffer[pos] == '[') {
+            pos += 1;
+            if (buffer[pos] == '"') {
+                size_t start = pos + 1;
+                pos = start;
+                while (pos < slice.len && buffer[pos] != '"') {
+                    pos += 1;
+                }
+                if (pos >= slice.len) {
+                    DS_LOG_ERROR("Unterminated key in path at %zu", start - 1);
+                    return_defer(1);
+                }
+                if (json_path_add_key(compiled, &keys, buffer + start, pos - start) != 0) {
+                    DS_LOG_ERROR("Failed to add path segment");
+                    return_defer(1);
+                }
+                pos += 1;
+            } else {
+                json_path_segment segment = {.kind = JSON_PATH_INDEX, .index = 0};
+                size_t start = pos;
+                while (isdigit((unsigned char)buffer[pos])) {
+                    size_t digit = buffer[pos] - '0';
+                    if (segment.index > (SIZE_MAX - digit) / 10) {
+                        DS_LOG_ERROR("Index too large in path at %zu", start);
+                        return_defer(1);
+                    }
+                    segment.index = segment.index * 10 + digit;
+                    pos += 1;
+                }
+                if (pos == start) {
+                    DS_LOG_ERROR("Expected an index in path at %zu", pos);
+                    return_defer(1);
+                }
+                if (ds_dynamic_array_append(&compiled->segments, &segment) != 0) {
+                    DS_LOG_ERROR("Failed to add path segment");
+                    return_defer(1);
+                }
+            }
+            if (buffer[pos] != ']') {
+                DS_LOG_ERROR("Expected ']' in path at %zu", pos);
+                return_defer(1);
+            }
+            pos += 1;
+        } else {
+            if (compiled->segments.count > 0) {
+                if (buffer[pos] != '.') {
+                    DS_LOG_ERROR("Expected '.' or '[' in path at %zu", pos);
+                    return_defer(1);
+                }
+                pos += 1;
+            }
+
+            size_t start = pos;
+            while (pos < slice.len && buffer[pos] != '.' && buffer[pos] != '[') {
+                pos += 1;
+            }
+            if (pos == start) {
+                DS_LOG_ERROR("Expected a key in path at %zu", pos);
+                return_defer(1);
+            }
+            if (json_path_add_key(compiled, &keys, buffer + start, pos - start) != 0) {
+                DS_LOG_ERROR("Failed to add path segment");
+                return_defer(1);
+            }
+        }
+    }
+
+defer:
+    if (result != 0) {
+        json_path_free(compiled);
+    }
+    return result;
+}
+
+// Follow a segment of a compiled path without changing the object
+//
+// Returns the value or NULL if the segment does not exist in the object
+static const json_object *json_path_step(const json_object *object, const json_path_segment *segment) {
+    if (segment->kind == JSON_PATH_INDEX) {
+        if (object->kind != JSON_OBJECT_ARRAY || segment->index >= object->array.count) {
+            return NULL;
+        }
+        return (const json_object *)object->array.items + segment->index;
+    }
+
+    if (object->kind != JSON_OBJECT_MAP) {
+        return NULL;
+    }
+
+    ds_hashmap_kv *kv = NULL;
+    if (ds_hashmap_get_ref((ds_hashmap *)&object->map, segment->key, segment->hash, &kv) != 0) {
+        return NULL;
+    }
+    return (const json_object *)kv->value;
+}
+
+// Find the value at the compiled path without changing the object
+//
+// Like json_object_map_find, the containers on the path are neither unshared
+// nor made to forget their source text, so the lookup does not hash the keys
+// again and does not allocate, and the value is read only.
+//
+// Returns 0 if the value was found. Returns 1 if the path does not exist in
+// the object
+DSHDEF int json_path_find(const json_path *path, const json_object *object, const json_object **value) {
+    const json_path_segment *segments = (const json_path_segment *)path->segments.items;
+
+    for (size_t i = 0; i < path->segments.count; i++) {
+        object = json_path_step(object, segments + i);
+        if (object == NULL) {
+            return 1;
+        }
+    }
+
+    *value = object;
+    return 0;
+}
+
+// Get a reference to the value at the compiled path
+//
+// The containers on the path are unshared and forget their source text, as
+// with json_object_map_get and json_object_array_get. Use json_path_find to
+// only read the value.
+//
+// Returns 0 if the value was found. Returns 1 if the path does not exist in
+// the object or it failed
+DSHDEF int json_path_get(json_path *path, json_object *object, json_object **value) {
+    json_path_segment *segments = (json_path_segment *)path->segments.items;
+    const json_object *found = NULL;
+
+    if (json_path_find(path, object, &found) != 0) {
+        return 1;
+    }
+
+    for (size_t i = 0; i < path->segments.count; i++) {
+        if (json_object_unshare(object) != 0) {
+            DS_LOG_ERROR("Failed to unshare json object");
+            return 1;
+        }
+        if (object->source != NULL) {
+            json_object_touch(object);
+        }
+
+        object = (json_object *)json_path_step(object, segments + i);
+    }
+
+    *value = object;
+    return 0;
+}
+
+// Free the compiled path
+DSHDEF void json_path_free(json_path *path) {
+    if (path->buffer != NULL) {
+        DS_FREE(NULL, path->buffer);
+    }
+    path->buffer = NULL;
+    ds_dynamic_array_free(&path->segments);
+}
+
+// State of a level of the writer stack. The root level has no container flag.
+enum {
+    JSON_WRITER_ARRAY = 1 << 0,
+    JSON_WRITER_OBJECT = 1 << 1,
+    JSON_WRITER_ITEMS = 1 << 2, /* at least one item was written */
+    JSON_WRITER_KEY = 1 << 3,   /* a key was written and waits for its value */
+};
+
+// Write the separator and the indentation that go before a value
+static int json_writer_before_value(json_writer *writer) {
+    int result = 0;
+    unsigned char *state = &writer->stack[writer->depth];
+
+    if (*state & JSON_WRITER_OBJECT) {
+        if (!(*state & JSON_WRITER_KEY)) {
+            DS_LOG_ERROR("Expected a key before the value in an object");
+            return_defer(1);
+        }
+        *state &= ~JSON_WRITER_KEY;
+    } else if (*state & JSON_WRITER_ARRAY) {
+        if ((*state & JSON_WRITER_ITEMS) && json_buffer_appendc(&writer->buffer, ',') != 0) {
+            return_defer(1);
+        }
+        if (writer->options.minified == false &&
+            json_buffer_newline(&writer->buffer, writer->depth * writer->options.indent) != 0) {
+            return_defer(1);
+        }
+        *state |= JSON_WRITER_ITEMS;
+    } else {
+        if (*state & JSON_WRITER_ITEMS) {
+            DS_LOG_ERROR("The root value was already written");
+            return_defer(1);
+        }
+        *state |= JSON_WRITER_ITEMS;
+    }
+
+defer:
+    return result;
+}
+
+static int json_writer_begin(json_writer *writer, unsigned char kind, char ch) {
+    int result = 0;
+
+    if (writer->depth >= JSON_WRITER_MAX_DEPTH) {
+        DS_LOG_ERROR("The maximum depth of %d was reached", JSON_WRITER_MAX_DEPTH);
+        return_defer(1);
+    }
+
+    if (json_writer_before_value(writer) != 0) {
+        return_defer(1);
+    }
+
+    if (json_buffer_appendc(&writer->buffer, ch) != 0) {
+        return_defer(1);
+    }
+
+    writer->depth += 1;
+    writer->stack[writer->depth] = kind;
+
+defer:
+    return result;
+}
+
+static int json_writer_end(json_writer *writer, unsigned char kind, char ch) {
+    int result = 0;
+    unsigned char state = writer->stack[writer->depth];
+
+    if (writer->depth == 0 || !(state & kind)) {
+        DS_LOG_ERROR("Expected the end of %s", (state & JSON_WRITER_OBJECT) ? "an object" : (state & JSON_WRITER_ARRAY) ? "an array" : "the root value");
+        return_defer(1);
+    }
+
+    if (state & JSON_WRITER_KEY) {
+        DS_LOG_ERROR("Expected a value after the key");
+        return_defer(1);
+    }
+
+    writer->depth -= 1;
+
+    if ((state & JSON_WRITER_ITEMS) && writer->options.minified == false &&
+        json_buffer_newline(&writer->buffer, writer->depth * writer->options.indent) != 0) {
+        return_defer(1);
+    }
+
+    if (json_buffer_appendc(&writer->buffer, ch) != 0) {
+        return_defer(1);
+    }
+
+defer:
+    return result;
+}
+
+// Initialize a writer that builds the JSON in memory
+//
+// If options is NULL the defaults from json_dump_options_init are used. The
+// result is returned by json_writer_finish.
+//
+// Returns 0 if the writer is ok. Returns 1 if it failed
+DSHDEF int json_writer_init(json_writer *writer, const json_dump_options *options) {
+    *writer = (json_writer){0};
+
+    json_dump_options_resolve(options, &writer->options);
+
+    return 0;
+}
+
+// Initialize a writer that writes the JSON to a file descriptor
+//
+// The JSON goes through a buffer of JSON_OBJECT_DUMP_FD_BUFFER_SIZE bytes that
+// is flushed each time it fills, and json_writer_finish flushes the rest.
+//
+// Returns 0 if the writer is ok. Returns 1 if it failed
+DSHDEF int json_writer_init_fd(json_writer *writer, const json_dump_options *options, int fd) {
+    int result = 0;
+
+    if (json_writer_init(writer, options) != 0) {
+        return_defer(1);
+    }
+
+    if (json_buffer_init_fd(&writer->buffer, fd) != 0) {
+        return_defer(1);
+    }
+
+defer:
+    return result;
+}
+
+// Open an object
+//
+// Returns 0 if the object was opened. Returns 1 if it is not allowed here
+DSHDEF int json_writer_begin_object(json_writer *writer) {
+    return json_writer_begin(writer, JSON_WRITER_OBJECT, '{');
+}
+
+// Close the current object
+//
+// Returns 0 if the object was closed. Returns 1 if the current container is
+// not an object or a key has no value
+DSHDEF int json_writer_end_object(json_writer *writer) {
+    return json_writer_end(writer, JSON_WRITER_OBJECT, '}');
+}
+
+// Open an array
+//
+// Returns 0 if the array was opened. Returns 1 if it is not allowed here
+DSHDEF int json_writer_begin_array(json_writer *writer) {
+    return json_writer_begin(writer, JSON_WRITER_ARRAY, '[');
+}
+
+// Close the current array
+//
+// Returns 0 if the array was closed. Returns 1 if the current container is
+// not an array
+DSHDEF int json_writer_end_array(json_writer *writer) {
+    return json_writer_end(writer, JSON_WRITER_ARRAY, ']');
+}
+
+// Write the key of the next value of the current object
+//
+// Returns 0 if the key was written. Returns 1 if the current container is not
+// an object or the previous key has no value
+DSHDEF int json_writer_key(json_writer *writer, const char *key) {
+    int result = 0;
+    unsigned char *state = &writer->stack[writer->depth];
+
+    if (!(*state & JSON_WRITER_OBJECT) || (*state & JSON_WRITER_KEY)) {
+        DS_LOG_ERROR("Expected a value but found the key \"%s\"", key);
+        return_defer(1);
+    }
+
+    if ((*state & JSON_WRITER_ITEMS) && json_buffer_appendc(&writer->buffer, ',') != 0) {
+        return_defer(1);
+    }
+
+    if (writer->options.minified == false &&
+        json_buffer_newline(&writer->buffer, writer->depth * writer->options.indent) != 0) {
+        return_defer(1);
+    }
+
+    if (json_object_dump_string(key, writer->options.ascii_only, &writer->buffer) != 0) {
+        return_defer(1);
+    }
+
+    if (writer->options.minified == true) {
+        if (json_buffer_appendc(&writer->buffer, ':') != 0) {
+            return_defer(1);
+        }
+    } else {
+        if (json_buffer_append(&writer->buffer, ": ", 2) != 0) {
+            return_defer(1);
+        }
+    }
+
+    *state |= JSON_WRITER_ITEMS | JSON_WRITER_KEY;
+
+defer:
+    return result;
+}
+
+// Write a string value
+//
+// Returns 0 if the value was written. Returns 1 if it is not allowed here
+DSHDEF int json_writer_string(json_writer *writer, const char *string) {
+    if (json_writer_before_value(writer) != 0) {
+        return 1;
+    }
+
+    return json_object_dump_string(string, writer->options.ascii_only, &writer->buffer);
+}
+
+// Write a number value
+//
+// Returns 0 if the value was written. Returns 1 if it is not allowed here
+DSHDEF int json_writer_number(json_writer *writer, double number) {
+    if (json_writer_before_value(writer) != 0) {
+        return 1;
+    }
+
+    return json_object_dump_number(number, &writer->options, &writer->buffer);
+}
+
+// Write a boolean value
+//
+// Returns 0 if the value was written. Returns 1 if it is not allowed here
+DSHDEF int json_writer_boolean(json_writer *writer, bool boolean) {
+    if (json_writer_before_value(writer) != 0) {
+        return 1;
+    }
+
+    if (boolean == true) {
+        return json_buffer_append(&writer->buffer, "true", 4);
+    }
+    return json_buffer_append(&writer->buffer, "false", 5);
+}
+
+// Write a null value
+//
+// Returns 0 if the value was written. Returns 1 if it is not allowed here
+DSHDEF int json_writer_null(json_writer *writer) {
+    if (json_writer_before_value(writer) != 0) {
+        return 1;
+    }
+
+    return json_buffer_append(&writer->buffer, "null", 4);
+}
+
+// Write a JSON Object as a value
+//
+// Returns 0 if the value was written. Returns 1 if it is not allowed here
+DSHDEF int json_writer_value(json_writer *writer, json_object *object) {
+    if (json_writer_before_value(writer) != 0) {
+        return 1;
+    }
+
+    if (writer->options.minified == true) {
+        return json_object_dump_compact(object, &writer->options, &writer->buffer);
+    }
+    return json_object_dump_pretty(object, writer->depth * writer->options.indent, &writer->options, &writer->buffer);
+}
+
+// Finish the JSON
+//
+// Checks that the root value is complete and writes the trailing newline. A
+// writer in memory hands its buffer to the caller, a writer to a file
+// descriptor flushes the rest of the output and buffer can be NULL.
+//
+// Returns 0 if the JSON is complete. Returns 1 if it failed
+DSHDEF int json_writer_finish(json_writer *writer, char **buffer) {
+    int result = 0;
+
+    if (writer->depth != 0 || !(writer->stack[0] & JSON_WRITER_ITEMS)) {
+        DS_LOG_ERROR("The JSON is not complete");
+        return_defer(1);
+    }
+
+    if (writer->options.trailing_newline == true && json_buffer_appendc(&writer->buffer, '\n') != 0) {
+        return_defer(1);
+    }
+
+    if (writer->buffer.flush == true) {
+        if (json_buffer_flush(&writer->buffer, NULL, 0) != 0) {
+            return_defer(1);
+        }
+    } else {
+        if (json_buffer_reserve(&writer->buffer, 0) != 0) {
+            return_defer(1);
+        }
+        *buffer = writer->buffer.data;
+        writer->buffer = (json_buffer){0};
+    }
+
+defer:
+    return result;
+}
+
+// Free the writer and its buffer
+DSHDEF void json_writer_free(json_writer *writer) {
+    json_buffer_free(&writer->buffer);
+    *writer = (json_writer){0};
+}
+
+// State of the binary encoder. The scalars are interned in an open addressing
+// table of their offsets, so that repeated keys, strings and numbers are
+// stored once and shared by all the containers that use them.
+typedef struct json_binary_encoder {
+    json_buffer buffer;
+    unsigned int *table;
+    unsigned int capacity;
+    unsigned int count;
+} json_binary_encoder;
+
+// Append a value with the given kind, count and payload size, aligned to 8
+// bytes. The payload is zeroed and *offset is set to the start of the value.
+static int json_binary_append_value(json_binary_encoder *encoder, json_object_kind kind, size_t count, size_t payload, unsigned int *offset) {
+    int result = 0;
+    json_buffer *buffer = &encoder->buffer;
+    size_t size = (8 + payload + 7) & ~7UL;
+    unsigned int header[2] = {kind, (unsigned int)count};
+
+    if (buffer->count + size > UINT_MAX - 1) {
+        DS_LOG_ERROR("The binary form is larger than 4 GiB");
+        return_defer(1);
+    }
+
+    if (json_buffer_reserve(buffer, size) != 0) {
+        return_defer(1);
+    }
+
+    *offset = buffer->count;
+    DS_MEMCPY(buffer->data + buffer->count, header, sizeof(header));
+    memset(buffer->data + buffer->count + 8, 0, size - 8);
+    buffer->count += size;
+
+defer:
+    return result;
+}
+
+static unsigned int json_binary_hash(json_object_kind kind, size_t count, const char *payload, size_t payload_len) {
+    unsigned int hash = 2166136261u;
+
+    for (size_t i = 0; i < payload_len; i++) {
+        hash = (hash ^ (unsigned char)payload[i]) * 16777619u;
+    }
+
+    return hash ^ (kind * 31 + count) * 2654435761u;
+}
+
+// Append a scalar, or reuse the offset of an equal scalar written before
+static int json_binary_append_scalar(json_binary_encoder *encoder, json_object_kind kind, size_t count, const char *payload, size_t payload_len, unsigned int *offset) {
+    int result = 0;
+    unsigned int header[2] = {kind, (unsigned int)count};
+    unsigned int hash = json_binary_hash(kind, count, payload, payload_len);
+    unsigned int index = 0;
+
+    if (payload_len > UINT_MAX - 1) {
+        DS_LOG_ERROR("The binary form is larger than 4 GiB");
+        return_defer(1);
+    }
+
+    if ((encoder->count + 1) * 2 > encoder->capacity) {
+        unsigned int capacity = encoder->capacity == 0 ? 1024 : encoder->capacity * 2;
+        unsigned int *table = DS_MALLOC(NULL, capacity * sizeof(unsigned int));
+        if (table == NULL) {
+            DS_LOG_ERROR("Failed to allocate the table of the encoder");
+            return_defer(1);
+        }
+        memset(table, 0, capacity * sizeof(unsigned int));
+
+        for (unsigned int i = 0; i < encoder->capacity; i++) {
+            unsigned int old = encoder->table[i];
+            if (old == 0) {
+                continue;
+            }
+
+            unsigned int old_header[2] = {0};
+            DS_MEMCPY(old_header, encoder->buffer.data + old, sizeof(old_header));
+            unsigned long int old_len = old_header[0] == JSON_OBJECT_STRING ? old_header[1] : old_header[0] == JSON_OBJECT_NUMBER ? sizeof(double) : 0;
+
+            unsigned int j = json_binary_hash(old_header[0], old_header[1], encoder->buffer.data + old + 8, old_len) & (capacity - 1);
+            while (table[j] != 0) {
+                j = (j + 1) & (capacity - 1);
+            }
+            table[j] = old;
+        }
+
+        if (encoder->table != NULL) {
+            DS_FREE(NULL, encoder->table);
+        }
+        encoder->table = table;
+        encoder->capacity = capacity;
+    }
+
+    index = hash & (encoder->capacity - 1);
+    while (encoder->table[index] != 0) {
+        const char *other = encoder->buffer.data + encoder->table[index];
+        if (DS_MEMCMP(other, header, sizeof(header)) == 0 && (payload_len == 0 || DS_MEMCMP(other + 8, payload, payload_len) == 0)) {
+            *offset = encoder->table[index];
+            return_defer(0);
+        }
+        index = (index + 1) & (encoder->capacity - 1);
+    }
+
+    if (json_binary_append_value(encoder, kind, count, kind == JSON_OBJECT_STRING ? payload_len + 1 : payload_len, offset) != 0) {
+        return_defer(1);
+    }
+    // Booleans and null have no payload, and memcpy does not accept NULL
+    if (payload_len > 0) {
+        DS_MEMCPY(encoder->buffer.data + *offset + 8, payload, payload_len);
+    }
+
+    encoder->table[index] = *offset;
+    encoder->count += 1;
+
+defer:
+    return result;
+}
+
+// Append a value and its children. The offsets of the children are stored into
+// the payload after each child is written, since the buffer can move.
+static int json_binary_append_object(json_binary_encoder *encoder, json_object *object, unsigned int *offset) {
+    int result = 0;
+    ds_hashmap_kv **sorted = NULL;
+    size_t count = 0;
+    unsigned int child = 0;
+    json_dump_options options = {.key_order = JSON_DUMP_KEYS_SORTED};
+
+    switch (object->kind) {
+    case JSON_OBJECT_STRING:
+        return_defer(json_binary_append_scalar(encoder, JSON_OBJECT_STRING, strlen(object->string), object->string, strlen(object->string), offset));
+    case JSON_OBJECT_NUMBER:
+        return_defer(json_binary_append_scalar(encoder, JSON_OBJECT_NUMBER, 0, (const char *)&object->number, sizeof(double), offset));
+    case JSON_OBJECT_BOOLEAN:
+        return_defer(json_binary_append_scalar(encoder, JSON_OBJECT_BOOLEAN, object->boolean, NULL, 0, offset));
+    case JSON_OBJECT_NULL:
+        return_defer(json_binary_append_scalar(encoder, JSON_OBJECT_NULL, 0, NULL, 0, offset));
+    case JSON_OBJECT_ARRAY:
+        count = object->array.count;
+        if (json_binary_append_value(encoder, JSON_OBJECT_ARRAY, count, count * 4, offset) != 0) {
+            return_defer(1);
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (json_binary_append_object(encoder, (json_object *)object->array.items + i, &child) != 0) {
+                return_defer(1);
+            }
+            DS_MEMCPY(encoder->buffer.data + *offset + 8 + i * 4, &child, 4);
+        }
+        break;
+    case JSON_OBJECT_MAP:
+        if (json_object_dump_entries(object, &options, &sorted, &count) != 0) {
+            return_defer(1);
+        }
+        if (json_binary_append_value(encoder, JSON_OBJECT_MAP, count, count * 8, offset) != 0) {
+            return_defer(1);
+        }
+        for (size_t i = 0; i < count; i++) {
+            const char *key = (const char *)sorted[i]->key;
+            if (json_binary_append_scalar(encoder, JSON_OBJECT_STRING, strlen(key), key, strlen(key), &child) != 0) {
+                return_defer(1);
+            }
+            DS_MEMCPY(encoder->buffer.data + *offset + 8 + i * 8, &child, 4);
+            if (json_binary_append_object(encoder, (json_object *)sorted[i]->value, &child) != 0) {
+                return_defer(1);
+            }
+            DS_MEMCPY(encoder->buffer.data + *offset + 8 + i * 8 + 4, &child, 4);
+        }
+        break;
+    }
+
+defer:
+    if (sorted != NULL) {
+        DS_FREE(NULL, sorted);
+    }
+    return result;
+}
+
+// Encode a JSON Object in the binary form
+//
+// The result is a single allocation of *size bytes that is handed to the
+// caller, and can be used with json_binary_init or written to a file.
+//
+// Returns 0 if dump is ok. Returns 1 if it failed
+DSHDEF int json_object_dump_binary(json_object *object, char **buffer, size_t *size) {
+    int result = 0;
+    json_binary_encoder encoder = {0};
+    unsigned int header[4] = {0};
+
+    if (json_buffer_reserve(&encoder.buffer, JSON_BINARY_HEADER_SIZE) != 0) {
+        return_defer(1);
+    }
+    encoder.buffer.count = JSON_BINARY_HEADER_SIZE;
+
+    if (json_binary_append_object(&encoder, object, &header[2]) != 0) {
+        DS_LOG_ERROR("Failed to encode value");
+        return_defer(1);
+    }
+
+    DS_MEMCPY(&header[0], JSON_BINARY_MAGIC, 4);
+    header[1] = JSON_BINARY_VERSION;
+    header[3] = encoder.buffer.count;
+    DS_MEMCPY(encoder.buffer.data, header, sizeof(header));
+
+    *buffer = encoder.buffer.data;
+    *size = encoder.buffer.count;
+    encoder.buffer = (json_buffer){0};
+
+defer:
+    json_buffer_free(&encoder.buffer);
+    if (encoder.table != NULL) {
+        DS_FREE(NULL, encoder.table);
+    }
+    return result;
+}
+
+// Encode a JSON Object in the binary form and write it to a file
+//
+// Returns 0 if dump is ok. Returns 1 if it failed
+DSHDEF int json_object_dump_binary_file(json_object *object, const char *filename) {
+    int result = 0;
+    char *data = NULL;
+    size_t size = 0;
+    json_buffer out = {.fd = -1};
+
+    if (json_object_dump_binary(object, &data, &size) != 0) {
+        return_defer(1);
+    }
+
+    out.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out.fd < 0) {
+        DS_LOG_ERROR("Failed to open file %s: %s", filename, strerror(errno));
+        return_defer(1);
+    }
+
+    struct iovec iov = {.iov_base = data, .iov_len = size};
+    if (json_buffer_writev(&out, &iov, 1) != 0) {
+        return_defer(1);
+    }
+
+defer:
+    if (out.fd >= 0 && close(out.fd) != 0) {
+        DS_LOG_ERROR("Failed to close file %s: %s", filename, strerror(errno));
+        result = 1;
+    }
+    if (data != NULL) {
+        DS_FREE(NULL, data);
+    }
+    return result;
+}
+
+// Use a buffer that holds the binary form of a JSON Object
+//
+// The buffer must be aligned to 8 bytes and outlive the binary. Only the
+// header is checked here.
+//
+// Returns 0 if the header is valid. Returns 1 if it is not
+DSHDEF int json_binary_init(json_binary *binary, const char *data, size_t size) {
+    int result = 0;
+    unsigned int header[4] = {0};
+
+    *binary = (json_binary){0};
+
+    if (size < JSON_BINARY_HEADER_SIZE || ((unsigned long int)data & 7) != 0) {
+        DS_LOG_ERROR("Invalid binary json");
+        return_defer(1);
+    }
+
+    DS_MEMCPY(header, data, sizeof(header));
+    if (DS_MEMCMP(data, JSON_BINARY_MAGIC, 4) != 0 || header[1] != JSON_BINARY_VERSION || header[3] > size) {
+        DS_LOG_ERROR("Invalid binary json");
+        return_defer(1);
+    }
+
+    binary->data = data;
+    binary->size = header[3];
+
+defer:
+    return result;
+}
+
+// Map a file that holds the binary form of a JSON Object
+//
+// The file is mapped read only, so opening it costs the same whatever its
+// size and the pages are read when the values are reached.
+//
+// Returns 0 if the file was mapped. Returns 1 if it failed
+DSHDEF int json_binary_open(json_binary *binary, const char *filename) {
+    int result = 0;
+    int fd = -1;
+    void *data = MAP_FAILED;
+    struct stat st;
+
+    *binary = (json_binary){0};
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        DS_LOG_ERROR("Failed to open file %s: %s", filename, strerror(errno));
+        return_defer(1);
+    }
+
+    if (fstat(fd, &st) != 0) {
+        DS_LOG_ERROR("Failed to stat file %s: %s", filename, strerror(errno));
+        return_defer(1);
+    }
+
+    if (st.st_size < JSON_BINARY_HEADER_SIZE) {
+        DS_LOG_ERROR("Invalid binary json");
+        return_defer(1);
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        DS_LOG_ERROR("Failed to map file %s: %s", filename, strerror(errno));
+        return_defer(1);
+    }
+
+    if (json_binary_init(binary, data, st.st_size) != 0) {
+        return_defer(1);
+    }
+    binary->capacity = st.st_size;
+    binary->mapped = true;
+    data = MAP_FAILED;
+
+defer:
+    if (data != MAP_FAILED) {
+        munmap(data, st.st_size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return result;
+}
+
+// Unmap the file of the binary. The values of the binary can not be used
+// after this.
+DSHDEF void json_binary_close(json_binary *binary) {
+    if (binary->mapped == true) {
+        munmap((void *)binary->data, binary->capacity);
+    }
+    *binary = (json_binary){0};
+}
+
+// Read the value at an offset, checking that it is inside the binary
+static int json_binary_value_at(const json_binary *binary, unsigned int offset, json_binary_value *value) {
+    int result = 0;
+    unsigned int header[2] = {0};
+    unsigned long int payload = 0;
+
+    if (offset < JSON_BINARY_HEADER_SIZE || (offset & 7) != 0 || offset + 8UL > binary->size) {
+        DS_LOG_ERROR("Invalid offset %u in binary json", offset);
+        return_defer(1);
+    }
+
+    DS_MEMCPY(header, binary->data + offset, sizeof(header));
+    switch (header[0]) {
+    case JSON_OBJECT_STRING:
+        payload = (unsigned long int)header[1] + 1;
+        break;
+    case JSON_OBJECT_NUMBER:
+        payload = sizeof(double);
+        break;
+    case JSON_OBJECT_BOOLEAN:
+    case JSON_OBJECT_NULL:
+        payload = 0;
+        break;
+    case JSON_OBJECT_ARRAY:
+        payload = (unsigned long int)header[1] * 4;
+        break;
+    case JSON_OBJECT_MAP:
+        payload = (unsigned long int)header[1] * 8;
+        break;
+    default:
+        DS_LOG_ERROR("Invalid kind %u in binary json", header[0]);
+        return_defer(1);
+    }
+
+    if (payload > binary->size - offset - 8) {
+        DS_LOG_ERROR("Invalid value at offset %u in binary json", offset);
+        return_defer(1);
+    }
+
+    *value = (json_binary_value){
+        .binary = binary,
+        .kind = (json_object_kind)header[0],
+        .count = header[1],
+        .payload = binary->data + offset + 8,
+    };
+
+    if (value->kind == JSON_OBJECT_STRING && value->payload[value->count] != '\0') {
+        DS_LOG_ERROR("Invalid string at offset %u in binary json", offset);
+        return_defer(1);
+    }
+
+defer:
+    return result;
+}
+
+// Read a child of a container. The containers are written before their
+// children, so a container that is not after its parent is a cycle; only the
+// shared scalars can be before.
+static int json_binary_child_at(const json_binary_value *value, unsigned int offset, json_binary_value *item) {
+    int result = 0;
+
+    if (json_binary_value_at(value->binary, offset, item) != 0) {
+        return_defer(1);
+    }
+
+    if ((item->kind == JSON_OBJECT_ARRAY || item->kind == JSON_OBJECT_MAP) && item->payload <= value->payload) {
+        DS_LOG_ERROR("Invalid offset %u in binary json", offset);
+        return_defer(1);
+    }
+
+defer:
+    return result;
+}
+
+// Get the root value of the binary
+//
+// Returns 0 if the root is valid. Returns 1 if it is not
+DSHDEF int json_binary_root(const json_binary *binary, json_binary_value *value) {
+    unsigned int offset = 0;
+
+    DS_MEMCPY(&offset, binary->data + 8, 4);
+    return json_binary_value_at(binary, offset, value);
+}
+
+// Get a reference to a string value, valid as long as the binary
+//
+// Returns 0 if the value is a string. Returns 1 if it is not
+DSHDEF int json_binary_string(const json_binary_value *value, const char **string, unsigned int *len) {
+    if (value->kind != JSON_OBJECT_STRING) {
+        return 1;
+    }
+
+    *string = value->payload;
+    if (len != NULL) {
+        *len = value->count;
+    }
+    return 0;
+}
+
+// Returns 0 if the value is a number. Returns 1 if it is not
+DSHDEF int json_binary_number(const json_binary_value *value, double *number) {
+    if (value->kind != JSON_OBJECT_NUMBER) {
+        return 1;
+    }
+
+    DS_MEMCPY(number, value->payload, sizeof(double));
+    return 0;
+}
+
+// Returns 0 if the value is a boolean. Returns 1 if it is not
+DSHDEF int json_binary_boolean(const json_binary_value *value, bool *boolean) {
+    if (value->kind != JSON_OBJECT_BOOLEAN) {
+        return 1;
+    }
+
+    *boolean = value->count != 0;
+    return 0;
+}
+
+// Get the number of items of an array or of entries of a map, 0 for the other
+// values
+DSHDEF unsigned int json_binary_count(const json_binary_value *value) {
+    if (value->kind != JSON_OBJECT_ARRAY && value->kind != JSON_OBJECT_MAP) {
+        return 0;
+    }
+
+    return value->count;
+}
+
+// Get an item of an array
+//
+// Returns 0 if the item was found. Returns 1 if the index is out of bounds or
+// the value is not an array
+DSHDEF int json_binary_array_get(const json_binary_value *value, unsigned int index, json_binary_value *item) {
+    unsigned int offset = 0;
+
+    if (value->kind != JSON_OBJECT_ARRAY || index >= value->count) {
+        return 1;
+    }
+
+    DS_MEMCPY(&offset, value->payload + (unsigned long int)index * 4, 4);
+    return json_binary_child_at(value, offset, item);
+}
+
+// Get an entry of a map by its position in the sorted order of the keys
+//
+// Returns 0 if the entry was found. Returns 1 if the index is out of bounds or
+// the value is not a map
+DSHDEF int json_binary_map_entry(const json_binary_value *value, unsigned int index, const char **key, json_binary_value *item) {
+    int result = 0;
+    unsigned int offsets[2] = {0};
+    json_binary_value name = {0};
+
+    if (value->kind != JSON_OBJECT_MAP || index >= value->count) {
+        return_defer(1);
+    }
+
+    DS_MEMCPY(offsets, value->payload + (unsigned long int)index * 8, sizeof(offsets));
+    if (json_binary_value_at(value->binary, offsets[0], &name) != 0 || json_binary_string(&name, key, NULL) != 0) {
+        return_defer(1);
+    }
+
+    if (item != NULL && json_binary_child_at(value, offsets[1], item) != 0) {
+        return_defer(1);
+    }
+
+defer:
+    return result;
+}
+
+// Get the value of a key in a map, with a binary search over the sorted keys
+//
+// Returns 0 if the key was found. Returns 1 if the key is missing or the value
+// is not a map
+DSHDEF int json_binary_map_get(const json_binary_value *value, const char *key, json_binary_value *item) {
+    unsigned int low = 0;
+    unsigned int high = 0;
+
+    if (value->kind != JSON_OBJECT_MAP) {
+        return 1;
+    }
+
+    high = value->count;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        const char *name = NULL;
+
+        if (json_binary_map_entry(value, mid, &name, NULL) != 0) {
+            return 1;
+        }
+
+        int compare = strcmp(key, name);
+        if (compare == 0) {
+            return json_binary_map_entry(value, mid, &name, item);
+        } else if (compare < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return 1;
+}
+
+// Build a JSON Object from a value of the binary
+//
+// The object owns its memory and does not depend on the binary. Returns 0 if
+// the conversion is ok. Returns 1 if it failed
+DSHDEF int json_binary_to_object(const json_binary_value *value, json_object *object) {
+    int result = 0;
+    json_object child = {0};
+    json_binary_value item = {0};
+
+    *object = (json_object){0};
+    json_object_init_null(object);
+
+    switch (value->kind) {
+    case JSON_OBJECT_STRING:
+        return_defer(json_object_init_string(object, value->payload));
+    case JSON_OBJECT_NUMBER:
+        json_object_init_number(object, 0);
+        DS_MEMCPY(&object->number, value->payload, sizeof(double));
+        break;
+    case JSON_OBJECT_BOOLEAN:
+        json_object_init_boolean(object, value->count != 0);
+        break;
+    case JSON_OBJECT_NULL:
+        break;
+    case JSON_OBJECT_ARRAY:
+        json_object_init_array(object);
+        for (unsigned int i = 0; i < value->count; i++) {
+            if (json_binary_array_get(value, i, &item) != 0 || json_binary_to_object(&item, &child) != 0) {
+                return_defer(1);
+            }
+            if (json_object_array_push(object, &child) != 0) {
+                return_defer(1);
+            }
+            child = (json_object){0};
+        }
+        break;
+    case JSON_OBJECT_MAP:
+        if (json_object_init_map(object) != 0) {
+            return_defer(1);
+        }
+        for (unsigned int i = 0; i < value->count; i++) {
+            const char *key = NULL;
+            if (json_binary_map_entry(value, i, &key, &item) != 0 || json_binary_to_object(&item, &child) != 0) {
+                return_defer(1);
+            }
+            if (json_object_map_set(object, key, &child) != 0) {
+                return_defer(1);
+            }
+            child = (json_object){0};
+        }
+        break;
+    }
+
+defer:
+    if (result != 0) {
+        json_object_free(&child);
+        json_object_free(object);
+    }
+    return result;
+}
+
+#if defined(DS_MP_IMPLEMENTATION) || defined(DS_CB_IMPLEMENTATION)
+
+// Append a marker byte followed by bytes bytes of value in big endian order
+static int json_buffer_append_be(json_buffer *buffer, unsigned char marker, unsigned long long value, unsigned int bytes) {
+    int result = 0;
+
+    if (json_buffer_reserve(buffer, 1 + bytes) != 0) {
+        return_defer(1);
+    }
+
+    buffer->data[buffer->count++] = marker;
+    for (unsigned int i = bytes; i > 0; i--) {
+        buffer->data[buffer->count++] = (unsigned char)(value >> ((i - 1) * 8));
+    }
+
+defer:
+    return result;
+}
+
+// Reader of a MessagePack or CBOR buffer. Every read checks the bounds, so a
+// truncated or damaged buffer fails the decode instead of reading past it.
+typedef struct json_decoder {
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+    unsigned int depth;
+} json_decoder;
+
+// Read bytes bytes in big endian order
+static int json_decoder_read(json_decoder *decoder, unsigned int bytes, unsigned long long *value) {
+    int result = 0;
+
+    if (bytes > decoder->size - decoder->pos) {
+        DS_LOG_ERROR("Unexpected end of input at byte %zu", decoder->pos);
+        return_defer(1);
+    }
 
-        return_defer(0);
+    *value = 0;
+    for (unsigned int i = 0; i < bytes; i++) {
+        *value = (*value << 8) | decoder->data[decoder->pos++];
     }
 
 defer:
     return result;
 }
 
-static int json_lexer_peek(json_lexer *lexer, json_token *token) {
-    unsigned int pos = lexer->pos;
-    unsigned int read_pos = lexer->read_pos;
-    unsigned int ch = lexer->ch;
+// Read a string of len bytes into a new NUL terminated string
+static int json_decoder_read_string(json_decoder *decoder, unsigned long long len, char **string) {
+    int result = 0;
 
-    int result = json_lexer_next(lexer, token);
+    if (len > decoder->size - decoder->pos || len >= UINT_MAX) {
+        DS_LOG_ERROR("Unexpected end of input at byte %zu", decoder->pos);
+        return_defer(1);
+    }
 
-    lexer->pos = pos;
-    lexer->read_pos = read_pos;
-    lexer->ch = ch;
+    // The strings of a JSON Object end at the first NUL byte
+    if (memchr(decoder->data + decoder->pos, '\0', len) != NULL) {
+        DS_LOG_ERROR("Unsupported NUL byte in string at byte %zu", decoder->pos);
+        return_defer(1);
+    }
+
+    *string = DS_MALLOC(NULL, len + 1);
+    if (*string == NULL) {
+        DS_LOG_ERROR("Failed to allocate string");
+        return_defer(1);
+    }
+    DS_MEMCPY(*string, decoder->data + decoder->pos, len);
+    (*string)[len] = '\0';
+    decoder->pos += len;
 
+defer:
     return result;
 }
 
-static int json_lexer_pos_to_lc(json_lexer *lexer, int pos, int *line, int *column) {
+// Enter a container, checking the nesting limit and that the input has at
+// least one byte for each of the count items
+static int json_decoder_enter(json_decoder *decoder, unsigned long long count) {
     int result = 0;
-    int n = (pos > lexer->buffer_len) ? lexer->buffer_len : pos;
 
-    *line = 1;
-    *column = 1;
+    if (decoder->depth >= JSON_DECODE_MAX_DEPTH) {
+        DS_LOG_ERROR("The maximum depth of %d was reached", JSON_DECODE_MAX_DEPTH);
+        return_defer(1);
+    }
 
-    for (int i = 0; i < n; i++) {
-        if (lexer->buffer[i] == '\n') {
-            *line += 1;
-            *column = 0;
-        } else {
-            *column += 1;
-        }
+    if (count > decoder->size - decoder->pos) {
+        DS_LOG_ERROR("Unexpected end of input at byte %zu", decoder->pos);
+        return_defer(1);
     }
 
+    decoder->depth += 1;
+
 defer:
     return result;
 }
 
-static void json_lexer_free(json_lexer *lexer) {
-    lexer->buffer = NULL;
-    lexer->buffer_len = 0;
-    lexer->pos = 0;
-    lexer->read_pos = 0;
-    lexer->ch = 0;
+// Append an item to an array that is being decoded. The array takes ownership
+// of the item, which is freed if the append fails.
+static int json_decoder_push(json_object *object, json_object *item) {
+    int result = 0;
+
+    if (ds_dynamic_array_append(&object->array, item) != 0) {
+        DS_LOG_ERROR("Failed to append item to array");
+        json_object_free(item);
+        return_defer(1);
+    }
+
+defer:
+    return result;
 }
 
-static int json_parser_init(json_parser *parser, json_lexer lexer) {
-    parser->lexer = lexer;
+// Insert an entry into a map that is being decoded. The key is not looked up
+// first, as in the parser. The map takes ownership of the key and of the
+// value, which are freed if the insert fails.
+static int json_decoder_insert(json_object *object, char *key, json_object *value) {
+    int result = 0;
+    ds_hashmap_kv kv = {.key = key, .hash = json_object_hash_len(key, strlen(key))};
 
-    return 0;
+    kv.value = DS_MALLOC(NULL, sizeof(json_object));
+    if (kv.value == NULL) {
+        DS_LOG_ERROR("Failed to allocate value for map");
+        return_defer(1);
+    }
+    *(json_object *)kv.value = *value;
+    json_object_init_null(value);
+
+    if (ds_hashmap_insert_hashed(&object->map, &kv) != 0) {
+        DS_LOG_ERROR("Failed to insert item to map");
+        *value = *(json_object *)kv.value;
+        return_defer(1);
+    }
+    kv = (ds_hashmap_kv){0};
+
+defer:
+    if (kv.key != NULL) {
+        DS_FREE(NULL, kv.key);
+    }
+    if (kv.value != NULL) {
+        DS_FREE(NULL, kv.value);
+    }
+    if (result != 0) {
+        json_object_free(value);
+    }
+    return result;
 }
 
-static int json_parser_parse_object(json_parser *parser, json_object *object);
-static int json_parser_parse_map(json_parser *parser, json_object *object);
-static int json_parser_parse_array(json_parser *parser, json_object *object);
+#endif // DS_MP_IMPLEMENTATION || DS_CB_IMPLEMENTATION
 
-static int json_parser_parse_object(json_parser *parser, json_object *object) {
+#endif // DS_JS_IMPLEMENTATION
+
+#ifdef DS_MP_IMPLEMENTATION
+
+// Write a number as the smallest integer that holds it, or as a float when it
+// is not an integer. Floats that survive the round trip to single precision
+// take 5 bytes instead of 9.
+static int json_msgpack_write_number(json_buffer *buffer, double number) {
     int result = 0;
-    json_token token = {0};
 
-    if (json_lexer_next(&parser->lexer, &token) != 0) {
-        DS_LOG_ERROR("Failed to get the next token");
+    // The doubles from 2^63 on are all integers, below that the cast back
+    // tells if the number has a fraction
+    if (!(number == 0 && signbit(number)) && number >= -9223372036854775808.0 && number < 18446744073709551616.0 &&
+        (number >= 9223372036854775808.0 || number == (double)(long long)number)) {
+        if (number >= 0) {
+            unsigned long long value = (unsigned long long)number;
+            if (value < 0x80) {
+                return_defer(json_buffer_append_be(buffer, (unsigned char)value, 0, 0));
+            } else if (value <= 0xFF) {
+                return_defer(json_buffer_append_be(buffer, 0xCC, value, 1));
+            } else if (value <= 0xFFFF) {
+                return_defer(json_buffer_append_be(buffer, 0xCD, value, 2));
+            } else if (value <= 0xFFFFFFFF) {
+                return_defer(json_buffer_append_be(buffer, 0xCE, value, 4));
+            }
+            return_defer(json_buffer_append_be(buffer, 0xCF, value, 8));
+        }
+
+        long long value = (long long)number;
+        if (value >= -32) {
+            return_defer(json_buffer_append_be(buffer, (unsigned char)value, 0, 0));
+        } else if (value >= -128) {
+            return_defer(json_buffer_append_be(buffer, 0xD0, (unsigned long long)value, 1));
+        } else if (value >= -32768) {
+            return_defer(json_buffer_append_be(buffer, 0xD1, (unsigned long long)value, 2));
+        } else if (value >= -2147483648LL) {
+            return_defer(json_buffer_append_be(buffer, 0xD2, (unsigned long long)value, 4));
+        }
+        return_defer(json_buffer_append_be(buffer, 0xD3, (unsigned long long)value, 8));
+    }
+
+    if ((double)(float)number == number) {
+        float single = (float)number;
+        unsigned int bits = 0;
+        DS_MEMCPY(&bits, &single, sizeof(bits));
+        return_defer(json_buffer_append_be(buffer, 0xCA, bits, 4));
+    }
+
+    unsigned long long bits = 0;
+    DS_MEMCPY(&bits, &number, sizeof(bits));
+    return_defer(json_buffer_append_be(buffer, 0xCB, bits, 8));
+
+defer:
+    return result;
+}
+
+// Write the header of a string, an array or a map, in its fixed form when the
+// count fits
+static int json_msgpack_write_head(json_buffer *buffer, unsigned char fixed, unsigned int fixed_max, unsigned char marker8, unsigned char marker16, unsigned long long count) {
+    if (count <= fixed_max) {
+        return json_buffer_append_be(buffer, fixed | (unsigned char)count, 0, 0);
+    } else if (marker8 != 0 && count <= 0xFF) {
+        return json_buffer_append_be(buffer, marker8, count, 1);
+    } else if (count <= 0xFFFF) {
+        return json_buffer_append_be(buffer, marker16, count, 2);
+    }
+    return json_buffer_append_be(buffer, marker16 + 1, count, 4);
+}
+
+static int json_msgpack_write_string(json_buffer *buffer, const char *string) {
+    int result = 0;
+    size_t len = strlen(string);
+
+    if (json_msgpack_write_head(buffer, 0xA0, 31, 0xD9, 0xDA, len) != 0) {
+        return_defer(1);
+    }
+    if (json_buffer_append(buffer, string, len) != 0) {
         return_defer(1);
     }
 
-    if (token.kind == JSON_TOKEN_LSQRLY) {
-        result = json_parser_parse_map(parser, object);
-    } else if (token.kind == JSON_TOKEN_LBRACE) {
-        result = json_parser_parse_array(parser, object);
-    } else if (token.kind == JSON_TOKEN_STRING) {
-        object->kind = JSON_OBJECT_STRING;
-        if (ds_string_slice_to_owned(&token.value, &object->string) != 0) {
-            DS_LOG_ERROR("Failed to allocate string");
+defer:
+    return result;
+}
+
+static int json_msgpack_write_object(json_buffer *buffer, json_object *object) {
+    int result = 0;
+
+    switch (object->kind) {
+    case JSON_OBJECT_STRING:
+        return_defer(json_msgpack_write_string(buffer, object->string));
+    case JSON_OBJECT_NUMBER:
+        return_defer(json_msgpack_write_number(buffer, object->number));
+    case JSON_OBJECT_BOOLEAN:
+        return_defer(json_buffer_append_be(buffer, object->boolean == true ? 0xC3 : 0xC2, 0, 0));
+    case JSON_OBJECT_NULL:
+        return_defer(json_buffer_append_be(buffer, 0xC0, 0, 0));
+    case JSON_OBJECT_ARRAY:
+        if (json_msgpack_write_head(buffer, 0x90, 15, 0, 0xDC, object->array.count) != 0) {
             return_defer(1);
         }
-    } else if (token.kind == JSON_TOKEN_NUMBER) {
-        char *value = NULL;
-        object->kind = JSON_OBJECT_NUMBER;
-        if (ds_string_slice_to_owned(&token.value, &value) != 0) {
-            DS_LOG_ERROR("Failed to allocate string");
-            return_defer(1);
+        for (size_t i = 0; i < object->array.count; i++) {
+            if (json_msgpack_write_object(buffer, (json_object *)object->array.items + i) != 0) {
+                return_defer(1);
+            }
         }
-        object->number = atof(value);
-        DS_FREE(NULL, value);
-    } else if (token.kind == JSON_TOKEN_BOOLEAN) {
-        char *value = NULL;
-        object->kind = JSON_OBJECT_BOOLEAN;
-        if (ds_string_slice_to_owned(&token.value, &value) != 0) {
-            DS_LOG_ERROR("Failed to allocate string");
+        break;
+    case JSON_OBJECT_MAP:
+        if (json_msgpack_write_head(buffer, 0x80, 15, 0, 0xDE, ds_hashmap_count(&object->map)) != 0) {
             return_defer(1);
         }
-        object->boolean = (strcmp(value, "true") == 0) ? true : false;
-        DS_FREE(NULL, value);
-    } else if (token.kind == JSON_TOKEN_NULL) {
-        object->kind = JSON_OBJECT_NULL;
-    } else {
-        int line, column;
-        json_lexer_pos_to_lc(&parser->lexer, token.pos, &line, &column);
-        DS_LOG_ERROR("Expected a json object but found %s at %d:%d", json_token_kind_to_string(token.kind), line, column);
-        return_defer(1);
+        for (size_t i = 0; i < object->map.entries.count; i++) {
+            ds_hashmap_kv *kv = (ds_hashmap_kv *)object->map.entries.items + i;
+            if (kv->key == NULL) {
+                continue;
+            }
+            if (json_msgpack_write_string(buffer, (const char *)kv->key) != 0) {
+                return_defer(1);
+            }
+            if (json_msgpack_write_object(buffer, (json_object *)kv->value) != 0) {
+                return_defer(1);
+            }
+        }
+        break;
     }
 
 defer:
     return result;
 }
 
-static int json_parser_parse_map(json_parser *parser, json_object *object) {
+// Read the length of a string that starts with the marker. Returns 1 if the
+// marker is not a string.
+static int json_msgpack_read_string_len(json_decoder *decoder, unsigned char marker, unsigned long long *len) {
+    if ((marker & 0xE0) == 0xA0) {
+        *len = marker & 0x1F;
+        return 0;
+    }
+
+    switch (marker) {
+    case 0xD9:
+        return json_decoder_read(decoder, 1, len);
+    case 0xDA:
+        return json_decoder_read(decoder, 2, len);
+    case 0xDB:
+        return json_decoder_read(decoder, 4, len);
+    default:
+        DS_LOG_ERROR("Expected a string at byte %zu", decoder->pos - 1);
+        return 1;
+    }
+}
+
+static int json_msgpack_read_object(json_decoder *decoder, json_object *object) {
     int result = 0;
-    json_token token = {0};
+    unsigned long long value = 0;
+    unsigned long long count = 0;
+    unsigned char marker = 0;
+    json_object item = {.kind = JSON_OBJECT_NULL};
+    char *key = NULL;
 
-    object->kind = JSON_OBJECT_MAP;
-    ds_hashmap_init(&object->map, JSON_OBJECT_MAP_MAX_CAPACITY, json_object_hash, json_object_compare);
+    json_object_init_null(object);
 
-    if (json_lexer_next(&parser->lexer, &token) != 0) {
-        DS_LOG_ERROR("Failed to get the next token");
+    if (json_decoder_read(decoder, 1, &value) != 0) {
         return_defer(1);
     }
+    marker = (unsigned char)value;
 
-    if (token.kind == JSON_TOKEN_RSQRLY) {
+    if (marker <= 0x7F) {
+        json_object_init_number(object, marker);
         return_defer(0);
-    }
-
-    while (token.kind != JSON_TOKEN_RSQRLY) {
-        ds_hashmap_kv kv = {0};
-
-        if (token.kind != JSON_TOKEN_STRING) {
-            int line, column;
-            json_lexer_pos_to_lc(&parser->lexer, token.pos, &line, &column);
-            DS_LOG_ERROR("Expected a string but found %s at %d:%d", json_token_kind_to_string(token.kind), line, column);
+    } else if (marker >= 0xE0) {
+        json_object_init_number(object, (signed char)marker);
+        return_defer(0);
+    } else if ((marker & 0xE0) == 0xA0 || marker == 0xD9 || marker == 0xDA || marker == 0xDB) {
+        char *string = NULL;
+        if (json_msgpack_read_string_len(decoder, marker, &count) != 0 ||
+            json_decoder_read_string(decoder, count, &string) != 0) {
             return_defer(1);
         }
-
-        if (ds_string_slice_to_owned(&token.value, (char **)&kv.key) != 0) {
-            DS_LOG_ERROR("Failed to allocate string");
+        *object = (json_object){.kind = JSON_OBJECT_STRING, .string = string};
+        return_defer(0);
+    } else if ((marker & 0xF0) == 0x90 || marker == 0xDC || marker == 0xDD) {
+        if ((marker & 0xF0) == 0x90) {
+            count = marker & 0x0F;
+        } else if (json_decoder_read(decoder, marker == 0xDC ? 2 : 4, &count) != 0) {
             return_defer(1);
         }
-
-        if (json_lexer_next(&parser->lexer, &token) != 0) {
-            DS_LOG_ERROR("Failed to get the next token");
+        if (json_decoder_enter(decoder, count) != 0) {
             return_defer(1);
         }
 
-        if (token.kind != JSON_TOKEN_COLON) {
-            int line, column;
-            json_lexer_pos_to_lc(&parser->lexer, token.pos, &line, &column);
-            DS_LOG_ERROR("Expected a colon but found %s at %d:%d", json_token_kind_to_string(token.kind), line, column);
+        json_object_init_array(object);
+        if (count > 0 && ds_dynamic_array_reserve(&object->array, count) != 0) {
+            DS_LOG_ERROR("Failed to allocate array");
             return_defer(1);
         }
+        for (unsigned long long i = 0; i < count; i++) {
+            if (json_msgpack_read_object(decoder, &item) != 0) {
+                return_defer(1);
+            }
+            if (json_decoder_push(object, &item) != 0) {
+                json_object_init_null(&item);
+                return_defer(1);
+            }
+            json_object_init_null(&item);
+        }
 
-        kv.value = DS_MALLOC(NULL, sizeof(json_object));
-        if (kv.value == NULL) {
-            DS_LOG_ERROR("Failed to allocate value for map");
+        decoder->depth -= 1;
+        return_defer(0);
+    } else if ((marker & 0xF0) == 0x80 || marker == 0xDE || marker == 0xDF) {
+        if ((marker & 0xF0) == 0x80) {
+            count = marker & 0x0F;
+        } else if (json_decoder_read(decoder, marker == 0xDE ? 2 : 4, &count) != 0) {
             return_defer(1);
         }
-
-        if (json_parser_parse_object(parser, (json_object *)kv.value) != 0) {
-            DS_LOG_ERROR("Failed to parse map value");
+        if (json_decoder_enter(decoder, count * 2) != 0) {
             return_defer(1);
         }
 
-        if (ds_hashmap_insert(&object->map, &kv) != 0) {
-            DS_LOG_ERROR("Failed to insert item to map");
+        if (json_object_init_map(object) != 0) {
             return_defer(1);
         }
+        for (unsigned long long i = 0; i < count; i++) {
+            unsigned long long len = 0;
+            if (json_decoder_read(decoder, 1, &value) != 0 ||
+                json_msgpack_read_string_len(decoder, (unsigned char)value, &len) != 0 ||
+                json_decoder_read_string(decoder, len, &key) != 0) {
+                return_defer(1);
+            }
+            if (json_msgpack_read_object(decoder, &item) != 0) {
+                return_defer(1);
+            }
+            if (json_decoder_insert(object, key, &item) != 0) {
+                key = NULL;
+                json_object_init_null(&item);
+                return_defer(1);
+            }
+            key = NULL;
+        }
 
-        if (json_lexer_next(&parser->lexer, &token) != 0) {
-            DS_LOG_ERROR("Failed to get the next token");
+        decoder->depth -= 1;
+        return_defer(0);
+    }
+
+    switch (marker) {
+    case 0xC0:
+        break;
+    case 0xC2:
+    case 0xC3:
+        json_object_init_boolean(object, marker == 0xC3);
+        break;
+    case 0xCA: {
+        float single = 0;
+        if (json_decoder_read(decoder, 4, &value) != 0) {
             return_defer(1);
         }
-
-        if (token.kind == JSON_TOKEN_RSQRLY) {
-            break;
+        unsigned int bits = (unsigned int)value;
+        DS_MEMCPY(&single, &bits, sizeof(single));
+        json_object_init_number(object, single);
+        break;
+    }
+    case 0xCB: {
+        double number = 0;
+        if (json_decoder_read(decoder, 8, &value) != 0) {
+            return_defer(1);
         }
-
-        if (token.kind != JSON_TOKEN_COMMA) {
-            int line, column;
-            json_lexer_pos_to_lc(&parser->lexer, token.pos, &line, &column);
-            DS_LOG_ERROR("Expected a comma but found %s at %d:%d", json_token_kind_to_string(token.kind), line, column);
+        DS_MEMCPY(&number, &value, sizeof(number));
+        json_object_init_number(object, number);
+        break;
+    }
+    case 0xCC:
+    case 0xCD:
+    case 0xCE:
+    case 0xCF:
+        if (json_decoder_read(decoder, 1 << (marker - 0xCC), &value) != 0) {
             return_defer(1);
         }
-
-        if (json_lexer_next(&parser->lexer, &token) != 0) {
-            DS_LOG_ERROR("Failed to get the next token");
+        json_object_init_number(object, (double)value);
+        break;
+    case 0xD0:
+    case 0xD1:
+    case 0xD2:
+    case 0xD3: {
+        unsigned int bytes = 1 << (marker - 0xD0);
+        if (json_decoder_read(decoder, bytes, &value) != 0) {
             return_defer(1);
         }
+        // Sign extend from the width of the integer
+        unsigned int shift = 64 - bytes * 8;
+        json_object_init_number(object, (double)((long long)(value << shift) >> shift));
+        break;
+    }
+    default:
+        DS_LOG_ERROR("Unsupported MessagePack type 0x%02X at byte %zu", marker, decoder->pos - 1);
+        return_defer(1);
+    }
+
+defer:
+    if (key != NULL) {
+        DS_FREE(NULL, key);
+    }
+    if (result != 0) {
+        json_object_free(&item);
+        json_object_free(object);
+        json_object_init_null(object);
+    }
+    return result;
+}
+
+// Encode a JSON Object as MessagePack
+//
+// The integers are written in the smallest form that holds them, and the maps
+// in insertion order. The result is a single allocation of *size bytes that
+// is handed to the caller.
+//
+// Returns 0 if dump is ok. Returns 1 if it failed
+DSHDEF int json_object_dump_msgpack(json_object *object, char **buffer, size_t *size) {
+    int result = 0;
+    json_buffer out = {0};
+
+    if (json_msgpack_write_object(&out, object) != 0) {
+        DS_LOG_ERROR("Failed to encode value");
+        return_defer(1);
+    }
+
+    *buffer = out.data;
+    *size = out.count;
+    out = (json_buffer){0};
+
+defer:
+    json_buffer_free(&out);
+    return result;
+}
+
+// Encode a JSON Object as MessagePack to a file descriptor
+//
+// The output goes through a buffer of JSON_OBJECT_DUMP_FD_BUFFER_SIZE bytes
+// as in json_object_dump_fd. Returns 0 if dump is ok. Returns 1 if it failed
+DSHDEF int json_object_dump_msgpack_fd(json_object *object, int fd) {
+    int result = 0;
+    json_buffer out = {0};
+
+    if (json_buffer_init_fd(&out, fd) != 0) {
+        return_defer(1);
+    }
+
+    if (json_msgpack_write_object(&out, object) != 0) {
+        DS_LOG_ERROR("Failed to encode value");
+        return_defer(1);
+    }
+
+    if (json_buffer_flush(&out, NULL, 0) != 0) {
+        DS_LOG_ERROR("Failed to flush buffer");
+        return_defer(1);
+    }
+
+defer:
+    json_buffer_free(&out);
+    return result;
+}
+
+// Decode a JSON Object from MessagePack
+//
+// The buffer must hold exactly one value. Map keys must be strings, and the
+// binary and extension types are not supported since JSON can not hold them.
+// Integers are read into doubles, so the ones above 2^53 lose precision.
+//
+// Returns 0 if load is ok. Returns 1 if it failed
+DSHDEF int json_object_load_msgpack(const char *buffer, size_t size, json_object *object) {
+    int result = 0;
+    json_decoder decoder = {.data = (const unsigned char *)buffer, .size = size};
+
+    if (json_msgpack_read_object(&decoder, object) != 0) {
+        DS_LOG_ERROR("Failed to decode MessagePack");
+        return_defer(1);
+    }
+
+    if (decoder.pos != decoder.size) {
+        DS_LOG_ERROR("Unexpected data after the value at byte %zu", decoder.pos);
+        json_object_free(object);
+        json_object_init_null(object);
+        return_defer(1);
     }
 
 defer:
     return result;
 }
 
-static int json_parser_parse_array(json_parser *parser, json_object *object) {
-    int result = 0;
-    json_token token = {0};
-
-    object->kind = JSON_OBJECT_ARRAY;
-    ds_dynamic_array_init(&object->array, sizeof(json_object));
+#endif // DS_MP_IMPLEMENTATION
 
-    if (json_lexer_peek(&parser->lexer, &token) != 0) {
-        DS_LOG_ERROR("Failed to get the next token");
-        return_defer(1);
-    }
+#ifdef DS_CB_IMPLEMENTATION
 
-    if (token.kind == JSON_TOKEN_RBRACE) {
-        return_defer(0);
+// Write the head of a CBOR item: the major type and its argument, in the
+// smallest form that holds it
+static int json_cbor_write_head(json_buffer *buffer, unsigned char major, unsigned long long value) {
+    if (value < 24) {
+        return json_buffer_append_be(buffer, (major << 5) | (unsigned char)value, 0, 0);
+    } else if (value <= 0xFF) {
+        return json_buffer_append_be(buffer, (major << 5) | 24, value, 1);
+    } else if (value <= 0xFFFF) {
+        return json_buffer_append_be(buffer, (major << 5) | 25, value, 2);
+    } else if (value <= 0xFFFFFFFF) {
+        return json_buffer_append_be(buffer, (major << 5) | 26, value, 4);
     }
+    return json_buffer_append_be(buffer, (major << 5) | 27, value, 8);
+}
 
-    while (token.kind != JSON_TOKEN_RBRACE) {
-        json_object item = {0};
-        if (json_parser_parse_object(parser, &item) != 0) {
-            DS_LOG_ERROR("Failed to parse array item");
-            return_defer(1);
-        }
-
-        if (ds_dynamic_array_append(&object->array, &item) != 0) {
-            DS_LOG_ERROR("Failed to add item to array");
-            return_defer(1);
-        }
-
-        if (json_lexer_next(&parser->lexer, &token) != 0) {
-            DS_LOG_ERROR("Failed to get the next token");
-            return_defer(1);
-        }
+// Write a number as an integer when it is one, or as the smallest float that
+// holds it exactly
+static int json_cbor_write_number(json_buffer *buffer, double number) {
+    int result = 0;
 
-        if (token.kind == JSON_TOKEN_RBRACE) {
-            break;
+    // The doubles from 2^63 on are all integers, below that the cast back
+    // tells if the number has a fraction
+    if (!(number == 0 && signbit(number)) && number >= -9223372036854775808.0 && number < 18446744073709551616.0 &&
+        (number >= 9223372036854775808.0 || number == (double)(long long)number)) {
+        if (number >= 0) {
+            return_defer(json_cbor_write_head(buffer, 0, (unsigned long long)number));
         }
+        return_defer(json_cbor_write_head(buffer, 1, (unsigned long long)(-((long long)number + 1))));
+    }
 
-        if (token.kind != JSON_TOKEN_COMMA) {
-            int line, column;
-            json_lexer_pos_to_lc(&parser->lexer, token.pos, &line, &column);
-            DS_LOG_ERROR("Expected a comma but found %s at %d:%d", json_token_kind_to_string(token.kind), line, column);
-            return_defer(1);
-        }
+    if ((double)(float)number == number) {
+        float single = (float)number;
+        unsigned int bits = 0;
+        DS_MEMCPY(&bits, &single, sizeof(bits));
+        return_defer(json_buffer_append_be(buffer, 0xFA, bits, 4));
     }
 
+    unsigned long long bits = 0;
+    DS_MEMCPY(&bits, &number, sizeof(bits));
+    return_defer(json_buffer_append_be(buffer, 0xFB, bits, 8));
+
 defer:
     return result;
 }
 
-static int json_parser_parse(json_parser *parser, json_object *object) {
+static int json_cbor_write_string(json_buffer *buffer, const char *string) {
     int result = 0;
-    json_token token = {0};
-
-    if (json_parser_parse_object(parser, object) != 0) {
-        DS_LOG_ERROR("Failed to parse json object");
-        return_defer(1);
-    }
+    size_t len = strlen(string);
 
-    if (json_lexer_next(&parser->lexer, &token) != 0) {
-        DS_LOG_ERROR("Failed to get the next token");
+    if (json_cbor_write_head(buffer, 3, len) != 0) {
         return_defer(1);
     }
-
-    if (token.kind != JSON_TOKEN_EOF) {
-        int line, column;
-        json_lexer_pos_to_lc(&parser->lexer, token.pos, &line, &column);
-        DS_LOG_ERROR("Expected end of file but found %s at %d:%d", json_token_kind_to_string(token.kind), line, column);
+    if (json_buffer_append(buffer, string, len) != 0) {
         return_defer(1);
     }
 
@@ -3214,58 +10148,44 @@ defer:
     return result;
 }
 
-static void json_parser_free(json_parser *parser) { }
-
-static int json_object_debug_indent(json_object *object, int indent) {
+static int json_cbor_write_object(json_buffer *buffer, json_object *object) {
     int result = 0;
 
     switch (object->kind) {
     case JSON_OBJECT_STRING:
-        printf("%*s[STRING]: \'%s\'\n", indent, "", object->string);
-        break;
+        return_defer(json_cbor_write_string(buffer, object->string));
     case JSON_OBJECT_NUMBER:
-        printf("%*s[NUMBER]: %f\n", indent, "", object->number);
-        break;
+        return_defer(json_cbor_write_number(buffer, object->number));
     case JSON_OBJECT_BOOLEAN:
-        printf("%*s[BOOLEAN]: %s\n", indent, "", object->boolean == true ? "true" : "false");
-        break;
+        return_defer(json_buffer_append_be(buffer, object->boolean == true ? 0xF5 : 0xF4, 0, 0));
     case JSON_OBJECT_NULL:
-        printf("%*s[NULL]\n", indent, "");
-        break;
+        return_defer(json_buffer_append_be(buffer, 0xF6, 0, 0));
     case JSON_OBJECT_ARRAY:
-        printf("%*s[ARRAY]: [\n", indent, "");
-        for (int i = 0; i < object->array.count; i++) {
-            json_object item = {0};
-            if (ds_dynamic_array_get(&object->array, i, &item) != 0) {
-                DS_LOG_ERROR("Failed to get item from array");
-                return_defer(1);
-            }
-
-            if (json_object_debug_indent(&item, indent + JSON_OBJECT_DUMP_INDENT) != 0) {
+        if (json_cbor_write_head(buffer, 4, object->array.count) != 0) {
+            return_defer(1);
+        }
+        for (size_t i = 0; i < object->array.count; i++) {
+            if (json_cbor_write_object(buffer, (json_object *)object->array.items + i) != 0) {
                 return_defer(1);
             }
         }
-        printf("%*s]\n", indent, "");
         break;
     case JSON_OBJECT_MAP:
-        printf("%*s[MAP]: {\n", indent, "");
-        for (int i = 0; i < object->map.capacity; i++) {
-            ds_dynamic_array bucket = object->map.buckets[i];
-
-            for (int j = 0; j < bucket.count; j++) {
-                ds_hashmap_kv kv = {0};
-                if (ds_dynamic_array_get(&bucket, j, &kv) != 0) {
-                    DS_LOG_ERROR("Failed to get item from array");
-                    return_defer(1);
-                }
-
-                printf("%*s[KEY]: \'%s\'\n", indent, "", (char *)kv.key);
-                if (json_object_debug_indent((json_object*)kv.value, indent + JSON_OBJECT_DUMP_INDENT) != 0) {
-                    return_defer(1);
-                }
+        if (json_cbor_write_head(buffer, 5, ds_hashmap_count(&object->map)) != 0) {
+            return_defer(1);
+        }
+        for (size_t i = 0; i < object->map.entries.count; i++) {
+            ds_hashmap_kv *kv = (ds_hashmap_kv *)object->map.entries.items + i;
+            if (kv->key == NULL) {
+                continue;
+            }
+            if (json_cbor_write_string(buffer, (const char *)kv->key) != 0) {
+                return_defer(1);
+            }
+            if (json_cbor_write_object(buffer, (json_object *)kv->value) != 0) {
+                return_defer(1);
             }
         }
-        printf("%*s}\n", indent, "");
         break;
     }
 
@@ -3273,226 +10193,322 @@ defer:
     return result;
 }
 
-static int json_object_dump_indent(json_object *object, unsigned int indent, const char *prefix, const char *ending, ds_string_builder *sb) {
+// Marks an indefinite length in the argument of a CBOR head
+#define JSON_CBOR_INDEFINITE (~0ULL)
+
+// Read the head of a CBOR item. The argument of an indefinite length string,
+// array or map is JSON_CBOR_INDEFINITE.
+static int json_cbor_read_head(json_decoder *decoder, unsigned char *major, unsigned char *info, unsigned long long *value) {
     int result = 0;
-    unsigned int count = 0;
+    unsigned long long head = 0;
+
+    if (json_decoder_read(decoder, 1, &head) != 0) {
+        return_defer(1);
+    }
+
+    *major = (unsigned char)head >> 5;
+    *info = (unsigned char)head & 0x1F;
+
+    if (*info < 24) {
+        *value = *info;
+    } else if (*info <= 27) {
+        return_defer(json_decoder_read(decoder, 1 << (*info - 24), value));
+    } else if (*info == 31 && *major >= 2 && *major != 6) {
+        *value = JSON_CBOR_INDEFINITE;
+    } else {
+        DS_LOG_ERROR("Invalid CBOR head 0x%02X at byte %zu", (unsigned int)head, decoder->pos - 1);
+        return_defer(1);
+    }
+
+defer:
+    return result;
+}
+
+// Returns true and consumes the break byte if it is next
+static bool json_cbor_read_break(json_decoder *decoder) {
+    if (decoder->pos < decoder->size && decoder->data[decoder->pos] == 0xFF) {
+        decoder->pos += 1;
+        return true;
+    }
+    return false;
+}
+
+// Read a text string, joining the chunks of an indefinite length one
+static int json_cbor_read_text(json_decoder *decoder, unsigned char major, unsigned long long len, char **string) {
+    int result = 0;
+    json_buffer chunks = {0};
+    unsigned char info = 0;
+
+    if (major != 3) {
+        DS_LOG_ERROR("Expected a text string at byte %zu", decoder->pos - 1);
+        return_defer(1);
+    }
+
+    if (len != JSON_CBOR_INDEFINITE) {
+        return_defer(json_decoder_read_string(decoder, len, string));
+    }
+
+    // A string without chunks is empty, and still needs its terminator
+    if (json_buffer_reserve(&chunks, 0) != 0) {
+        return_defer(1);
+    }
+    chunks.data[0] = '\0';
 
-    if (prefix != NULL) {
-        if (ds_string_builder_append(sb, "%s", prefix) != 0) {
-            DS_LOG_ERROR("Failed to append string");
+    while (json_cbor_read_break(decoder) == false) {
+        if (json_cbor_read_head(decoder, &major, &info, &len) != 0) {
             return_defer(1);
         }
-    } else {
-        if (ds_string_builder_append(sb, "%*s", indent, "") != 0) {
-            DS_LOG_ERROR("Failed to append string");
+        if (major != 3 || len == JSON_CBOR_INDEFINITE || len > decoder->size - decoder->pos) {
+            DS_LOG_ERROR("Invalid text string chunk at byte %zu", decoder->pos);
+            return_defer(1);
+        }
+        if (memchr(decoder->data + decoder->pos, '\0', len) != NULL) {
+            DS_LOG_ERROR("Unsupported NUL byte in string at byte %zu", decoder->pos);
+            return_defer(1);
+        }
+        if (json_buffer_append(&chunks, (const char *)decoder->data + decoder->pos, len) != 0) {
             return_defer(1);
         }
+        decoder->pos += len;
     }
 
-    switch (object->kind) {
-    case JSON_OBJECT_STRING:
-        if (ds_string_builder_append(sb, "\"%s\"%s", object->string, ending) != 0) {
-            DS_LOG_ERROR("Failed to append string");
+    *string = chunks.data;
+    chunks = (json_buffer){0};
+
+defer:
+    json_buffer_free(&chunks);
+    return result;
+}
+
+// Returns true when the container has more items: count items for a definite
+// length, or until the break byte for an indefinite one
+static bool json_cbor_read_more(json_decoder *decoder, unsigned long long count, unsigned long long index) {
+    if (count == JSON_CBOR_INDEFINITE) {
+        return json_cbor_read_break(decoder) == false;
+    }
+    return index < count;
+}
+
+static int json_cbor_read_object(json_decoder *decoder, json_object *object) {
+    int result = 0;
+    unsigned char major = 0;
+    unsigned char info = 0;
+    unsigned long long value = 0;
+    json_object item = {.kind = JSON_OBJECT_NULL};
+    char *key = NULL;
+
+    json_object_init_null(object);
+
+    // Tags add meaning that JSON can not hold, the tagged item is read as is
+    do {
+        if (json_cbor_read_head(decoder, &major, &info, &value) != 0) {
             return_defer(1);
         }
+    } while (major == 6);
+
+    switch (major) {
+    case 0:
+        json_object_init_number(object, (double)value);
         break;
-    case JSON_OBJECT_NUMBER:
-        if (ds_string_builder_append(sb, "%f%s", object->number, ending) != 0) {
-            DS_LOG_ERROR("Failed to append string");
-            return_defer(1);
-        }
+    case 1:
+        json_object_init_number(object, -1.0 - (double)value);
         break;
-    case JSON_OBJECT_BOOLEAN:
-        if (ds_string_builder_append(sb, "%s%s", object->boolean == true ? "true" : "false", ending) != 0) {
-            DS_LOG_ERROR("Failed to append string");
+    case 3: {
+        char *string = NULL;
+        if (json_cbor_read_text(decoder, major, value, &string) != 0) {
             return_defer(1);
         }
+        *object = (json_object){.kind = JSON_OBJECT_STRING, .string = string};
         break;
-    case JSON_OBJECT_NULL:
-        if (ds_string_builder_append(sb, "null%s", ending) != 0) {
-            DS_LOG_ERROR("Failed to append string");
+    }
+    case 4:
+        if (json_decoder_enter(decoder, value == JSON_CBOR_INDEFINITE ? 0 : value) != 0) {
             return_defer(1);
         }
-        break;
-    case JSON_OBJECT_ARRAY:
-        if (ds_string_builder_append(sb, "[\n") != 0) {
-            DS_LOG_ERROR("Failed to append string");
+
+        json_object_init_array(object);
+        if (value != JSON_CBOR_INDEFINITE && value > 0 && ds_dynamic_array_reserve(&object->array, value) != 0) {
+            DS_LOG_ERROR("Failed to allocate array");
             return_defer(1);
         }
-        for (int i = 0; i < object->array.count; i++) {
-            json_object item = {0};
-            if (ds_dynamic_array_get(&object->array, i, &item) != 0) {
-                DS_LOG_ERROR("Failed to get item from array");
+        for (unsigned long long i = 0; json_cbor_read_more(decoder, value, i); i++) {
+            if (json_cbor_read_object(decoder, &item) != 0) {
                 return_defer(1);
             }
-
-            if (json_object_dump_indent(&item, indent + JSON_OBJECT_DUMP_INDENT, NULL, "", sb) != 0) {
+            if (json_decoder_push(object, &item) != 0) {
+                json_object_init_null(&item);
                 return_defer(1);
             }
-
-            if (i < object->array.count - 1) {
-                if (ds_string_builder_append(sb, ",\n") != 0) {
-                    DS_LOG_ERROR("Failed to append string");
-                    return_defer(1);
-                }
-            }
-        }
-        if (ds_string_builder_append(sb, "\n%*s]%s", indent, "", ending) != 0) {
-            DS_LOG_ERROR("Failed to append string");
-            return_defer(1);
+            json_object_init_null(&item);
         }
+
+        decoder->depth -= 1;
         break;
-    case JSON_OBJECT_MAP:
-        count = ds_hashmap_count(&object->map);
-        if (ds_string_builder_append(sb, "{\n") != 0) {
-            DS_LOG_ERROR("Failed to append string");
+    case 5:
+        if (json_decoder_enter(decoder, value == JSON_CBOR_INDEFINITE ? 0 : value * 2) != 0) {
             return_defer(1);
         }
-        for (int i = 0, index = 0; i < object->map.capacity; i++) {
-            ds_dynamic_array bucket = object->map.buckets[i];
-
-            for (int j = 0; j < bucket.count; j++) {
-                ds_hashmap_kv kv = {0};
-                if (ds_dynamic_array_get(&bucket, j, &kv) != 0) {
-                    DS_LOG_ERROR("Failed to get item from array");
-                    return_defer(1);
-                }
 
-                if (ds_string_builder_append(sb, "%*s\"%s\":", indent + JSON_OBJECT_DUMP_INDENT, "", (char *)kv.key) != 0) {
-                    DS_LOG_ERROR("Failed to append string");
-                    return_defer(1);
-                }
-                if (json_object_dump_indent((json_object*)kv.value, indent + JSON_OBJECT_DUMP_INDENT, " ", "", sb) != 0) {
-                    DS_LOG_ERROR("Failed to dump value");
-                    return_defer(1);
-                }
+        if (json_object_init_map(object) != 0) {
+            return_defer(1);
+        }
+        for (unsigned long long i = 0; json_cbor_read_more(decoder, value, i); i++) {
+            unsigned long long len = 0;
+            if (json_cbor_read_head(decoder, &major, &info, &len) != 0 ||
+                json_cbor_read_text(decoder, major, len, &key) != 0) {
+                return_defer(1);
+            }
+            if (json_cbor_read_object(decoder, &item) != 0) {
+                return_defer(1);
+            }
+            if (json_decoder_insert(object, key, &item) != 0) {
+                key = NULL;
+                return_defer(1);
+            }
+            key = NULL;
+        }
 
-                index += 1;
-                if (index < count ) {
-                    ds_string_builder_append(sb, ",\n");
-                }
+        decoder->depth -= 1;
+        break;
+    case 7:
+        switch (info) {
+        case 20:
+        case 21:
+            json_object_init_boolean(object, info == 21);
+            break;
+        case 22:
+        case 23:
+            // Both null and undefined are null in JSON
+            break;
+        case 25: {
+            // Half precision: 1 sign bit, 5 exponent bits and 10 mantissa bits.
+            // The mantissa is scaled by a power of two, which is exact.
+            unsigned int exponent = (value >> 10) & 0x1F;
+            double mantissa = value & 0x3FF;
+            double number = 0;
+            if (exponent == 0) {
+                number = mantissa / 16777216.0;
+            } else if (exponent != 31) {
+                number = (mantissa + 1024) * (double)(1u << exponent) / 33554432.0;
+            } else {
+                number = mantissa == 0 ? INFINITY : NAN;
             }
+            json_object_init_number(object, (value & 0x8000) ? -number : number);
+            break;
+        }
+        case 26: {
+            float single = 0;
+            unsigned int bits = (unsigned int)value;
+            DS_MEMCPY(&single, &bits, sizeof(single));
+            json_object_init_number(object, single);
+            break;
         }
-        if (ds_string_builder_append(sb, "\n%*s}%s", indent, "", ending) != 0) {
-            DS_LOG_ERROR("Failed to append string");
+        case 27: {
+            double number = 0;
+            DS_MEMCPY(&number, &value, sizeof(number));
+            json_object_init_number(object, number);
+            break;
+        }
+        default:
+            DS_LOG_ERROR("Unsupported CBOR simple value %u at byte %zu", info, decoder->pos - 1);
             return_defer(1);
         }
         break;
+    default:
+        DS_LOG_ERROR("Unsupported CBOR major type %u at byte %zu", major, decoder->pos - 1);
+        return_defer(1);
     }
 
 defer:
+    if (key != NULL) {
+        DS_FREE(NULL, key);
+    }
+    if (result != 0) {
+        json_object_free(&item);
+        json_object_free(object);
+        json_object_init_null(object);
+    }
     return result;
 }
 
-// Load json object from a string
+// Encode a JSON Object as CBOR
 //
-// Returns 0 if parsing successful. Returns 1 if it failed
-DSHDEF int json_object_load(char *buffer, unsigned int buffer_len, json_object *object) {
+// The integers are written in the smallest form that holds them, the floats
+// in single precision when that is exact, and the maps in insertion order. The
+// result is a single allocation of *size bytes that is handed to the caller.
+//
+// Returns 0 if dump is ok. Returns 1 if it failed
+DSHDEF int json_object_dump_cbor(json_object *object, char **buffer, size_t *size) {
     int result = 0;
-    json_lexer lexer = {0};
-    json_parser parser = {0};
-
-    json_lexer_init(&lexer, buffer, buffer_len);
-    json_parser_init(&parser, lexer);
+    json_buffer out = {0};
 
-    if (json_parser_parse(&parser, object) != 0) {
-        DS_LOG_ERROR("Failed to parse json");
+    if (json_cbor_write_object(&out, object) != 0) {
+        DS_LOG_ERROR("Failed to encode value");
         return_defer(1);
     }
 
+    *buffer = out.data;
+    *size = out.count;
+    out = (json_buffer){0};
+
 defer:
-    json_parser_free(&parser);
-    json_lexer_free(&lexer);
+    json_buffer_free(&out);
     return result;
 }
 
-// Show a debug view of the JSON AST
-//
-// Returns 0 if debug is ok. Returns 1 if it failed
-DSHDEF int json_object_debug(json_object *object) {
-    return json_object_debug_indent(object, 0);
-}
-
-// Print the JSON into a string
+// Encode a JSON Object as CBOR to a file descriptor
 //
-// Returns 0 if dump is ok. Returns 1 if it failed
-DSHDEF int json_object_dump(json_object *object, char **buffer) {
+// The output goes through a buffer of JSON_OBJECT_DUMP_FD_BUFFER_SIZE bytes
+// as in json_object_dump_fd. Returns 0 if dump is ok. Returns 1 if it failed
+DSHDEF int json_object_dump_cbor_fd(json_object *object, int fd) {
     int result = 0;
-    ds_string_builder sb = {0};
+    json_buffer out = {0};
 
-    ds_string_builder_init(&sb);
+    if (json_buffer_init_fd(&out, fd) != 0) {
+        return_defer(1);
+    }
 
-    if (json_object_dump_indent(object, 0, NULL, "\n", &sb) != 0) {
-        DS_LOG_ERROR("Failed to dump indent");
+    if (json_cbor_write_object(&out, object) != 0) {
+        DS_LOG_ERROR("Failed to encode value");
         return_defer(1);
     }
 
-    if (ds_string_builder_build(&sb, buffer) != 0) {
-        DS_LOG_ERROR("Failed to build string");
+    if (json_buffer_flush(&out, NULL, 0) != 0) {
+        DS_LOG_ERROR("Failed to flush buffer");
         return_defer(1);
     }
 
 defer:
-    ds_string_builder_free(&sb);
+    json_buffer_free(&out);
     return result;
 }
 
-// Free the JSON object
+// Decode a JSON Object from CBOR
 //
-// Returns 0 if free is ok. Returns 1 if it failed
-DSHDEF int json_object_free(json_object *object) {
+// The buffer must hold exactly one item. Definite and indefinite lengths are
+// both read, tags are skipped and undefined is read as null. Map keys must be
+// text strings, and byte strings are not supported since JSON can not hold
+// them. Integers are read into doubles, so the ones above 2^53 lose precision.
+//
+// Returns 0 if load is ok. Returns 1 if it failed
+DSHDEF int json_object_load_cbor(const char *buffer, size_t size, json_object *object) {
     int result = 0;
+    json_decoder decoder = {.data = (const unsigned char *)buffer, .size = size};
 
-    switch (object->kind) {
-    case JSON_OBJECT_STRING:
-        DS_FREE(NULL, object->string);
-        break;
-    case JSON_OBJECT_NUMBER:
-        break;
-    case JSON_OBJECT_BOOLEAN:
-        break;
-    case JSON_OBJECT_NULL:
-        break;
-    case JSON_OBJECT_ARRAY:
-        for (int i = 0; i < object->array.count; i++) {
-            json_object *item = NULL;
-            if (ds_dynamic_array_get_ref(&object->array, i, (void **)&item) != 0) {
-                DS_LOG_ERROR("Failed to get item from array");
-                return_defer(1);
-            }
-
-            if (json_object_free(item) != 0) {
-                DS_LOG_ERROR("Failed to free json object");
-                return_defer(1);
-            }
-        }
-        ds_dynamic_array_free(&object->array);
-        break;
-    case JSON_OBJECT_MAP:
-        for (int i = 0; i < object->map.capacity; i++) {
-            ds_dynamic_array bucket = object->map.buckets[i];
-
-            for (int j = 0; j < bucket.count; j++) {
-                ds_hashmap_kv kv = {0};
-                if (ds_dynamic_array_get(&bucket, j, &kv) != 0) {
-                    DS_LOG_ERROR("Failed to get item from array");
-                    return_defer(1);
-                }
+    if (json_cbor_read_object(&decoder, object) != 0) {
+        DS_LOG_ERROR("Failed to decode CBOR");
+        return_defer(1);
+    }
 
-                DS_FREE(NULL, kv.key);
-                if (json_object_free(kv.value) != 0) {
-                    DS_LOG_ERROR("Failed to free json object");
-                    return_defer(1);
-                }
-                DS_FREE(NULL, kv.value);
-            }
-        }
-        ds_hashmap_free(&object->map);
-        break;
+    if (decoder.pos != decoder.size) {
+        DS_LOG_ERROR("Unexpected data after the value at byte %zu", decoder.pos);
+        json_object_free(object);
+        json_object_init_null(object);
+        return_defer(1);
     }
 
 defer:
     return result;
 }
 
-#endif // DS_JS_IMPLEMENTATION
+#endif // DS_CB_IMPLEMENTATION
@@ -1,9 +1,28 @@
 #define DS_IO_IMPLEMENTATION
+#define DS_TP_IMPLEMENTATION
 #define DS_AP_IMPLEMENTATION
 #define DS_JS_IMPLEMENTATION
 #include "ds.h"
+#include <dirent.h>
 
-static int argparse(int argc, char **argv, char **filename) {
+// Read a count given on the command line, which must be a non-negative number
+static int parse_count(const char *name, const char *value, unsigned int *count) {
+    int result = 0;
+    char *end = NULL;
+
+    errno = 0;
+    unsigned long int number = strtoul(value, &end, 10);
+    if (value[0] < '0' || value[0] > '9' || *end != '\0' || errno != 0 || number > UINT_MAX) {
+        DS_LOG_ERROR("Invalid value for `%s`: %s", name, value);
+        return_defer(1);
+    }
+    *count = number;
+
+defer:
+    return result;
+}
+
+static int argparse(int argc, char **argv, ds_dynamic_array *inputs, char **output, char **binary, bool *lines, json_dump_options *options) {
     int result = 0;
     ds_argparse_parser argparser = {0};
 
@@ -12,64 +31,568 @@ static int argparse(int argc, char **argv, char **filename) {
     if (ds_argparse_add_argument(&argparser, (ds_argparse_options){
         .short_name = 'i',
         .long_name = "input",
-        .description = "the input file",
-        .type = ARGUMENT_TYPE_POSITIONAL,
+        .description = "the input files, or directories of input files",
+        .type = ARGUMENT_TYPE_POSITIONAL_REST,
         .required = 0,
     }) != 0) {
         DS_LOG_ERROR("Failed to add argument `input`");
         return_defer(1);
     }
 
+    if (ds_argparse_add_argument(&argparser, (ds_argparse_options){
+        .short_name = 'm',
+        .long_name = "minify",
+        .description = "write the json without whitespace",
+        .type = ARGUMENT_TYPE_FLAG,
+        .required = 0,
+    }) != 0) {
+        DS_LOG_ERROR("Failed to add argument `minify`");
+        return_defer(1);
+    }
+
+    if (ds_argparse_add_argument(&argparser, (ds_argparse_options){
+        .short_name = 'n',
+        .long_name = "indent",
+        .description = "the number of spaces used for indentation",
+        .type = ARGUMENT_TYPE_VALUE,
+        .required = 0,
+    }) != 0) {
+        DS_LOG_ERROR("Failed to add argument `indent`");
+        return_defer(1);
+    }
+
+    if (ds_argparse_add_argument(&argparser, (ds_argparse_options){
+        .short_name = 's',
+        .long_name = "sort-keys",
+        .description = "write the keys of maps in sorted order",
+        .type = ARGUMENT_TYPE_FLAG,
+        .required = 0,
+    }) != 0) {
+        DS_LOG_ERROR("Failed to add argument `sort-keys`");
+        return_defer(1);
+    }
+
+    if (ds_argparse_add_argument(&argparser, (ds_argparse_options){
+        .short_name = 'a',
+        .long_name = "ascii",
+        .description = "escape the characters outside of ascii",
+        .type = ARGUMENT_TYPE_FLAG,
+        .required = 0,
+    }) != 0) {
+        DS_LOG_ERROR("Failed to add argument `ascii`");
+        return_defer(1);
+    }
+
+    if (ds_argparse_add_argument(&argparser, (ds_argparse_options){
+        .short_name = 'c',
+        .long_name = "canonical",
+        .description = "write the canonical form of RFC 8785",
+        .type = ARGUMENT_TYPE_FLAG,
+        .required = 0,
+    }) != 0) {
+        DS_LOG_ERROR("Failed to add argument `canonical`");
+        return_defer(1);
+    }
+
+    if (ds_argparse_add_argument(&argparser, (ds_argparse_options){
+        .short_name = 'b',
+        .long_name = "binary",
+        .description = "write the binary form to this file instead of the json",
+        .type = ARGUMENT_TYPE_VALUE,
+        .required = 0,
+    }) != 0) {
+        DS_LOG_ERROR("Failed to add argument `binary`");
+        return_defer(1);
+    }
+
+    if (ds_argparse_add_argument(&argparser, (ds_argparse_options){
+        .short_name = 'j',
+        .long_name = "threads",
+        .description = "the number of threads used for large arrays and objects, or for the files of a batch",
+        .type = ARGUMENT_TYPE_VALUE,
+        .required = 0,
+    }) != 0) {
+        DS_LOG_ERROR("Failed to add argument `threads`");
+        return_defer(1);
+    }
+
+    if (ds_argparse_add_argument(&argparser, (ds_argparse_options){
+        .short_name = 'l',
+        .long_name = "lines",
+        .description = "read one json value per line and write each one as it is read",
+        .type = ARGUMENT_TYPE_FLAG,
+        .required = 0,
+    }) != 0) {
+        DS_LOG_ERROR("Failed to add argument `lines`");
+        return_defer(1);
+    }
+
+    if (ds_argparse_add_argument(&argparser, (ds_argparse_options){
+        .short_name = 'o',
+        .long_name = "output",
+        .description = "write the result of each input to this directory",
+        .type = ARGUMENT_TYPE_VALUE,
+        .required = 0,
+    }) != 0) {
+        DS_LOG_ERROR("Failed to add argument `output`");
+        return_defer(1);
+    }
+
     if (ds_argparse_parse(&argparser, argc, argv) != 0) {
         DS_LOG_ERROR("Failed to parse arguments");
         return_defer(1);
     }
 
-    *filename = ds_argparse_get_value(&argparser, "input");
+    ds_dynamic_array values = {0};
+    ds_argparse_get_values(&argparser, "input", &values);
+    for (size_t i = 0; i < values.count; i++) {
+        char *value = NULL;
+        ds_dynamic_array_get(&values, i, &value);
+        if (ds_dynamic_array_append(inputs, &value) != 0) {
+            DS_LOG_ERROR("Failed to append input");
+            return_defer(1);
+        }
+    }
+    *output = ds_argparse_get_value(&argparser, "output");
+    *binary = ds_argparse_get_value(&argparser, "binary");
+    *lines = ds_argparse_get_flag(&argparser, "lines");
+
+    json_dump_options_init(options);
+    options->minified = ds_argparse_get_flag(&argparser, "minify");
+    if (ds_argparse_get_value(&argparser, "indent") != NULL &&
+        parse_count("indent", ds_argparse_get_value(&argparser, "indent"), &options->indent) != 0) {
+        return_defer(1);
+    }
+    if (ds_argparse_get_flag(&argparser, "sort-keys")) {
+        options->key_order = JSON_DUMP_KEYS_SORTED;
+    }
+    options->ascii_only = ds_argparse_get_flag(&argparser, "ascii");
+    options->canonical = ds_argparse_get_flag(&argparser, "canonical");
+    if (ds_argparse_get_value(&argparser, "threads") != NULL &&
+        parse_count("threads", ds_argparse_get_value(&argparser, "threads"), &options->threads) != 0) {
+        return_defer(1);
+    }
 
 defer:
     ds_argparse_parser_free(&argparser);
     return result;
 }
 
-int main(int argc, char **argv) {
+static int dump_line(char *line, size_t len, const json_dump_options *options) {
     int result = 0;
-    char *filename = NULL;
-    char *buffer = NULL;
-    char *string = NULL;
-    int buffer_len;
     json_object object = {0};
 
-    if (argparse(argc, argv, &filename) != 0) {
-        DS_LOG_ERROR("Failed to parse arguments");
+    if (len > 0 && line[len - 1] == '\r') {
+        len -= 1;
+    }
+    if (len == 0) {
+        return_defer(0);
+    }
+
+    if (json_object_load(line, len, &object) != 0) {
+        DS_LOG_ERROR("Failed to parse json");
         return_defer(1);
     }
 
-    buffer_len = ds_io_read(filename, &buffer, "r");
-    if (buffer_len < 0) {
+    if (json_object_dump_fd(&object, options, STDOUT_FILENO) != 0) {
+        DS_LOG_ERROR("Failed to dump json");
+        return_defer(1);
+    }
+
+defer:
+    json_object_free(&object);
+    return result;
+}
+
+// Read one json value per line, with the reads done by another thread so
+// that each line is parsed and written while the next ones are read. Lines
+// that are split between two buffers are copied into a line buffer.
+static int dump_lines(const char *filename, const json_dump_options *options) {
+    int result = 0;
+    int fd = STDIN_FILENO;
+    ds_io_stream stream = {0};
+    ds_string_builder partial;
+    char *data = NULL;
+    size_t size = 0;
+
+    ds_string_builder_init(&partial);
+
+    if (filename != NULL) {
+        fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            DS_LOG_ERROR("Failed to open file %s: %s", filename, strerror(errno));
+            return_defer(1);
+        }
+    }
+
+    if (ds_io_stream_open(&stream, fd) != 0) {
+        return_defer(1);
+    }
+
+    for (;;) {
+        if (ds_io_stream_next(&stream, &data, &size) != 0) {
+            return_defer(1);
+        }
+        if (size == 0) {
+            break;
+        }
+
+        char *line = data;
+        char *end = data + size;
+        char *newline = NULL;
+        while ((newline = memchr(line, '\n', end - line)) != NULL) {
+            if (partial.items.count > 0) {
+                if (ds_string_builder_appendn(&partial, line, newline - line) != 0) {
+                    return_defer(1);
+                }
+                if (dump_line(partial.items.items, partial.items.count, options) != 0) {
+                    return_defer(1);
+                }
+                partial.items.count = 0;
+            } else if (dump_line(line, newline - line, options) != 0) {
+                return_defer(1);
+            }
+            line = newline + 1;
+        }
+
+        if (line < end && ds_string_builder_appendn(&partial, line, end - line) != 0) {
+            return_defer(1);
+        }
+        ds_io_stream_release(&stream);
+    }
+
+    if (dump_line(partial.items.items, partial.items.count, options) != 0) {
+        return_defer(1);
+    }
+
+defer:
+    ds_io_stream_close(&stream);
+    ds_string_builder_free(&partial);
+    if (filename != NULL && fd >= 0) {
+        close(fd);
+    }
+    return result;
+}
+
+static int load_file(const char *filename, ds_io_mapping *input, json_object *object) {
+    int result = 0;
+    json_binary binary = {0};
+    json_binary_value root = {0};
+
+    if (ds_io_map(filename, input) != 0) {
         DS_LOG_ERROR("Failed to read from file: %s", (filename == NULL) ? "stdin" : filename);
-        return_defer(-1);
+        return_defer(1);
     }
 
-    if (json_object_load(buffer, buffer_len, &object) != 0) {
+    if (input->size >= 4 && memcmp(input->data, JSON_BINARY_MAGIC, 4) == 0) {
+        if (json_binary_init(&binary, input->data, input->size) != 0 ||
+            json_binary_root(&binary, &root) != 0 ||
+            json_binary_to_object(&root, object) != 0) {
+            DS_LOG_ERROR("Failed to read binary json");
+            return_defer(1);
+        }
+    } else if (json_object_load(input->data, input->size, object) != 0) {
         DS_LOG_ERROR("Failed to parse json");
         return_defer(1);
     }
 
-    if (json_object_dump(&object, &string) != 0) {
-        DS_LOG_ERROR("Failed to dump json");
+defer:
+    return result;
+}
+
+// A file of a batch and the result of loading and writing it
+typedef struct batch_file {
+    char *input;
+    char *output; /* NULL when the input is only checked */
+    const json_dump_options *options;
+    int result;
+} batch_file;
+
+static void batch_task(void *arg) {
+    batch_file *file = (batch_file *)arg;
+    ds_io_mapping input = {0};
+    json_object object = {0};
+
+    file->result = load_file(file->input, &input, &object);
+    if (file->result == 0 && file->output != NULL) {
+        file->result = json_object_dump_file(&object, file->options, file->output);
+    }
+
+    json_object_free(&object);
+    ds_io_unmap(&input);
+}
+
+// Add a file to the batch. The output is named after the input, without the
+// extension of the compression since it is written as plain json.
+static int batch_add(ds_dynamic_array *files, const char *path, const char *output, const json_dump_options *options) {
+    int result = 0;
+    batch_file file = {.options = options};
+    const char *name = strrchr(path, '/');
+    size_t len = 0;
+
+    name = (name != NULL) ? name + 1 : path;
+    len = strlen(name);
+    if (len > 3 && strcmp(name + len - 3, ".gz") == 0) {
+        len -= 3;
+    } else if (len > 4 && strcmp(name + len - 4, ".zst") == 0) {
+        len -= 4;
+    }
+
+    file.input = DS_MALLOC(NULL, strlen(path) + 1);
+    if (file.input != NULL) {
+        memcpy(file.input, path, strlen(path) + 1);
+    }
+    if (output != NULL) {
+        size_t size = strlen(output) + len + 2;
+        file.output = DS_MALLOC(NULL, size);
+        if (file.output != NULL) {
+            snprintf(file.output, size, "%s/%.*s", output, (int)len, name);
+        }
+    }
+    if (file.input == NULL || (output != NULL && file.output == NULL)) {
+        DS_LOG_ERROR("Failed to allocate file name");
         return_defer(1);
     }
 
-    printf("%s", string);
+    if (ds_dynamic_array_append(files, &file) != 0) {
+        DS_LOG_ERROR("Failed to append file");
+        return_defer(1);
+    }
+    file = (batch_file){0};
 
 defer:
-    json_object_free(&object);
-    if (buffer != NULL) {
-        DS_FREE(NULL, buffer);
+    if (file.input != NULL) {
+        DS_FREE(NULL, file.input);
+    }
+    if (file.output != NULL) {
+        DS_FREE(NULL, file.output);
+    }
+    return result;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Add an input to the batch, or the regular files inside it in name order if
+// it is a directory
+static int batch_collect(ds_dynamic_array *files, const char *input, const char *output, const json_dump_options *options) {
+    int result = 0;
+    struct stat st;
+    DIR *dir = NULL;
+    struct dirent *entry = NULL;
+    ds_dynamic_array paths;
+
+    ds_dynamic_array_init(&paths, sizeof(char *));
+
+    if (stat(input, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return_defer(batch_add(files, input, output, options));
+    }
+
+    dir = opendir(input);
+    if (dir == NULL) {
+        DS_LOG_ERROR("Failed to open directory %s: %s", input, strerror(errno));
+        return_defer(1);
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        size_t size = strlen(input) + strlen(entry->d_name) + 2;
+        char *path = DS_MALLOC(NULL, size);
+        if (path == NULL) {
+            DS_LOG_ERROR("Failed to allocate file name");
+            return_defer(1);
+        }
+        snprintf(path, size, "%s/%s", input, entry->d_name);
+
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            DS_FREE(NULL, path);
+            continue;
+        }
+        if (ds_dynamic_array_append(&paths, &path) != 0) {
+            DS_LOG_ERROR("Failed to append file name");
+            DS_FREE(NULL, path);
+            return_defer(1);
+        }
+    }
+
+    qsort(paths.items, paths.count, sizeof(char *), compare_names);
+    for (size_t i = 0; i < paths.count; i++) {
+        if (batch_add(files, ((char **)paths.items)[i], output, options) != 0) {
+            return_defer(1);
+        }
+    }
+
+defer:
+    for (size_t i = 0; i < paths.count; i++) {
+        DS_FREE(NULL, ((char **)paths.items)[i]);
     }
-    if (string != NULL) {
-        DS_FREE(NULL, string);
+    ds_dynamic_array_free(&paths);
+    if (dir != NULL) {
+        closedir(dir);
+    }
+    return result;
+}
+
+static int compare_outputs(const void *a, const void *b) {
+    return strcmp((*(batch_file *const *)a)->output, (*(batch_file *const *)b)->output);
+}
+
+// Check that no two files of the batch are written to the same output, which
+// happens for inputs with the same name in different directories, or with and
+// without a compression extension
+static int batch_check_outputs(ds_dynamic_array *files) {
+    int result = 0;
+    batch_file **sorted = NULL;
+
+    if (files->count < 2) {
+        return_defer(0);
+    }
+
+    sorted = DS_MALLOC(NULL, files->count * sizeof(batch_file *));
+    if (sorted == NULL) {
+        DS_LOG_ERROR("Failed to allocate file names");
+        return_defer(1);
+    }
+    for (size_t i = 0; i < files->count; i++) {
+        sorted[i] = (batch_file *)files->items + i;
+    }
+    qsort(sorted, files->count, sizeof(batch_file *), compare_outputs);
+
+    for (size_t i = 1; i < files->count; i++) {
+        if (strcmp(sorted[i - 1]->output, sorted[i]->output) == 0) {
+            DS_LOG_ERROR("Both %s and %s would be written to %s", sorted[i - 1]->input, sorted[i]->input, sorted[i]->output);
+            result = 1;
+        }
     }
+
+defer:
+    if (sorted != NULL) {
+        DS_FREE(NULL, sorted);
+    }
+    return result;
+}
+
+// Load and write many files in one process on a thread pool with the given
+// number of threads, or a thread per core. Each file is written by one thread.
+// The files that fail are listed at the end, and the batch fails if any of
+// them did. Nothing is written if two files would have the same output.
+static int dump_batch(ds_dynamic_array *inputs, const char *output, const json_dump_options *options) {
+    int result = 0;
+    ds_dynamic_array files;
+    ds_thread_pool pool = {0};
+    json_dump_options file_options = *options;
+    size_t failed = 0;
+
+    file_options.threads = 1;
+
+    ds_dynamic_array_init(&files, sizeof(batch_file));
+
+    if (output != NULL && mkdir(output, 0777) != 0 && errno != EEXIST) {
+        DS_LOG_ERROR("Failed to create directory %s: %s", output, strerror(errno));
+        return_defer(1);
+    }
+
+    for (size_t i = 0; i < inputs->count; i++) {
+        if (batch_collect(&files, ((char **)inputs->items)[i], output, &file_options) != 0) {
+            return_defer(1);
+        }
+    }
+
+    if (output != NULL && batch_check_outputs(&files) != 0) {
+        return_defer(1);
+    }
+
+    if (ds_thread_pool_init(&pool, options->threads) != 0) {
+        return_defer(1);
+    }
+    for (size_t i = 0; i < files.count; i++) {
+        if (ds_thread_pool_submit(&pool, batch_task, (batch_file *)files.items + i) != 0) {
+            ((batch_file *)files.items)[i].result = 1;
+        }
+    }
+    ds_thread_pool_wait(&pool);
+
+    for (size_t i = 0; i < files.count; i++) {
+        batch_file *file = (batch_file *)files.items + i;
+        if (file->result != 0) {
+            DS_LOG_ERROR("Failed to convert %s", file->input);
+            failed += 1;
+        }
+    }
+    DS_LOG_INFO("%zu files, %zu failed", files.count, failed);
+    result = (failed > 0) ? 1 : 0;
+
+defer:
+    ds_thread_pool_free(&pool);
+    for (size_t i = 0; i < files.count; i++) {
+        batch_file *file = (batch_file *)files.items + i;
+        DS_FREE(NULL, file->input);
+        if (file->output != NULL) {
+            DS_FREE(NULL, file->output);
+        }
+    }
+    ds_dynamic_array_free(&files);
+    return result;
+}
+
+int main(int argc, char **argv) {
+    int result = 0;
+    char *filename = NULL;
+    char *output = NULL;
+    char *binary_filename = NULL;
+    bool lines = false;
+    ds_dynamic_array inputs;
+    struct stat st;
+    ds_io_mapping input = {0};
+    json_object object = {0};
+    json_dump_options options = {0};
+
+    ds_dynamic_array_init(&inputs, sizeof(char *));
+
+    if (argparse(argc, argv, &inputs, &output, &binary_filename, &lines, &options) != 0) {
+        DS_LOG_ERROR("Failed to parse arguments");
+        return_defer(1);
+    }
+    if (inputs.count > 0) {
+        filename = ((char **)inputs.items)[0];
+    }
+
+    if (inputs.count > 1 || output != NULL || (filename != NULL && stat(filename, &st) == 0 && S_ISDIR(st.st_mode))) {
+        if (binary_filename != NULL || lines) {
+            DS_LOG_ERROR("The --binary and --lines options take a single input");
+            return_defer(1);
+        }
+        return_defer(dump_batch(&inputs, output, &options));
+    }
+
+    if (lines) {
+        return_defer(dump_lines(filename, &options));
+    }
+
+    if (load_file(filename, &input, &object) != 0) {
+        return_defer(1);
+    }
+
+    if (binary_filename != NULL) {
+        if (json_object_dump_binary_file(&object, binary_filename) != 0) {
+            DS_LOG_ERROR("Failed to write binary json");
+            return_defer(1);
+        }
+        return_defer(0);
+    }
+
+    if (json_object_dump_file(&object, &options, NULL) != 0) {
+        DS_LOG_ERROR("Failed to dump json");
+        return_defer(1);
+    }
+
+defer:
+    json_object_free(&object);
+    ds_io_unmap(&input);
+    ds_dynamic_array_free(&inputs);
     return result;
 }